@@ -2,6 +2,10 @@
 
 #include "Cam.hpp"
 #include <core/libcamera_app.h>
+#include <Heli/Trace/FrameTrace.hpp>
+#include <Heli/parallel/policy.hpp>
+
+#include <chrono>
 
 namespace Heli
 {
@@ -13,10 +17,19 @@ namespace Heli
               m_right_id(0),
               m_left(new LibcameraApp()),
               m_right(new LibcameraApp()),
+              m_cameras_open(false),
+              m_sync([this](CamSync::Eye eye, CompletedRequest* request)
+                     { (eye == CamSync::LEFT ? m_left : m_right)->queueRequest(request); }),
+              m_replaying(false),
+              m_replay_pacing(Cam_ReplayPacing::REAL_TIME),
+              m_replay_repeat(false),
               tlm_dropped(0),
               tlm_captured(0),
               m_streaming(false)
     {
+        // Requests from both eyes are paired on a single thread
+        m_left->SetMessageQueue(&m_msg_queue, CamSync::LEFT);
+        m_right->SetMessageQueue(&m_msg_queue, CamSync::RIGHT);
     }
 
     void Cam::init(NATIVE_INT_TYPE instance)
@@ -24,20 +37,34 @@ namespace Heli
         CamComponentBase::init(instance);
     }
 
-    void Cam::configure(I32 left_id, I32 right_id)
+    void Cam::configure(I32 left_id, I32 right_id, U32 buffer_n)
     {
-        for (auto &buffer: m_buffers)
+        m_buffers.configure(buffer_n, [this](CompletedRequest *cr_l, CompletedRequest *cr_r)
         {
-            buffer.register_callback([this](CompletedRequest *cr_l, CompletedRequest *cr_r)
-                                     {  m_left->queueRequest(cr_l);
-                                        m_right->queueRequest(cr_r); });
-        }
+            // Replayed frames have no requests to give back
+            if (cr_l) m_left->queueRequest(cr_l);
+            if (cr_r) m_right->queueRequest(cr_r);
+        });
+
+        // Every pool buffer can hold a request from each camera
+        m_left->SetBufferCount(buffer_n);
+        m_right->SetBufferCount(buffer_n);
 
         m_left_id = left_id;
         m_right_id = right_id;
 
-        m_left->OpenCamera(m_left_id);
-        m_right->OpenCamera(m_right_id);
+        // Missing cameras are not fatal, frames may still be replayed
+        try
+        {
+            m_left->OpenCamera(m_left_id);
+            m_right->OpenCamera(m_right_id);
+            m_cameras_open = true;
+        }
+        catch (const std::exception& e)
+        {
+            Fw::Logger::logMsg("[WARNING] Failed to open cameras: %s\n", (POINTER_CAST) e.what());
+            m_cameras_open = false;
+        }
 
         m_configured = false;
     }
@@ -50,96 +77,169 @@ namespace Heli
 
     void Cam::streaming_thread()
     {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CAMERA, "cam");
         Os::Task::delay(1000);
-        Fw::LogStringArg leftId(m_left->CameraId().c_str()), rightId(m_right->CameraId().c_str());
-        Fw::Logger::logMsg("left: %s, right: %s\n",
-                           (POINTER_CAST) m_left->CameraId().c_str(),
-                           (POINTER_CAST) m_right->CameraId().c_str());
-        log_ACTIVITY_LO_CameraActivated(leftId, rightId);
+        if (m_cameras_open)
+        {
+            Fw::LogStringArg leftId(m_left->CameraId().c_str()), rightId(m_right->CameraId().c_str());
+            Fw::Logger::logMsg("left: %s, right: %s\n",
+                               (POINTER_CAST) m_left->CameraId().c_str(),
+                               (POINTER_CAST) m_right->CameraId().c_str());
+            log_ACTIVITY_LO_CameraActivated(leftId, rightId);
+        }
 
         while (true)
         {
-            // Wait for both camera to respond
-            LibcameraApp::Msg msg_l = m_left->Wait();
-            LibcameraApp::Msg msg_r = m_right->Wait();
+            // Both cameras post to the same queue
+            LibcameraApp::Msg msg = m_msg_queue.Wait();
 
             // Exit the stream thread if either of the camera request quit
-            if (msg_l.type == LibcameraApp::MsgType::Quit
-                || msg_r.type == LibcameraApp::MsgType::Quit)
+            if (msg.type == LibcameraApp::MsgType::Quit)
             {
                 break;
             }
 
-            FW_ASSERT(msg_l.type == LibcameraApp::MsgType::RequestComplete, (I32) msg_l.type);
-            FW_ASSERT(msg_r.type == LibcameraApp::MsgType::RequestComplete, (I32) msg_r.type);
-
-            tlm_captured++;
-            tlmWrite_FramesCapture(tlm_captured);
+            FW_ASSERT(msg.type == LibcameraApp::MsgType::RequestComplete, (I32) msg.type);
+            FW_ASSERT(msg.tag < CamSync::EYE_N, msg.tag);
 
-            // Get an internal frame buffer
-            CamBuffer *buffer = get_buffer();
-            if (!buffer)
+            // Requests completed before the stream was reconfigured
+            // hold frame buffers that no longer exist
+            LibcameraApp* eye = msg.tag == CamSync::LEFT ? m_left : m_right;
+            if (msg.generation != eye->Generation())
             {
-                // Ran out of frame buffers
-                tlm_dropped++;
-                tlmWrite_FramesDropped(tlm_dropped);
-                m_left->queueRequest(msg_l.payload);
-                m_right->queueRequest(msg_r.payload);
+                eye->queueRequest(msg.payload);
                 continue;
             }
 
-            buffer->left_request = msg_l.payload;
-            buffer->right_request = msg_r.payload;
-
-            libcamera::Stream* left_stream = m_left->GetStream();
-            libcamera::Stream* right_stream = m_right->GetStream();
-
-            // Get the DMA buffer
-            buffer->left_fb = msg_l.payload->buffers[left_stream];
-            buffer->right_fb = msg_r.payload->buffers[right_stream];
+            // Single stream configuration, the first buffer is the frame
+            const libcamera::FrameBuffer* fb = msg.payload->buffers.begin()->second;
 
-            // Make sure we got DMA buffers from the request
-            FW_ASSERT(buffer->left_fb);
-            FW_ASSERT(buffer->right_fb);
+            m_sync.push(static_cast<CamSync::Eye>(msg.tag),
+                        {msg.payload, fb->metadata().timestamp});
 
-            // Get the userland pointer
-            try
+            CamSync::Item left, right;
+            I64 skew;
+            while (m_sync.pop(left, right, skew))
             {
-                buffer->left_span = m_left->Mmap(buffer->left_fb)[0];
-                buffer->right_span = m_right->Mmap(buffer->right_fb)[0];
-            }
-            catch(const std::exception& e)
-            {
-                // This buffer may be old after the stream changed
-                continue;
+                tlmWrite_PairSkew(static_cast<I32>(skew / 1000));
+                frame_pair(left.request, right.request);
             }
 
-            // Stream info should be identical on both streams
-            // They are configured with identical parameters
-            buffer->info = LibcameraApp::GetStreamInfo(left_stream);
-
-            // Send the frame to the requester on the same port
-            frame_out(0, buffer->id);
+            tlmWrite_OrphansLeft(m_sync.orphans(CamSync::LEFT));
+            tlmWrite_OrphansRight(m_sync.orphans(CamSync::RIGHT));
         }
 
+        m_sync.flush();
         stop();
     }
 
-    CamBuffer *Cam::get_buffer()
+    void Cam::frame_pair(CompletedRequest* left, CompletedRequest* right)
     {
-        m_buffer_mutex.lock();
-        for (auto &buf: m_buffers)
+        tlm_captured++;
+        tlmWrite_FramesCapture(tlm_captured);
+
+        // Get an internal frame buffer
+        CamBuffer *buffer = get_buffer();
+        if (!buffer)
         {
-            if (!buf.in_use())
+            // Ran out of frame buffers
+            tlm_dropped++;
+            tlmWrite_FramesDropped(tlm_dropped);
+            m_left->queueRequest(left);
+            m_right->queueRequest(right);
+            return;
+        }
+
+        buffer->left_request = left;
+        buffer->right_request = right;
+
+        libcamera::Stream* left_stream = m_left->GetStream();
+        libcamera::Stream* right_stream = m_right->GetStream();
+
+        // Get the DMA buffer
+        buffer->left_fb = left->buffers[left_stream];
+        buffer->right_fb = right->buffers[right_stream];
+
+        // Make sure we got DMA buffers from the request
+        FW_ASSERT(buffer->left_fb);
+        FW_ASSERT(buffer->right_fb);
+
+        // Get the userland pointer
+        const LibcameraApp::MappedBuffer* left_map = m_left->Lookup(buffer->left_fb);
+        const LibcameraApp::MappedBuffer* right_map = m_right->Lookup(buffer->right_fb);
+        if (!left_map || !right_map)
+        {
+            // This buffer is from before the stream changed
+            // Give the requests back to the camera
+            buffer->decref();
+            return;
+        }
+
+        buffer->left_span = left_map->span;
+        buffer->right_span = right_map->span;
+        buffer->left_timestamp = buffer->left_fb->metadata().timestamp;
+        buffer->right_timestamp = buffer->right_fb->metadata().timestamp;
+        buffer->left_plane = left_map->fd;
+        buffer->right_plane = right_map->fd;
+
+        // Stream info should be identical on both streams
+        // They are configured with identical parameters
+        buffer->info = LibcameraApp::GetStreamInfo(left_stream);
+
+        FrameTrace::get().begin(buffer->id, buffer->left_timestamp);
+        FrameTrace::get().mark(buffer->id, FrameTrace::CAM_OUT);
+
+        // Send the frame to the requester on the same port
+        frame_out(0, buffer->id);
+    }
+
+    bool Cam::replay_frame(libcamera::Span<U8> left,
+                           libcamera::Span<U8> right,
+                           const StreamInfo& info,
+                           U64 timestamp_ns)
+    {
+        CamBuffer *buffer = get_buffer();
+        if (!buffer)
+        {
+            // Free running replay will retry this frame
+            if (m_replay_pacing == Cam_ReplayPacing::REAL_TIME)
             {
-                buf.incref();
-                m_buffer_mutex.unlock();
-                return &buf;
+                tlm_captured++;
+                tlmWrite_FramesCapture(tlm_captured);
+                tlm_dropped++;
+                tlmWrite_FramesDropped(tlm_dropped);
             }
+
+            return false;
         }
 
-        m_buffer_mutex.unlock();
-        return nullptr;
+        tlm_captured++;
+        tlmWrite_FramesCapture(tlm_captured);
+
+        buffer->left_request = nullptr;
+        buffer->right_request = nullptr;
+        buffer->left_span = left;
+        buffer->right_span = right;
+        buffer->left_timestamp = timestamp_ns;
+        buffer->right_timestamp = timestamp_ns;
+        buffer->left_plane = -1;
+        buffer->right_plane = -1;
+        buffer->info = info;
+
+        FrameTrace::get().begin(buffer->id, timestamp_ns);
+        FrameTrace::get().mark(buffer->id, FrameTrace::CAM_OUT);
+
+        frame_out(0, buffer->id);
+        return true;
+    }
+
+    CamBuffer *Cam::get_buffer()
+    {
+        CamBuffer* buffer = m_buffers.acquire();
+
+        tlmWrite_BuffersInUse(m_buffers.in_use());
+        tlmWrite_BuffersHighWater(m_buffers.high_water());
+        return buffer;
     }
 
     void Cam::start()
@@ -152,10 +252,35 @@ namespace Heli
         m_left->StopCamera();
         m_right->StopCamera();
 
+        m_replay.stop();
+
         log_ACTIVITY_LO_CameraStarting();
         m_streaming = true;
-        m_left->StartCamera();
-        m_right->StartCamera();
+
+        if (m_replaying)
+        {
+            Fw::ParamValid valid;
+            U32 frame_rate = paramGet_FRAME_RATE(valid);
+
+            m_replay.start([this](libcamera::Span<U8> left, libcamera::Span<U8> right,
+                                  const StreamInfo& info, U64 timestamp_ns)
+                           { return replay_frame(left, right, info, timestamp_ns); },
+                           frame_rate,
+                           m_replay_pacing == Cam_ReplayPacing::REAL_TIME,
+                           m_replay_repeat);
+        }
+        else
+        {
+            Fw::ParamValid valid;
+            m_sync.set_skew(static_cast<U64>(paramGet_SYNC_SKEW_US(valid)) * 1000);
+
+            // Requests completed before this point belong to the last stream
+            m_sync.set_epoch(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+
+            m_left->StartCamera();
+            m_right->StartCamera();
+        }
     }
 
     void Cam::stop()
@@ -166,6 +291,7 @@ namespace Heli
         }
 
         // Doesn't hurt to stop again
+        m_replay.stop();
         m_left->StopCamera();
         m_right->StopCamera();
     }
@@ -219,6 +345,7 @@ namespace Heli
     void Cam::quitStreamThread()
     {
         // Stop the stream
+        m_replay.stop();
         m_left->StopCamera();
         m_right->StopCamera();
 
@@ -227,6 +354,9 @@ namespace Heli
         m_right->Quit();
         m_task.join(nullptr);
 
+        // The second eye's quit message is still queued
+        m_msg_queue.Clear();
+
         m_left->CloseCamera();
         m_right->CloseCamera();
 
@@ -275,10 +405,11 @@ namespace Heli
 
     bool Cam::frameGet_handler(NATIVE_INT_TYPE portNum, U32 frameId, CamFrame &left, CamFrame &right)
     {
-        FW_ASSERT(frameId < CAMERA_BUFFER_N, frameId);
-        const auto &buf = m_buffers[frameId];
+        const CamBuffer* buf_ptr = m_buffers.at(frameId);
+        FW_ASSERT(buf_ptr, frameId);
+        const auto &buf = *buf_ptr;
 
-        if (!buf.in_use() || !buf.left_fb || !buf.right_fb)
+        if (!buf.in_use() || !buf.left_span.data() || !buf.right_span.data())
         {
             log_WARNING_LO_BufferNotInUse(frameId);
             return false;
@@ -295,8 +426,8 @@ namespace Heli
                 buf.left_span.size(),
                 buf.info.width, buf.info.height,
                 buf.info.stride,
-                buf.left_fb->metadata().timestamp / 1000,
-                buf.left_fb->planes()[0].fd.get()
+                buf.left_timestamp / 1000,
+                buf.left_plane
         );
 
         right = CamFrame(
@@ -304,8 +435,8 @@ namespace Heli
                 buf.right_span.size(),
                 buf.info.width, buf.info.height,
                 buf.info.stride,
-                buf.right_fb->metadata().timestamp / 1000,
-                buf.right_fb->planes()[0].fd.get()
+                buf.right_timestamp / 1000,
+                buf.right_plane
         );
 
         return true;
@@ -313,9 +444,10 @@ namespace Heli
 
     void Cam::incdec_handler(NATIVE_INT_TYPE portNum, U32 frameId, const ReferenceCounter& dir)
     {
-        FW_ASSERT(frameId < CAMERA_BUFFER_N, frameId);
+        CamBuffer* buf_ptr = m_buffers.at(frameId);
+        FW_ASSERT(buf_ptr, frameId);
 
-        auto &buf = m_buffers[frameId];
+        auto &buf = *buf_ptr;
         switch(dir.e)
         {
             case ReferenceCounter::INCREMENT:
@@ -350,8 +482,19 @@ namespace Heli
         m_right->CloseCamera();
         m_right->Teardown();
 
-        m_left->OpenCamera(m_left_id);
-        m_right->OpenCamera(m_right_id);
+        try
+        {
+            m_left->OpenCamera(m_left_id);
+            m_right->OpenCamera(m_right_id);
+            m_cameras_open = true;
+        }
+        catch(const std::exception& e)
+        {
+            m_cameras_open = false;
+            log_WARNING_HI_CameraOpenFailed(CamSelect::BOTH, e.what());
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
 
         try
         {
@@ -390,6 +533,48 @@ namespace Heli
 
         log_ACTIVITY_HI_CameraStreamConfiguring(width, height);
 
+        m_replaying = false;
+        m_configured = true;
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Cam::REPLAY_cmdHandler(U32 opCode, U32 cmdSeq,
+                                const Fw::CmdStringArg& pattern,
+                                Cam_ReplayPacing pacing,
+                                bool repeat)
+    {
+        stop();
+
+        // Frames in the pipeline point directly into the replay storage
+        for (const auto& buf : m_buffers)
+        {
+            if (buf.in_use())
+            {
+                log_WARNING_LO_ReplayBuffersInUse();
+                cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::BUSY);
+                return;
+            }
+        }
+
+        U32 n;
+        try
+        {
+            n = m_replay.load(pattern.toChar());
+        }
+        catch(const std::exception& e)
+        {
+            log_WARNING_HI_ReplayLoadFailed(pattern.toChar(), e.what());
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        log_ACTIVITY_HI_ReplayLoaded(pattern.toChar(), n,
+                                     m_replay.info().width,
+                                     m_replay.info().height);
+
+        m_replay_pacing = pacing;
+        m_replay_repeat = repeat;
+        m_replaying = true;
         m_configured = true;
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
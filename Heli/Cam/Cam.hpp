@@ -7,14 +7,17 @@
 #include <Heli/Cam/CamComponentAc.hpp>
 #include <Heli/Cam/CameraConfig.hpp>
 #include <Heli/Cam/CamBuffer.hpp>
+#include <Heli/Cam/CamBufferPool.hpp>
+#include <Heli/Cam/CamReplay.hpp>
+#include <Heli/Cam/CamSync.hpp>
 #include <Heli/Cam/core/completed_request.hpp>
+#include <Heli/Cam/core/libcamera_app.h>
 
 #include <queue>
 #include <mutex>
 
 namespace Heli
 {
-    class LibcameraApp;
     class Cam : public CamComponentBase
     {
     public:
@@ -23,7 +26,7 @@ namespace Heli
 
         void init(NATIVE_INT_TYPE instance);
 
-        void configure(I32 left_id, I32 right_id);
+        void configure(I32 left_id, I32 right_id, U32 buffer_n = CAMERA_BUFFER_N);
 
         void startStreamThread(const Fw::StringBase &name);
         void quitStreamThread();
@@ -45,17 +48,27 @@ namespace Heli
                                   bool l_vflip, bool r_vflip,
                                   bool l_hflip, bool r_hflip) override;
 
+        void REPLAY_cmdHandler(U32 opCode, U32 cmdSeq,
+                               const Fw::CmdStringArg& pattern,
+                               Cam_ReplayPacing pacing,
+                               bool repeat) override;
+
         CamBuffer* get_buffer();
 
         static void streaming_thread_entry(void* this_);
         void streaming_thread();
+        void frame_pair(CompletedRequest* left, CompletedRequest* right);
+
+        bool replay_frame(libcamera::Span<U8> left,
+                          libcamera::Span<U8> right,
+                          const StreamInfo& info,
+                          U64 timestamp_ns);
 
     PRIVATE:
         void start();
         void stop();
 
-        std::mutex m_buffer_mutex;
-        CamBuffer m_buffers[CAMERA_BUFFER_N];
+        CamBufferPool m_buffers;
 
         bool m_configured;
         I32 m_left_id;
@@ -63,8 +76,17 @@ namespace Heli
 
         LibcameraApp* m_left;
         LibcameraApp* m_right;
+        bool m_cameras_open;
         Os::Task m_task;
 
+        LibcameraApp::MessageQueue<LibcameraApp::Msg> m_msg_queue;
+        CamSync m_sync;
+
+        CamReplay m_replay;
+        bool m_replaying;           //!< Replay is selected over the cameras
+        Cam_ReplayPacing m_replay_pacing;
+        bool m_replay_repeat;
+
         U32 tlm_dropped;
         U32 tlm_captured;
 
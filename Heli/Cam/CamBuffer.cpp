@@ -1,4 +1,5 @@
 #include "CamBuffer.hpp"
+#include "CamBufferPool.hpp"
 
 #include <utility>
 #include "Assert.hpp"
@@ -18,24 +19,22 @@ namespace Heli
 
     void CamBuffer::decref()
     {
-        if (ref_count == 1)
+        // Only the thread dropping the last reference frees the buffer
+        I32 previous = ref_count.fetch_sub(1);
+        FW_ASSERT(previous > 0, previous);
+
+        if (previous == 1)
         {
-            // Free the frame buffer
             clear();
         }
-        else
-        {
-            ref_count--;
-        }
     }
 
     void CamBuffer::clear()
     {
-        FW_ASSERT(ref_count == 1, ref_count);
-        FW_ASSERT(left_request);
-        FW_ASSERT(right_request);
+        FW_ASSERT(ref_count == 0, ref_count);
 
         // Returns the buffer back to the camera
+        // Replayed frames are not backed by a libcamera request
         return_buffer(left_request, right_request);
 
         left_request = nullptr;
@@ -47,9 +46,19 @@ namespace Heli
         size_t s = 0;
         left_span = libcamera::Span<U8>(nullptr, s);
         right_span = libcamera::Span<U8>(nullptr, s);
-        ref_count = 0;
+
+        left_timestamp = 0;
+        right_timestamp = 0;
+        left_plane = -1;
+        right_plane = -1;
 
         invalid = false;
+
+        // Must be last, the buffer may be re-acquired immediately
+        if (m_pool)
+        {
+            m_pool->release(this);
+        }
     }
 
     bool CamBuffer::in_use() const
@@ -62,10 +71,19 @@ namespace Heli
         return_buffer = std::move(return_cb);
     }
 
+    void CamBuffer::set_pool(CamBufferPool* pool)
+    {
+        m_pool = pool;
+    }
+
     CamBuffer::CamBuffer()
     : id(0), left_request(nullptr),
     right_request(nullptr), left_fb(nullptr),
-    right_fb(nullptr), ref_count(0),
+    right_fb(nullptr),
+    left_timestamp(0), right_timestamp(0),
+    left_plane(-1), right_plane(-1),
+    m_pool(nullptr),
+    ref_count(0),
     invalid(false)
     {
     }
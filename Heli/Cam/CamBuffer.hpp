@@ -10,6 +10,8 @@
 
 namespace Heli
 {
+    class CamBufferPool;
+
     class CamBuffer
     {
     public:
@@ -27,17 +29,24 @@ namespace Heli
         libcamera::FrameBuffer* right_fb;
         libcamera::Span<U8> right_span;
 
+        U64 left_timestamp;     //!< Sensor timestamp in nanoseconds
+        U64 right_timestamp;    //!< Sensor timestamp in nanoseconds
+        I32 left_plane;         //!< DMA file descriptor, -1 if not backed by DMA
+        I32 right_plane;        //!< DMA file descriptor, -1 if not backed by DMA
+
         void incref();
         void decref();
         bool in_use() const;
         bool is_invalid() const;
 
         void register_callback(std::function<void(CompletedRequest*, CompletedRequest*)> return_cb);
+        void set_pool(CamBufferPool* pool);
 
         void invalidate();
 
     private:
         std::function<void(CompletedRequest*, CompletedRequest*)> return_buffer;
+        CamBufferPool* m_pool;
         std::atomic<I32> ref_count;
         std::atomic<bool> invalid;
 
@@ -0,0 +1,132 @@
+//
+// Created by tumbar on 4/4/23.
+//
+
+#include <Heli/Cam/CamBufferPool.hpp>
+#include <Fw/Types/Assert.hpp>
+
+namespace Heli
+{
+    CamBufferPool::CamBufferPool()
+            : m_head(pack(0, NIL)),
+              m_depth(0), m_in_use(0), m_high_water(0)
+    {
+        for (auto& next : m_next)
+        {
+            next = NIL;
+        }
+    }
+
+    void CamBufferPool::configure(U32 depth, const ReturnCallback& return_cb)
+    {
+        FW_ASSERT(depth > 0 && depth <= CAMERA_BUFFER_MAX_N, depth);
+        FW_ASSERT(m_in_use == 0, m_in_use);
+
+        m_depth = depth;
+        for (U32 i = 0; i < m_depth; i++)
+        {
+            m_buffers[i].id = i;
+            m_buffers[i].register_callback(return_cb);
+            m_buffers[i].set_pool(this);
+            m_next[i] = i + 1 < m_depth ? i + 1 : NIL;
+        }
+
+        m_head = pack(tag_of(m_head) + 1, 0);
+        m_high_water = 0;
+    }
+
+    CamBuffer* CamBufferPool::acquire()
+    {
+        U64 head = m_head.load(std::memory_order_acquire);
+        while (true)
+        {
+            U32 index = index_of(head);
+            if (index == NIL)
+            {
+                return nullptr;
+            }
+
+            U64 next = pack(tag_of(head) + 1, m_next[index].load(std::memory_order_relaxed));
+            if (m_head.compare_exchange_weak(head, next,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire))
+            {
+                U32 n = ++m_in_use;
+                U32 hw = m_high_water.load(std::memory_order_relaxed);
+                while (n > hw && !m_high_water.compare_exchange_weak(hw, n))
+                {
+                }
+
+                CamBuffer* buffer = &m_buffers[index];
+                buffer->incref();
+                return buffer;
+            }
+        }
+    }
+
+    void CamBufferPool::release(CamBuffer* buffer)
+    {
+        FW_ASSERT(buffer >= begin() && buffer < end());
+        U32 index = buffer->id;
+
+        U64 head = m_head.load(std::memory_order_relaxed);
+        do
+        {
+            m_next[index].store(index_of(head), std::memory_order_relaxed);
+        } while (!m_head.compare_exchange_weak(head, pack(tag_of(head) + 1, index),
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+
+        m_in_use--;
+    }
+
+    CamBuffer* CamBufferPool::at(U32 id)
+    {
+        if (id >= m_depth)
+        {
+            return nullptr;
+        }
+
+        return &m_buffers[id];
+    }
+
+    U32 CamBufferPool::depth() const
+    {
+        return m_depth;
+    }
+
+    U32 CamBufferPool::in_use() const
+    {
+        return m_in_use;
+    }
+
+    U32 CamBufferPool::high_water() const
+    {
+        return m_high_water;
+    }
+
+    CamBuffer* CamBufferPool::begin()
+    {
+        return &m_buffers[0];
+    }
+
+    CamBuffer* CamBufferPool::end()
+    {
+        return &m_buffers[m_depth];
+    }
+
+    U64 CamBufferPool::pack(U32 tag, U32 index)
+    {
+        return (static_cast<U64>(tag) << 32) | index;
+    }
+
+    U32 CamBufferPool::index_of(U64 head)
+    {
+        return static_cast<U32>(head & 0xFFFFFFFF);
+    }
+
+    U32 CamBufferPool::tag_of(U64 head)
+    {
+        return static_cast<U32>(head >> 32);
+    }
+}
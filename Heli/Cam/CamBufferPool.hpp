@@ -0,0 +1,74 @@
+//
+// Created by tumbar on 4/4/23.
+//
+
+#ifndef HELI_CAMBUFFERPOOL_HPP
+#define HELI_CAMBUFFERPOOL_HPP
+
+#include <CamCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+#include <Heli/Cam/CamBuffer.hpp>
+
+#include <atomic>
+#include <functional>
+
+namespace Heli
+{
+    /**
+     * Fixed storage pool of camera buffers with a runtime depth.
+     * Free buffers are kept on a lock-free stack so that the camera
+     * thread, replay thread and downstream decrefs never contend on a lock.
+     *
+     * The stack head packs a generation tag with the slot index to
+     * protect the compare-exchange from ABA when a buffer is released
+     * and re-acquired between the read and the swap.
+     */
+    class CamBufferPool
+    {
+    public:
+        using ReturnCallback = std::function<void(CompletedRequest*, CompletedRequest*)>;
+
+        CamBufferPool();
+
+        /**
+         * Size the pool and link all the buffers on the free list
+         * No buffers may be in use
+         * @param depth number of usable buffers (at most CAMERA_BUFFER_MAX_N)
+         * @param return_cb gives the camera requests back once a buffer is freed
+         */
+        void configure(U32 depth, const ReturnCallback& return_cb);
+
+        //! Pop a free buffer holding a single reference, nullptr if the pool is exhausted
+        CamBuffer* acquire();
+
+        //! Push a freed buffer back on the free list (called by CamBuffer)
+        void release(CamBuffer* buffer);
+
+        //! Buffer by id, nullptr if the id is outside the configured depth
+        CamBuffer* at(U32 id);
+
+        U32 depth() const;
+        U32 in_use() const;
+        U32 high_water() const;
+
+        CamBuffer* begin();
+        CamBuffer* end();
+
+    private:
+        static constexpr U32 NIL = 0xFFFFFFFF;
+
+        static U64 pack(U32 tag, U32 index);
+        static U32 index_of(U64 head);
+        static U32 tag_of(U64 head);
+
+        CamBuffer m_buffers[CAMERA_BUFFER_MAX_N];
+        std::atomic<U32> m_next[CAMERA_BUFFER_MAX_N];
+        std::atomic<U64> m_head;
+
+        U32 m_depth;
+        std::atomic<U32> m_in_use;
+        std::atomic<U32> m_high_water;
+    };
+}
+
+#endif //HELI_CAMBUFFERPOOL_HPP
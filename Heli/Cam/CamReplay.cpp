@@ -0,0 +1,217 @@
+//
+// Created by tumbar on 4/2/23.
+//
+
+#include <Heli/Cam/CamReplay.hpp>
+#include <Heli/parallel/policy.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <libcamera/formats.h>
+#include <opencv2/imgcodecs.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace Heli
+{
+    static bool is_tiff(const std::string& filename)
+    {
+        auto ext = filename.substr(filename.find_last_of('.') + 1);
+        return ext == "tiff" || ext == "tif";
+    }
+
+    static U64 monotonic_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    CamReplay::CamReplay()
+            : m_frame_rate(0), m_paced(false), m_loop(false),
+              m_running(false)
+    {
+    }
+
+    CamReplay::~CamReplay()
+    {
+        stop();
+    }
+
+    U32 CamReplay::load(const std::string& pattern)
+    {
+        FW_ASSERT(!m_running);
+
+        std::vector<cv::String> files;
+        cv::glob(pattern, files, false);
+
+        std::vector<std::pair<cv::Mat, cv::Mat>> images;
+        for (const auto& file: files)
+        {
+            if (is_tiff(file))
+            {
+                std::vector<cv::Mat> layers;
+                if (!cv::imreadmulti(file, layers, cv::IMREAD_GRAYSCALE) || layers.size() < 2)
+                {
+                    throw std::runtime_error("expected stereo pair in " + file);
+                }
+
+                images.emplace_back(layers[0], layers[1]);
+            }
+            else
+            {
+                // Only the left eye is used to find a pair
+                auto idx = file.rfind("left");
+                if (idx == std::string::npos)
+                {
+                    continue;
+                }
+
+                std::string right_file = file;
+                right_file.replace(idx, 4, "right");
+
+                cv::Mat left = cv::imread(file, cv::IMREAD_GRAYSCALE);
+                cv::Mat right = cv::imread(right_file, cv::IMREAD_GRAYSCALE);
+                if (left.empty() || right.empty())
+                {
+                    throw std::runtime_error("failed to read pair " + file);
+                }
+
+                images.emplace_back(left, right);
+            }
+        }
+
+        if (images.empty())
+        {
+            throw std::runtime_error("no stereo pairs match " + pattern);
+        }
+
+        StreamInfo info;
+        info.width = images[0].first.cols;
+        info.height = images[0].first.rows;
+        info.stride = info.width;
+        info.pixel_format = libcamera::formats::YUV420;
+
+        // Luma plane followed by two quarter sized chroma planes
+        size_t luma_size = info.stride * info.height;
+        size_t frame_size = luma_size + 2 * (info.stride / 2) * (info.height / 2);
+
+        std::vector<Pair> pairs(images.size());
+        for (U32 i = 0; i < images.size(); i++)
+        {
+            const cv::Mat* eyes[2] = {&images[i].first, &images[i].second};
+            std::vector<U8>* planes[2] = {&pairs[i].left, &pairs[i].right};
+
+            for (U32 eye = 0; eye < 2; eye++)
+            {
+                const cv::Mat& image = *eyes[eye];
+                if (image.cols != (I32) info.width || image.rows != (I32) info.height)
+                {
+                    throw std::runtime_error("stereo pairs must have identical dimensions");
+                }
+
+                auto& plane = *planes[eye];
+                plane.resize(frame_size);
+
+                for (I32 row = 0; row < image.rows; row++)
+                {
+                    std::memcpy(&plane[row * info.stride], image.ptr(row), info.width);
+                }
+
+                // Neutral chroma
+                std::memset(&plane[luma_size], 128, frame_size - luma_size);
+            }
+        }
+
+        m_pairs = std::move(pairs);
+        m_info = info;
+        return m_pairs.size();
+    }
+
+    void CamReplay::start(FrameCallback callback, U32 frame_rate, bool paced, bool loop)
+    {
+        stop();
+
+        FW_ASSERT(!m_pairs.empty());
+
+        m_callback = std::move(callback);
+        m_frame_rate = frame_rate;
+        m_paced = paced && frame_rate > 0;
+        m_loop = loop;
+
+        m_running = true;
+        m_thread = std::thread(&CamReplay::run, this);
+    }
+
+    void CamReplay::stop()
+    {
+        m_running = false;
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    bool CamReplay::running() const
+    {
+        return m_running;
+    }
+
+    U32 CamReplay::size() const
+    {
+        return m_pairs.size();
+    }
+
+    const StreamInfo& CamReplay::info() const
+    {
+        return m_info;
+    }
+
+    void CamReplay::run()
+    {
+        using namespace std::chrono;
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CAMERA, "replay");
+
+        auto period = m_paced ? nanoseconds(1000000000 / m_frame_rate) : nanoseconds(0);
+        auto next_frame = steady_clock::now();
+
+        U32 i = 0;
+        while (m_running)
+        {
+            if (i >= m_pairs.size())
+            {
+                if (!m_loop)
+                {
+                    break;
+                }
+
+                i = 0;
+            }
+
+            if (m_paced)
+            {
+                std::this_thread::sleep_until(next_frame);
+                next_frame += period;
+            }
+
+            auto& pair = m_pairs[i];
+            bool accepted = m_callback(
+                    libcamera::Span<U8>(pair.left.data(), pair.left.size()),
+                    libcamera::Span<U8>(pair.right.data(), pair.right.size()),
+                    m_info, monotonic_ns());
+
+            if (!accepted && !m_paced)
+            {
+                // Free running replay is throttled by the pipeline
+                // Retry this frame once a buffer frees up
+                std::this_thread::sleep_for(microseconds(200));
+                continue;
+            }
+
+            // Paced replay behaves like a real sensor and drops the frame
+            i++;
+        }
+
+        m_running = false;
+    }
+}
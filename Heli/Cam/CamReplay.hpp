@@ -0,0 +1,92 @@
+//
+// Created by tumbar on 4/2/23.
+//
+
+#ifndef HELI_CAMREPLAY_HPP
+#define HELI_CAMREPLAY_HPP
+
+#include <Fw/Types/BasicTypes.hpp>
+#include <Heli/Cam/core/stream_info.hpp>
+
+#include <libcamera/base/span.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Heli
+{
+    /**
+     * Offline stereo camera source.
+     * Streams pre-recorded stereo pairs at a fixed rate so that
+     * the frame pipeline can be exercised without camera hardware.
+     *
+     * Frames are decoded once during load() and stored as YUV420 planar
+     * buffers identical in layout to what libcamera hands us. Frames are
+     * never modified after loading, so the CamBuffer spans point directly
+     * into the replay storage without any copying.
+     */
+    class CamReplay
+    {
+    public:
+        /**
+         * Called for every replayed stereo pair
+         * Returns false if the frame could not be accepted (no free buffers)
+         */
+        using FrameCallback = std::function<bool(libcamera::Span<U8> left,
+                                                 libcamera::Span<U8> right,
+                                                 const StreamInfo& info,
+                                                 U64 timestamp_ns)>;
+
+        CamReplay();
+        ~CamReplay();
+
+        /**
+         * Decode all the stereo pairs matching a file pattern
+         * Multi-page TIFF files hold the left image on the first page
+         * and the right image on the second page (see Vis.CAPTURE).
+         * Other files are paired by replacing 'left' with 'right' in the file name.
+         * @param pattern glob pattern matching the recorded files
+         * @return number of stereo pairs loaded
+         */
+        U32 load(const std::string& pattern);
+
+        /**
+         * Start streaming the loaded frames
+         * @param callback frame sink
+         * @param frame_rate frames per second when paced
+         * @param paced true to pace to frame_rate, false to run as fast as the pipeline accepts
+         * @param loop restart from the first pair after the last one
+         */
+        void start(FrameCallback callback, U32 frame_rate, bool paced, bool loop);
+        void stop();
+
+        bool running() const;
+        U32 size() const;
+        const StreamInfo& info() const;
+
+    private:
+        void run();
+
+        struct Pair
+        {
+            std::vector<U8> left;
+            std::vector<U8> right;
+        };
+
+        std::vector<Pair> m_pairs;
+        StreamInfo m_info;
+
+        FrameCallback m_callback;
+        U32 m_frame_rate;
+        bool m_paced;
+        bool m_loop;
+
+        std::atomic<bool> m_running;
+        std::thread m_thread;
+    };
+}
+
+#endif //HELI_CAMREPLAY_HPP
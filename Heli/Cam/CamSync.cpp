@@ -0,0 +1,134 @@
+//
+// Created by tumbar on 4/3/23.
+//
+
+#include <Heli/Cam/CamSync.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <cstdlib>
+#include <utility>
+
+namespace Heli
+{
+    CamSync::CamSync(DropCallback drop)
+            : m_drop(std::move(drop)),
+              m_orphans{0},
+              m_skew(0), m_epoch(0)
+    {
+    }
+
+    void CamSync::set_skew(U64 skew_ns)
+    {
+        m_skew = skew_ns;
+    }
+
+    void CamSync::set_epoch(U64 timestamp_ns)
+    {
+        m_epoch = timestamp_ns;
+    }
+
+    void CamSync::push(Eye eye, const Item& item)
+    {
+        FW_ASSERT(eye < EYE_N, eye);
+
+        if (item.timestamp < m_epoch)
+        {
+            // Stale request from before the stream restarted
+            m_drop(eye, item.request);
+            return;
+        }
+
+        auto& pending = m_pending[eye];
+        if (pending.full())
+        {
+            // The other eye has stalled, nothing can match the oldest
+            drop(eye);
+        }
+
+        pending.push(item);
+    }
+
+    bool CamSync::pop(Item& left, Item& right, I64& skew)
+    {
+        auto& l = m_pending[LEFT];
+        auto& r = m_pending[RIGHT];
+        U64 window = m_skew;
+
+        while (!l.empty() && !r.empty())
+        {
+            I64 diff = static_cast<I64>(l.front().timestamp - r.front().timestamp);
+            if (static_cast<U64>(std::abs(diff)) <= window)
+            {
+                left = l.pop();
+                right = r.pop();
+                skew = diff;
+                return true;
+            }
+
+            // The older frame lost its partner
+            drop(diff < 0 ? LEFT : RIGHT);
+        }
+
+        return false;
+    }
+
+    void CamSync::flush()
+    {
+        for (U32 eye = 0; eye < EYE_N; eye++)
+        {
+            while (!m_pending[eye].empty())
+            {
+                m_drop(static_cast<Eye>(eye), m_pending[eye].pop().request);
+            }
+        }
+    }
+
+    U32 CamSync::orphans(Eye eye) const
+    {
+        FW_ASSERT(eye < EYE_N, eye);
+        return m_orphans[eye];
+    }
+
+    void CamSync::drop(Eye eye)
+    {
+        m_orphans[eye]++;
+        m_drop(eye, m_pending[eye].pop().request);
+    }
+
+    CamSync::Fifo::Fifo()
+            : m_buffer{}, m_head(0), n(0)
+    {
+    }
+
+    bool CamSync::Fifo::empty() const
+    {
+        return n == 0;
+    }
+
+    bool CamSync::Fifo::full() const
+    {
+        return n >= CAMERA_SYNC_QUEUE_N;
+    }
+
+    void CamSync::Fifo::push(const Item& item)
+    {
+        FW_ASSERT(!full(), n);
+        m_buffer[(m_head + n) % CAMERA_SYNC_QUEUE_N] = item;
+        n++;
+    }
+
+    CamSync::Item CamSync::Fifo::pop()
+    {
+        FW_ASSERT(!empty());
+        Item out = m_buffer[m_head];
+        m_head = (m_head + 1) % CAMERA_SYNC_QUEUE_N;
+        n--;
+        return out;
+    }
+
+    const CamSync::Item& CamSync::Fifo::front() const
+    {
+        FW_ASSERT(!empty());
+        return m_buffer[m_head];
+    }
+}
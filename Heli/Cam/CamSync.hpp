@@ -0,0 +1,113 @@
+//
+// Created by tumbar on 4/3/23.
+//
+
+#ifndef HELI_CAMSYNC_HPP
+#define HELI_CAMSYNC_HPP
+
+#include <CamCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+#include <Heli/Cam/core/completed_request.hpp>
+
+#include <atomic>
+#include <functional>
+
+namespace Heli
+{
+    /**
+     * Pairs left and right camera requests on their sensor timestamps.
+     * The cameras are free running so a dropped frame on one sensor
+     * would otherwise offset the two streams until restart.
+     *
+     * Each eye keeps a small pending queue of completed requests.
+     * The oldest request of each eye are compared, if they are within
+     * the skew window they form a pair. Otherwise the older request
+     * can never be matched (its partner was dropped) and it is orphaned.
+     */
+    class CamSync
+    {
+    public:
+        enum Eye
+        {
+            LEFT = 0,
+            RIGHT = 1,
+            EYE_N
+        };
+
+        struct Item
+        {
+            CompletedRequest* request;
+            U64 timestamp;      //!< Sensor timestamp in nanoseconds
+        };
+
+        //! Called when a request is dropped without being paired
+        using DropCallback = std::function<void(Eye eye, CompletedRequest* request)>;
+
+        explicit CamSync(DropCallback drop);
+
+        /**
+         * Set the maximum timestamp difference between a stereo pair
+         * This should be well under half the frame period
+         * Safe to call while another thread is pushing requests
+         * @param skew_ns skew window in nanoseconds
+         */
+        void set_skew(U64 skew_ns);
+
+        /**
+         * Drop all requests older than this timestamp
+         * Requests from before a stream restart should never be paired
+         * Safe to call while another thread is pushing requests
+         * @param timestamp_ns oldest accepted sensor timestamp
+         */
+        void set_epoch(U64 timestamp_ns);
+
+        /**
+         * Add a completed request to an eye's pending queue
+         * @param eye eye the request was captured on
+         * @param item completed request
+         */
+        void push(Eye eye, const Item& item);
+
+        /**
+         * Match the oldest pending requests
+         * @param left left eye request if matched
+         * @param right right eye request if matched
+         * @param skew signed timestamp difference (left - right) of the pair
+         * @return true if a pair was matched
+         */
+        bool pop(Item& left, Item& right, I64& skew);
+
+        //! Drop all pending requests
+        void flush();
+
+        U32 orphans(Eye eye) const;
+
+    private:
+        struct Fifo
+        {
+            Fifo();
+
+            bool empty() const;
+            bool full() const;
+            void push(const Item& item);
+            Item pop();
+            const Item& front() const;
+
+            Item m_buffer[CAMERA_SYNC_QUEUE_N];
+            U32 m_head;
+            U32 n;
+        };
+
+        void drop(Eye eye);
+
+        DropCallback m_drop;
+        Fifo m_pending[EYE_N];
+        U32 m_orphans[EYE_N];
+
+        // Set from the command thread, read on the streaming thread
+        std::atomic<U64> m_skew;
+        std::atomic<U64> m_epoch;
+    };
+}
+
+#endif //HELI_CAMSYNC_HPP
@@ -49,7 +49,10 @@ namespace Heli
     }
 
     LibcameraApp::LibcameraApp()
-            : stream(nullptr), controls_(controls::controls),
+            : stream(nullptr), msg_sink_(&msg_queue_), msg_tag_(0),
+              buffer_count_(CAMERA_BUFFER_N),
+              generation_(0),
+              controls_(controls::controls),
               last_timestamp_(0)
     {
         check_camera_stack();
@@ -133,7 +136,7 @@ namespace Heli
         if (vflip)
             configuration_->transform = libcamera::Transform::VFlip * configuration_->transform;
 
-        configuration_->at(0).bufferCount = CAMERA_BUFFER_N;
+        configuration_->at(0).bufferCount = buffer_count_;
 
         setupCapture();
 
@@ -151,6 +154,11 @@ namespace Heli
         }
 
         mapped_buffers_.clear();
+        mapped_index_.clear();
+
+        // Explicitly invalidate every buffer and in-flight message
+        generation_++;
+
         allocator_.reset();
         configuration_.reset();
         frame_buffers_.clear();
@@ -236,19 +244,35 @@ namespace Heli
         // called to delete it later, but we need to know not to try and re-queue it.
         completed_requests_.clear();
 
-        msg_queue_.Clear();
+        // A shared queue holds messages from other cameras
+        // Stale messages are filtered by the owner of the queue
+        if (msg_sink_ == &msg_queue_)
+            msg_queue_.Clear();
         requests_.clear();
         controls_.clear(); // no need for mutex here
     }
 
     LibcameraApp::Msg LibcameraApp::Wait()
     {
-        return msg_queue_.Wait();
+        return msg_sink_->Wait();
     }
 
     void LibcameraApp::Quit()
     {
-        msg_queue_.Post(Msg(MsgType::Quit));
+        Msg msg(MsgType::Quit);
+        msg.tag = msg_tag_;
+        msg_sink_->Post(std::move(msg));
+    }
+
+    void LibcameraApp::SetMessageQueue(MessageQueue<Msg>* queue, U32 tag)
+    {
+        msg_sink_ = queue ? queue : &msg_queue_;
+        msg_tag_ = tag;
+    }
+
+    void LibcameraApp::SetBufferCount(U32 count)
+    {
+        buffer_count_ = count;
     }
 
     void LibcameraApp::queueRequest(CompletedRequest* completed_request)
@@ -309,6 +333,23 @@ namespace Heli
         return item->second;
     }
 
+    const LibcameraApp::MappedBuffer* LibcameraApp::Lookup(const FrameBuffer* buffer) const
+    {
+        U64 cookie = buffer->cookie();
+        U32 index = static_cast<U32>(cookie & 0xFFFFFFFF);
+        if (static_cast<U32>(cookie >> 32) != generation_ || index >= mapped_index_.size())
+        {
+            return nullptr;
+        }
+
+        return &mapped_index_[index];
+    }
+
+    U32 LibcameraApp::Generation() const
+    {
+        return generation_;
+    }
+
     void LibcameraApp::SetControls(ControlList &controls)
     {
         std::lock_guard<std::mutex> lock(control_mutex_);
@@ -369,6 +410,11 @@ namespace Heli
                         buffer_size = 0;
                     }
                 }
+                // Resolve the mapping once, the hot path indexes it using the cookie
+                buffer->setCookie((static_cast<U64>(generation_) << 32) | mapped_index_.size());
+                const auto& spans = mapped_buffers_[buffer.get()];
+                mapped_index_.push_back({buffer.get(), spans[0], buffer->planes()[0].fd.get()});
+
                 frame_buffers_[stream].push(buffer.get());
             }
         }
@@ -424,7 +470,10 @@ namespace Heli
         last_timestamp_ = timestamp;
 
         // Send out the frame to the users
-        msg_queue_.Post(Msg(MsgType::RequestComplete, payload));
+        Msg msg(MsgType::RequestComplete, payload);
+        msg.tag = msg_tag_;
+        msg.generation = generation_;
+        msg_sink_->Post(std::move(msg));
     }
 
 }
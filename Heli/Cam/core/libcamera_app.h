@@ -11,6 +11,7 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
@@ -20,6 +21,7 @@
 #include <string>
 #include <thread>
 #include <variant>
+#include <vector>
 
 #include <libcamera/base/span.h>
 #include <libcamera/camera.h>
@@ -80,6 +82,50 @@ namespace Heli
 
             MsgType type;
             MsgPayload payload = nullptr;
+            U32 tag = 0;        //!< Identifies the sender on a shared queue
+            U32 generation = 0; //!< Stream configuration the request was completed on
+        };
+
+        //! Userland mapping of a DMA frame buffer
+        struct MappedBuffer
+        {
+            FrameBuffer* buffer;
+            libcamera::Span<uint8_t> span;  //!< First mapped plane
+            I32 fd;                         //!< DMA file descriptor of the first plane
+        };
+
+        template<typename T>
+        class MessageQueue
+        {
+        public:
+            template<typename U>
+            void Post(U &&msg)
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queue_.push(std::forward<U>(msg));
+                cond_.notify_one();
+            }
+
+            T Wait()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this]
+                { return !queue_.empty(); });
+                T msg = std::move(queue_.front());
+                queue_.pop();
+                return msg;
+            }
+
+            void Clear()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queue_ = {};
+            }
+
+        private:
+            std::queue<T> queue_;
+            std::mutex mutex_;
+            std::condition_variable cond_;
         };
 
         LibcameraApp();
@@ -109,10 +155,37 @@ namespace Heli
 
         void Quit();
 
+        /**
+         * Post messages to a queue shared with other cameras
+         * instead of this camera's own queue
+         * @param queue shared message queue, must outlive this camera
+         * @param tag tag attached to every message from this camera
+         */
+        void SetMessageQueue(MessageQueue<Msg>* queue, U32 tag);
+
+        /**
+         * Number of frame buffers to allocate on the next stream configuration
+         * @param count buffers per stream
+         */
+        void SetBufferCount(U32 count);
+
         Stream* GetStream(StreamInfo *info = nullptr) const;
 
         std::vector<libcamera::Span<uint8_t>> Mmap(FrameBuffer *buffer) const;
 
+        /**
+         * Constant time lookup of a frame buffer mapping using its cookie
+         * @param buffer frame buffer allocated by the current stream configuration
+         * @return mapping or nullptr if the buffer belongs to an older configuration
+         */
+        const MappedBuffer* Lookup(const FrameBuffer* buffer) const;
+
+        /**
+         * Stream configuration generation, bumped on every Teardown
+         * Buffers and messages from older generations must not be touched
+         */
+        U32 Generation() const;
+
         void SetControls(ControlList &controls);
 
         static StreamInfo GetStreamInfo(Stream const *stream);
@@ -121,40 +194,6 @@ namespace Heli
 //        std::unique_ptr<Options> options_;
 
     private:
-        template<typename T>
-        class MessageQueue
-        {
-        public:
-            template<typename U>
-            void Post(U &&msg)
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                queue_.push(std::forward<U>(msg));
-                cond_.notify_one();
-            }
-
-            T Wait()
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                cond_.wait(lock, [this]
-                { return !queue_.empty(); });
-                T msg = std::move(queue_.front());
-                queue_.pop();
-                return msg;
-            }
-
-            void Clear()
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                queue_ = {};
-            }
-
-        private:
-            std::queue<T> queue_;
-            std::mutex mutex_;
-            std::condition_variable cond_;
-        };
-
         struct PreviewItem
         {
             PreviewItem() : stream(nullptr)
@@ -190,6 +229,8 @@ namespace Heli
         bool camera_acquired_ = false;
         std::unique_ptr<CameraConfiguration> configuration_;
         std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
+        std::vector<MappedBuffer> mapped_index_;    //!< Indexed by the low half of the buffer cookie
+        std::atomic<U32> generation_;               //!< High half of the buffer cookie
         Stream* stream = nullptr;
         std::unique_ptr<FrameBufferAllocator> allocator_ = nullptr;
         std::map<Stream *, std::queue<FrameBuffer *>> frame_buffers_;
@@ -199,6 +240,9 @@ namespace Heli
         bool camera_started_ = false;
         std::mutex camera_stop_mutex_;
         MessageQueue<Msg> msg_queue_;
+        MessageQueue<Msg>* msg_sink_;
+        U32 msg_tag_;
+        U32 buffer_count_;
         // Related to the preview window.
 //        std::unique_ptr<Preview> preview_;
         std::map<int, CompletedRequestPtr> preview_completed_requests_;
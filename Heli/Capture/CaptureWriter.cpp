@@ -0,0 +1,357 @@
+//
+// Created by tumbar on 4/10/23.
+//
+
+#include <Heli/Capture/CaptureWriter.hpp>
+#include <Heli/parallel/policy.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <cstdio>
+
+namespace Heli
+{
+    static const char* extension(CaptureWriter::Format format)
+    {
+        switch (format)
+        {
+            case CaptureWriter::JPEG:
+                return ".jpg";
+            case CaptureWriter::PNG:
+                return ".png";
+            case CaptureWriter::TIFF:
+                return ".tiff";
+        }
+
+        FW_ASSERT(0, format);
+        return "";
+    }
+
+    CaptureWriter& CaptureWriter::get()
+    {
+        static CaptureWriter writer;
+        return writer;
+    }
+
+    CaptureWriter::Format CaptureWriter::format(const ImageEncoding& encoding)
+    {
+        switch (encoding.e)
+        {
+            case ImageEncoding::JPEG:
+                return JPEG;
+            case ImageEncoding::PNG:
+                return PNG;
+            case ImageEncoding::TIFF:
+                return TIFF;
+        }
+
+        FW_ASSERT(0, encoding.e);
+        return PNG;
+    }
+
+    CaptureWriter::CaptureWriter()
+            : m_depth(CAPTURE_QUEUE_DEFAULT_N), m_pending(0),
+              m_quit(false)
+    {
+        for (U32 i = CAPTURE_QUEUE_MAX_N; i > 0; i--)
+        {
+            m_free.push_back(i - 1);
+        }
+
+        m_thread = std::thread(&CaptureWriter::run, this);
+    }
+
+    CaptureWriter::~CaptureWriter()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_quit = true;
+            m_cv.notify_all();
+        }
+
+        m_thread.join();
+    }
+
+    void CaptureWriter::configure(U32 depth)
+    {
+        FW_ASSERT(depth > 0 && depth <= CAPTURE_QUEUE_MAX_N, depth);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_depth = depth;
+    }
+
+    bool CaptureWriter::submit(const cv::Mat& left, const cv::Mat& right,
+                               const std::string& path, Format format,
+                               Done done)
+    {
+        FW_ASSERT(!left.empty() || !right.empty());
+
+        U32 idx;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_pending >= m_depth)
+            {
+                return false;
+            }
+
+            idx = m_free.back();
+            m_free.pop_back();
+            m_pending++;
+        }
+
+        // The job is owned by this thread until it is queued
+        // Copying only reallocates if the frame size changed
+        Job& job = m_jobs[idx];
+        const cv::Mat* eyes[2] = {&left, &right};
+        for (U32 i = 0; i < 2; i++)
+        {
+            job.eyes[i] = !eyes[i]->empty();
+            if (job.eyes[i])
+            {
+                eyes[i]->copyTo(job.images[i]);
+            }
+        }
+
+        job.path = path;
+        job.format = format;
+        job.done = std::move(done);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queue.push_back(idx);
+        m_cv.notify_one();
+        return true;
+    }
+
+    U32 CaptureWriter::pending() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_pending;
+    }
+
+    std::string CaptureWriter::burst_path(const std::string& path, U32 index, U32 count)
+    {
+        if (count <= 1)
+        {
+            return path;
+        }
+
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "-%03u", index);
+        return path + suffix;
+    }
+
+    CaptureWriter::Result CaptureWriter::write(Job& job)
+    {
+        Result result;
+        result.ok = true;
+        result.file_n = 0;
+
+        std::string ext = extension(job.format);
+
+        try
+        {
+            if (job.eyes[0] && job.eyes[1] && job.format == TIFF)
+            {
+                // Store both images in a single tiff file
+                std::vector<cv::Mat> layers = {job.images[0], job.images[1]};
+                result.files[result.file_n++] = job.path + ext;
+                result.ok = cv::imwrite(job.path + ext, layers);
+            }
+            else if (job.eyes[0] && job.eyes[1])
+            {
+                // Store both images in separate files
+                result.files[result.file_n++] = job.path + "-left" + ext;
+                result.files[result.file_n++] = job.path + "-right" + ext;
+                result.ok = cv::imwrite(result.files[0], job.images[0]) &&
+                            cv::imwrite(result.files[1], job.images[1]);
+            }
+            else
+            {
+                result.files[result.file_n++] = job.path + ext;
+                result.ok = cv::imwrite(job.path + ext, job.images[job.eyes[0] ? 0 : 1]);
+            }
+
+            if (!result.ok)
+            {
+                result.error = "failed to write image";
+            }
+        }
+        catch (const cv::Exception& e)
+        {
+            result.ok = false;
+            result.error = e.what();
+        }
+
+        return result;
+    }
+
+    void CaptureWriter::run()
+    {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::GROUND, "capture");
+
+        while (true)
+        {
+            U32 idx;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (m_queue.empty() && !m_quit)
+                {
+                    m_cv.wait(lock);
+                }
+
+                if (m_queue.empty())
+                {
+                    break;
+                }
+
+                idx = m_queue.front();
+                m_queue.pop_front();
+            }
+
+            Job& job = m_jobs[idx];
+            Result result = write(job);
+
+            Done done = std::move(job.done);
+            job.done = nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_free.push_back(idx);
+                m_pending--;
+            }
+
+            if (done)
+            {
+                done(result);
+            }
+        }
+    }
+
+    CaptureWriter::Burst::Burst(Handlers handlers)
+            : m_handlers(std::move(handlers)),
+              m_active(false), m_format(PNG),
+              m_index(0), m_count(0)
+    {
+    }
+
+    CaptureWriter::Burst::Status CaptureWriter::Burst::start(
+            FwOpcodeType opCode, U32 cmdSeq,
+            const Fw::StringBase& location, CamSelect eye,
+            ImageEncoding encoding, U8 count)
+    {
+        if (count == 0 || count > CAPTURE_BURST_MAX_N)
+        {
+            return INVALID_COUNT;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_active)
+        {
+            return BUSY;
+        }
+
+        // Callbacks of an abandoned burst keep their own state
+        m_state = std::make_shared<State>();
+        m_state->opCode = opCode;
+        m_state->cmdSeq = cmdSeq;
+        m_state->eye = eye;
+        m_state->failed = false;
+        m_state->finished = false;
+
+        m_location = location;
+        m_format = CaptureWriter::format(encoding);
+        m_index = 0;
+        m_count = count;
+        m_progress = std::chrono::steady_clock::now();
+        m_active = true;
+        return STARTED;
+    }
+
+    bool CaptureWriter::Burst::frame(const cv::Mat& left, const cv::Mat& right)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_active)
+        {
+            return true;
+        }
+
+        std::string path = burst_path(m_location.toChar(), m_index, m_count);
+
+        // Only the requested eyes are copied out of the frame
+        cv::Mat none;
+        CamSelect eye = m_state->eye;
+        const cv::Mat& l = eye != CamSelect::RIGHT ? left : none;
+        const cv::Mat& r = eye != CamSelect::LEFT ? right : none;
+
+        bool last = m_index + 1 >= m_count;
+        std::shared_ptr<State> state = m_state;
+
+        bool queued = CaptureWriter::get().submit(
+                l, r, path, m_format,
+                [this, state, last](const Result& result) {
+                    if (result.ok)
+                    {
+                        for (U32 i = 0; i < result.file_n; i++)
+                        {
+                            CamSelect camera = state->eye;
+                            if (result.file_n > 1)
+                            {
+                                camera = i == 0 ? CamSelect::LEFT : CamSelect::RIGHT;
+                            }
+
+                            m_handlers.completed(camera, result.files[i].c_str());
+                        }
+                    }
+                    else
+                    {
+                        state->failed = true;
+                        m_handlers.failed(result.files[0].c_str(), result.error.c_str());
+                    }
+
+                    // Snapshots are written in order, the last one finishes the burst
+                    if (last)
+                    {
+                        finish(*state, !state->failed);
+                    }
+                });
+
+        if (!queued)
+        {
+            return false;
+        }
+
+        m_index++;
+        m_progress = std::chrono::steady_clock::now();
+        if (last)
+        {
+            m_active = false;
+        }
+
+        return true;
+    }
+
+    bool CaptureWriter::Burst::expired(Fw::String& location)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_active ||
+            std::chrono::steady_clock::now() - m_progress < std::chrono::milliseconds(CAPTURE_TIMEOUT_MS))
+        {
+            return false;
+        }
+
+        m_active = false;
+        location = m_location;
+        finish(*m_state, false);
+        return true;
+    }
+
+    void CaptureWriter::Burst::finish(State& state, bool ok)
+    {
+        // A burst that timed out may still finish writing its queued frames
+        if (!state.finished.exchange(true))
+        {
+            m_handlers.finished(state.opCode, state.cmdSeq, ok);
+        }
+    }
+}
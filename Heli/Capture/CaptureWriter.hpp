@@ -0,0 +1,220 @@
+//
+// Created by tumbar on 4/10/23.
+//
+
+#ifndef STEREO_HELI_CAPTUREWRITER_HPP
+#define STEREO_HELI_CAPTUREWRITER_HPP
+
+#include <CaptureCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+#include <Fw/Types/String.hpp>
+#include <Heli/Capture/ImageEncodingEnumAc.hpp>
+#include <Heli/Cam/CamSelectEnumAc.hpp>
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Heli
+{
+    /**
+     * Image capture service shared by every component that saves frames.
+     *
+     * Encoding a PNG or TIFF and writing it to disk takes hundreds of
+     * milliseconds. Components snapshot the frame into a pooled buffer
+     * and return to their frame immediately. A background thread encodes
+     * and writes the snapshots in the order they were submitted.
+     *
+     * Snapshot buffers are reused between captures so that only the
+     * first capture of a frame size allocates.
+     */
+    class CaptureWriter
+    {
+    public:
+        enum Format
+        {
+            JPEG,
+            PNG,
+            TIFF,       //!< Both eyes are stored as layers of a single file
+        };
+
+        struct Result
+        {
+            bool ok;
+            std::string files[2];   //!< Files written, left file first when eyes are split
+            U32 file_n;
+            std::string error;      //!< Failure reason if not ok
+        };
+
+        //! Called on the writer thread once a snapshot was written
+        using Done = std::function<void(const Result& result)>;
+
+        /**
+         * Frames saved by one capture command
+         *
+         * A component starts a burst from its command handler and offers
+         * it every frame. The burst copies the requested eyes, numbers the
+         * files, retries a frame while the writer queue is full and reports
+         * the command result once, after the last frame is written or when
+         * no frame could be queued for CAPTURE_TIMEOUT_MS.
+         *
+         * Every method is thread safe.
+         */
+        class Burst
+        {
+        public:
+            struct Handlers
+            {
+                //! A file of the burst was written (writer thread)
+                std::function<void(CamSelect camera, const char* file)> completed;
+
+                //! A frame of the burst failed to be written (writer thread)
+                std::function<void(const char* file, const char* error)> failed;
+
+                //! Respond to the command that started the burst
+                std::function<void(FwOpcodeType opCode, U32 cmdSeq, bool ok)> finished;
+            };
+
+            enum Status
+            {
+                STARTED,        //!< Frames are captured from now on, the response is deferred
+                INVALID_COUNT,  //!< Burst is empty or longer than CAPTURE_BURST_MAX_N
+                BUSY,           //!< Another burst is in progress
+            };
+
+            explicit Burst(Handlers handlers);
+
+            /**
+             * Start capturing the next frames
+             * @param opCode command that requested the burst
+             * @param cmdSeq command sequence that requested the burst
+             * @param location output path without the extension
+             * @param eye eyes to save
+             * @param encoding image encoding
+             * @param count frames to save
+             */
+            Status start(FwOpcodeType opCode, U32 cmdSeq,
+                         const Fw::StringBase& location, CamSelect eye,
+                         ImageEncoding encoding, U8 count);
+
+            /**
+             * Offer the current frame
+             * Nothing is copied unless a burst is in progress
+             * @param left left image
+             * @param right right image
+             * @return false if the writer was full, the burst retries on the next frame
+             */
+            bool frame(const cv::Mat& left, const cv::Mat& right);
+
+            /**
+             * Abandon a burst that could not queue a frame for CAPTURE_TIMEOUT_MS
+             * The command fails, frames already queued are still written
+             * @param location set to the requested path if the burst timed out
+             * @return true if the burst timed out
+             */
+            bool expired(Fw::String& location);
+
+        PRIVATE:
+            //! Shared with the writer callbacks of the burst
+            struct State
+            {
+                FwOpcodeType opCode;
+                U32 cmdSeq;
+                CamSelect eye;
+                std::atomic<bool> failed;       //!< Any frame failed to be written
+                std::atomic<bool> finished;     //!< Command response was sent
+            };
+
+            void finish(State& state, bool ok);
+
+            Handlers m_handlers;
+
+            std::mutex m_mutex;
+            bool m_active;
+            Fw::String m_location;
+            Format m_format;
+            U32 m_index;        //!< Next frame of the burst
+            U32 m_count;        //!< Frames in the burst
+            std::chrono::steady_clock::time_point m_progress;  //!< Start or last queued frame
+            std::shared_ptr<State> m_state;
+        };
+
+        static CaptureWriter& get();
+
+        //! Writer format of a capture command encoding
+        static Format format(const ImageEncoding& encoding);
+
+        /**
+         * Set the number of snapshots that may wait to be written
+         * Submissions fail while this many are pending
+         * @param depth queue depth, at most CAPTURE_QUEUE_MAX_N
+         */
+        void configure(U32 depth);
+
+        /**
+         * Snapshot a frame and queue it to be written
+         * An empty eye is not saved
+         * @param left left image
+         * @param right right image
+         * @param path output path without the extension
+         * @param format image encoding
+         * @param done completion callback
+         * @return false if the queue is full and nothing was captured
+         */
+        bool submit(const cv::Mat& left, const cv::Mat& right,
+                    const std::string& path, Format format,
+                    Done done);
+
+        //! Snapshots waiting to be written
+        U32 pending() const;
+
+        /**
+         * Output path of a frame in a burst
+         * Bursts of more than one frame are numbered
+         * @param path requested path
+         * @param index frame index in the burst
+         * @param count frames in the burst
+         * @return output path without the extension
+         */
+        static std::string burst_path(const std::string& path, U32 index, U32 count);
+
+        ~CaptureWriter();
+
+    PRIVATE:
+        CaptureWriter();
+
+        struct Job
+        {
+            cv::Mat images[2];      //!< Snapshot buffers, kept between captures
+            bool eyes[2];
+            std::string path;
+            Format format;
+            Done done;
+        };
+
+        void run();
+        Result write(Job& job);
+
+        Job m_jobs[CAPTURE_QUEUE_MAX_N];
+        std::vector<U32> m_free;
+        std::deque<U32> m_queue;
+        U32 m_depth;
+        U32 m_pending;              //!< Queued or being written
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_quit;
+        std::thread m_thread;
+    };
+}
+
+#endif //STEREO_HELI_CAPTUREWRITER_HPP
@@ -3,6 +3,7 @@
 //
 
 #include <Heli/Fc/Fc.hpp>
+#include <Heli/parallel/policy.hpp>
 
 namespace Heli
 {
@@ -28,6 +29,7 @@ namespace Heli
 
     void Fc::preamble()
     {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CONTROL, "fc");
         reset();
     }
 
@@ -16,26 +16,34 @@ namespace Heli
         FmComponentBase::init(instance);
     }
 
-    template<typename T, typename R = cv::Mat3f>
-    static inline R get_rotation_matrix(T rx, T ry, T rz)
+    template<typename T>
+    static inline cv::Mat3f get_rotation_matrix(T rx, T ry, T rz)
     {
         // Convert from euler angles back to rotation matrix
-        R R_x = (R(3, 3)
-                << 1, 0, 0,
+        cv::Matx33f R_x(
+                1, 0, 0,
                 0, cos(rx), -sin(rx),
                 0, sin(rx), cos(rx));
 
-        R R_y = (R(3, 3)
-                << cos(ry), 0, sin(ry),
+        cv::Matx33f R_y(
+                cos(ry), 0, sin(ry),
                 0, 1, 0,
                 -sin(ry), 0, cos(ry));
 
-        R R_z = (R(3, 3)
-                << cos(rz), -sin(rz), 0,
+        cv::Matx33f R_z(
+                cos(rz), -sin(rz), 0,
                 sin(rz), cos(rz), 0,
                 0, 0, 1);
 
-        return R_z.mul(R_y.mul(R_x));
+        // Rows in the layout Transform takes
+        cv::Matx33f R = R_z * R_y * R_x;
+        cv::Mat3f rows(3, 1);
+        for (I32 i = 0; i < 3; i++)
+        {
+            rows(i) = cv::Vec3f(R(i, 0), R(i, 1), R(i, 2));
+        }
+
+        return rows;
     }
 
     static inline
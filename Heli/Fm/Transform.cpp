@@ -3,6 +3,7 @@
 //
 
 #include "Transform.hpp"
+#include <Fw/Types/Assert.hpp>
 
 #include <utility>
 
@@ -30,46 +31,67 @@ namespace Heli
         auto status = buffer.deserialize(reinterpret_cast<U8*>(tf_raw), size, true);
         if (status != Fw::SerializeStatus::FW_SERIALIZE_OK) return status;
 
-        m_tf = (cv::Mat4f() <<
-                tf_raw[0][0], tf_raw[0][0], tf_raw[0][0],
-                tf_raw[1][0], tf_raw[1][1], tf_raw[1][2],
-                tf_raw[2][0], tf_raw[2][1], tf_raw[2][2]
-                );
+        m_tf.create(4, 1);
+        for (I32 i = 0; i < 4; i++)
+        {
+            m_tf(i) = cv::Vec4f(tf_raw[i][0], tf_raw[i][1], tf_raw[i][2], tf_raw[i][3]);
+        }
 
         return status;
     }
 
+    //! Rows of a 4x4 matrix, the layout of m_tf
+    static cv::Mat4f to_rows(const cv::Matx44f& m)
+    {
+        cv::Mat4f tf(4, 1);
+        for (I32 i = 0; i < 4; i++)
+        {
+            tf(i) = cv::Vec4f(m(i, 0), m(i, 1), m(i, 2), m(i, 3));
+        }
+
+        return tf;
+    }
+
     Transform::Transform()
     : m_valid(true),
-      m_tf(cv::Mat4f::eye(4, 4))
+      m_tf(to_rows(cv::Matx44f::eye()))
     {
     }
 
     Transform::Transform(const cv::Mat3f &r, const cv::Vec3f &t)
     : m_valid(true)
     {
-        m_tf = (cv::Mat4f() <<
+        FW_ASSERT(r.total() == 3, static_cast<NATIVE_INT_TYPE>(r.total()));
+        m_tf = to_rows(cv::Matx44f(
                 r(0)(0), r(0)(1), r(0)(2), t(0),
                 r(1)(0), r(1)(1), r(1)(2), t(1),
                 r(2)(0), r(2)(1), r(2)(2), t(2),
                 0, 0, 0, 1
-        );
+        ));
     }
 
     Transform::Transform(cv::Mat4f tf)
             : m_valid(true), m_tf(std::move(tf))
     {
+        FW_ASSERT(m_tf.total() == 4, static_cast<NATIVE_INT_TYPE>(m_tf.total()));
     }
 
     Transform Transform::inverse() const
     {
-        const cv::Mat4f& t = m_tf;
-        return Transform((cv::Mat4f() <<
-                t(0)(0), t(1)(0), t(2)(0), -t(0),
-                t(0)(1), t(1)(1), t(2)(1), -t(1),
-                t(0)(2), t(1)(2), t(2)(2), -t(2),
-                0, 0, 0, 1
-        ));
+        // [R t]^-1 = [R^T -R^T t]
+        const auto& T = *this;
+        cv::Vec3f t = T.t();
+        cv::Matx44f inv = cv::Matx44f::eye();
+        for (I32 i = 0; i < 3; i++)
+        {
+            for (I32 j = 0; j < 3; j++)
+            {
+                inv(i, j) = T(j, i);
+                inv(i, 3) -= T(j, i) * t(j);
+            }
+        }
+
+        return Transform(to_rows(inv));
     }
 
     bool Transform::is_valid() const
@@ -85,43 +107,61 @@ namespace Heli
 
     cv::Mat Transform::operator*(const cv::Vec3f &v) const
     {
-        return m_tf * cv::Vec4f(v(0), v(1), v(2), 1);
+        return *this * cv::Vec4f(v(0), v(1), v(2), 1);
     }
 
     cv::Mat Transform::operator*(const cv::Vec4f &v) const
     {
-        return m_tf * v;
+        cv::Vec4f out;
+        for (I32 i = 0; i < 4; i++)
+        {
+            out(i) = m_tf(i).dot(v);
+        }
+
+        return cv::Mat(out, true);
     }
 
     Transform Transform::operator*(const Transform &tf)
     {
-        return Transform(m_tf * tf.tf());
+        const auto& T = *this;
+        cv::Matx44f out;
+        for (I32 i = 0; i < 4; i++)
+        {
+            for (I32 j = 0; j < 4; j++)
+            {
+                out(i, j) = T(i, 0) * tf(0, j) + T(i, 1) * tf(1, j) +
+                            T(i, 2) * tf(2, j) + T(i, 3) * tf(3, j);
+            }
+        }
+
+        return Transform(to_rows(out));
     }
 
     Transform Transform::operator=(const Transform &tf)
     {
-        m_tf = tf.m_tf;
+        m_valid = tf.m_valid;
+        m_tf = tf.m_tf.clone();
         return *this;
     }
 
     cv::Mat Transform::R() const
     {
         const auto& t = *this;
-        return (cv::Mat3f(3, 3)
-                << t(0, 0), t(0, 1), t(0, 2),
+        return cv::Mat(cv::Matx33f(
+                t(0, 0), t(0, 1), t(0, 2),
                 t(1, 0), t(1, 1), t(1, 2),
-                t(2, 0), t(2, 1), t(2, 2));
+                t(2, 0), t(2, 1), t(2, 2)), true);
     }
 
     F32 Transform::operator()(I32 i, I32 j) const
     {
-        return m_tf.at<F32>(i, j);
+        return m_tf(i)(j);
     }
 
     cv::Vec3f Transform::t() const
     {
         const auto& t = *this;
-        return {t(3, 0), t(3, 1), t(3, 2)};
+        return {t(0, 3), t(1, 3), t(2, 3)};
     }
 
     Transform::Transform(const Transform &tf)
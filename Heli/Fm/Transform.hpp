@@ -9,6 +9,10 @@
 
 namespace Heli
 {
+    /**
+     * Rigid 4x4 homogeneous transform
+     * The matrix is held as four Vec4f rows, tf()(i) is row i
+     */
     class Transform : public Fw::Serializable
     {
     public:
@@ -19,7 +23,10 @@ namespace Heli
 
         explicit Transform();
         explicit Transform(bool valid);
+        //! @param r rotation as three Vec3f rows
         explicit Transform(const cv::Mat3f& r, const cv::Vec3f& t);
+
+        //! @param tf four Vec4f rows
         explicit Transform(cv::Mat4f  tf);
         Transform(const Transform& tf);
 
@@ -28,6 +35,7 @@ namespace Heli
 
         bool is_valid() const;
 
+        //! 3x3 CV_32F rotation
         cv::Mat R() const;
         cv::Vec3f t() const;
         const cv::Mat4f& tf() const { return m_tf; }
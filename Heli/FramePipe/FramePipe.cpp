@@ -3,14 +3,18 @@
 //
 
 #include <Heli/FramePipe/FramePipe.hpp>
+#include <Heli/Trace/FrameTrace.hpp>
 #include <Fw/Types/Assert.hpp>
 
 namespace Heli
 {
+    static_assert(TRACE_PIPE_STAGE_N >= FramePipe_PIPELINE_N,
+                  "Frame trace must cover every pipeline stage");
 
     FramePipe::FramePipe(const char* compName)
     : FramePipeComponentBase(compName),
-    m_pipeline_n(0), m_valid(false)
+    m_pipeline_n(0), m_valid(false),
+    m_trace_frames(0)
     {
     }
 
@@ -38,7 +42,7 @@ namespace Heli
         }
 
         auto& stage = m_pipeline[idx];
-        if (stage.inStage != -1)
+        if (stage.full())
         {
             // Perform requested action if the pipeline stage is not
             // ready for this frame yet
@@ -61,13 +65,18 @@ namespace Heli
                     return;
                 case FramePipe_ComponentType::NO_REPLY:
                     // We don't expect replies from here
-                    // This stage will always look full
                     // Send the frame anyway
                     break;
             }
         }
 
-        stage.inStage = static_cast<I32>(frameId);
+        // Frames sent to a stage with no reply are never tracked
+        if (stage.type != FramePipe_ComponentType::NO_REPLY)
+        {
+            stage.enter(frameId);
+        }
+
+        FrameTrace::get().mark(frameId, FrameTrace::PIPE, idx);
         frame_out(stage.component.e, frameId);
     }
 
@@ -76,6 +85,32 @@ namespace Heli
         m_mutex.lock();
         send_to_idx(0, frameId);
         m_mutex.unlock();
+
+        if (++m_trace_frames >= TRACE_PUBLISH_PERIOD)
+        {
+            m_trace_frames = 0;
+            publish_latency();
+        }
+    }
+
+    void FramePipe::publish_latency()
+    {
+        auto convert = [](const FrameTrace::Percentiles& p) {
+            return TraceLatency(p.p50, p.p95, p.p99);
+        };
+
+        FrameTrace& trace = FrameTrace::get();
+        tlmWrite_LatencyCamOut(convert(trace.latency(FrameTrace::CAM_OUT)));
+
+        TracePipeLatency pipe;
+        for (U32 i = 0; i < FramePipe_PIPELINE_N; i++)
+        {
+            pipe[i] = convert(trace.latency(FrameTrace::PIPE, i));
+        }
+        tlmWrite_LatencyPipe(pipe);
+
+        tlmWrite_LatencyVis(convert(trace.latency(FrameTrace::VIS_END)));
+        tlmWrite_LatencyEncoder(convert(trace.latency(FrameTrace::ENCODER)));
     }
 
     void FramePipe::frameIn_handler(NATIVE_INT_TYPE portNum, U32 frameId)
@@ -85,7 +120,7 @@ namespace Heli
         I32 stageIdx = -1;
         for (U32 i = 0; i < m_pipeline_n; i++)
         {
-            if (m_pipeline[i].inStage == static_cast<I32>(frameId))
+            if (m_pipeline[i].leave(frameId))
             {
                 stageIdx = static_cast<I32>(i);
                 break;
@@ -102,9 +137,6 @@ namespace Heli
 
         FramePipe::Stage& stage = m_pipeline[stageIdx];
 
-        // Mark this pipeline as ready
-        m_pipeline->inStage = -1;
-
         // Send waiting frame into stage if there is one
         if (!stage.queue.empty())
         {
@@ -132,8 +164,16 @@ namespace Heli
     void FramePipe::PUSH_cmdHandler(
             U32 opCode, U32 cmdSeq,
             FramePipe_Component cmp,
-            FramePipe_ComponentType cmpType)
+            FramePipe_ComponentType cmpType,
+            U8 depth)
     {
+        if (depth == 0 || depth > FramePipe_STAGE_DEPTH_N)
+        {
+            log_WARNING_LO_CheckFailed(FramePipe_CheckFailure::DEPTH);
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::VALIDATION_ERROR);
+            return;
+        }
+
         m_mutex.lock();
         if (m_pipeline_n >= FramePipe_PIPELINE_N)
         {
@@ -147,8 +187,8 @@ namespace Heli
         m_valid = false;
 
         FramePipe::Stage& stage = m_pipeline[m_pipeline_n++];
-        stage.inStage = -1;
-        stage.queue.clear();
+        stage.clear();
+        stage.depth = depth;
         stage.component = cmp;
         stage.type = cmpType;
 
@@ -218,6 +258,30 @@ namespace Heli
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
+    void FramePipe::TRACE_DUMP_cmdHandler(U32 opCode, U32 cmdSeq, const Fw::CmdStringArg& path)
+    {
+        U32 n;
+        try
+        {
+            n = FrameTrace::get().dump(path.toChar());
+        }
+        catch (const std::exception& e)
+        {
+            log_WARNING_LO_TraceDumpFailed(path, e.what());
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        log_ACTIVITY_LO_TraceDumped(n, path);
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void FramePipe::TRACE_CLEAR_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        FrameTrace::get().clear();
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
     FramePipe::Fifo::Fifo()
     : m_buffer{0}, n(0)
     {
@@ -249,6 +313,7 @@ namespace Heli
         memmove(&m_buffer[0],
                 &m_buffer[1],
                 sizeof(U32) * (FramePipe_PIPELINE_QUEUE_N - 1));
+        n--;
 
         return out;
     }
@@ -258,4 +323,43 @@ namespace Heli
         memset(m_buffer, 0, sizeof(m_buffer));
         n = 0;
     }
+
+    FramePipe::Stage::Stage()
+    : inStage{0}, inStageN(0), depth(1)
+    {
+    }
+
+    bool FramePipe::Stage::full() const
+    {
+        return inStageN >= depth;
+    }
+
+    void FramePipe::Stage::enter(U32 frameId)
+    {
+        FW_ASSERT(inStageN < FramePipe_STAGE_DEPTH_N, inStageN);
+        inStage[inStageN++] = frameId;
+    }
+
+    bool FramePipe::Stage::leave(U32 frameId)
+    {
+        for (U32 i = 0; i < inStageN; i++)
+        {
+            if (inStage[i] == frameId)
+            {
+                memmove(&inStage[i],
+                        &inStage[i + 1],
+                        sizeof(U32) * (inStageN - i - 1));
+                inStageN--;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void FramePipe::Stage::clear()
+    {
+        inStageN = 0;
+        queue.clear();
+    }
 }
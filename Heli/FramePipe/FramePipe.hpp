@@ -27,11 +27,15 @@ namespace Heli
         void CLEAR_cmdHandler(U32 opCode, U32 cmdSeq) override;
         void PUSH_cmdHandler(U32 opCode, U32 cmdSeq,
                              FramePipe_Component cmp,
-                             FramePipe_ComponentType cmpType) override;
+                             FramePipe_ComponentType cmpType,
+                             U8 depth) override;
         void CHECK_cmdHandler(U32 opCode, U32 cmdSeq) override;
         void SHOW_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void TRACE_DUMP_cmdHandler(U32 opCode, U32 cmdSeq, const Fw::CmdStringArg& path) override;
+        void TRACE_CLEAR_cmdHandler(U32 opCode, U32 cmdSeq) override;
 
         void send_to_idx(U32 idx, U32 frameId);
+        void publish_latency();
 
 
         struct Fifo
@@ -53,7 +57,16 @@ namespace Heli
 
         struct Stage
         {
-            I32 inStage = -1;
+            Stage();
+
+            bool full() const;
+            void enter(U32 frameId);
+            bool leave(U32 frameId);
+            void clear();
+
+            U32 inStage[FramePipe_STAGE_DEPTH_N];   // frames being processed, oldest first
+            U32 inStageN;
+            U32 depth;
             Fifo queue; // only for wait types
             FramePipe_Component component;
             FramePipe_ComponentType type;
@@ -61,6 +74,8 @@ namespace Heli
 
         U32 m_pipeline_n;
         bool m_valid;
+
+        U32 m_trace_frames;     //!< Frames since latency telemetry was published
     };
 }
 
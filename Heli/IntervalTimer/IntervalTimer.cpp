@@ -3,6 +3,7 @@
 //
 
 #include <Heli/IntervalTimer/IntervalTimer.hpp>
+#include <Heli/parallel/policy.hpp>
 
 #include <sys/timerfd.h>
 #include <unistd.h>
@@ -69,6 +70,7 @@ namespace Heli
     void IntervalTimer::main()
     {
         FW_ASSERT(m_running);
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CONTROL, "timer");
 
         int fd;
         struct itimerspec itval;
@@ -9,6 +9,7 @@
 #include <poll.h>
 #include "Joystick.hpp"
 #include "File.hpp"
+#include <Heli/parallel/policy.hpp>
 
 namespace Heli
 {
@@ -87,6 +88,8 @@ namespace Heli
 
     void Joystick::main_loop()
     {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CONTROL, "joystick");
+
         Fw::String path;
         path.format("/dev/input/js%d", m_joystick);
 
@@ -3,13 +3,34 @@
 //
 
 #include "Nav.hpp"
+#include <Heli/parallel/policy.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 namespace Heli
 {
+    //! Sapp positions are in metres, point clouds in centimetres
+    static const F32 POSITION_TO_CLOUD = 100.0f;
+
+    //! Default of OCCUPANCY_CELL_SIZE until the grid is reset
+    static const F32 OCCUPANCY_CELL_SIZE_DEFAULT = 20.0f;
 
     Nav::Nav(const char* compName) : NavComponentBase(compName),
-    vo(nullptr)
+    vo(nullptr),
+    m_vo_camera(),
+    m_tracking(false),
+    m_cloud_dropped(0),
+    m_grid(OCCUPANCY_CELL_SIZE_DEFAULT),
+    m_pose_warned(false),
+    m_vo_lost(false)
     {
+        for (auto& buffer : m_cloud)
+        {
+            buffer.points.create(NAV_CLOUD_POINT_MAX, 3, CV_32F);
+            buffer.queued = false;
+        }
     }
 
     void Nav::init(NATIVE_INT_TYPE queueDepth, NATIVE_INT_TYPE instance)
@@ -17,21 +38,273 @@ namespace Heli
         NavComponentBase::init(queueDepth, instance);
     }
 
+    void Nav::preamble()
+    {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::VISION, "nav");
+    }
+
     void Nav::frame_handler(NATIVE_INT_TYPE portNum, U32 frameId)
     {
+        // Camera frames are not rectified, tracking runs on the frames of a Vis TRACK stage
+        frameOut_out(0, frameId);
+    }
+
+    void Nav::stereo_handler(NATIVE_INT_TYPE portNum, const Mat& left, const Mat& right,
+                             const StereoCamera& camera)
+    {
+        if (!m_tracking)
+        {
+            return;
+        }
 
+        Vo::Camera model;
+        model.fx = camera.getfx();
+        model.fy = camera.getfy();
+        model.cx = camera.getcx();
+        model.cy = camera.getcy();
+        model.baseline = camera.getbaseline();
+        FW_ASSERT(model.fx > 0 && model.fy > 0 && model.baseline > 0);
 
-        frameOut_out(0, frameId);
+        // Tracking restarts when the Vis pipeline is rebuilt at another size
+        if (vo && (model.fx != m_vo_camera.fx || model.fy != m_vo_camera.fy ||
+                   model.cx != m_vo_camera.cx || model.cy != m_vo_camera.cy ||
+                   model.baseline != m_vo_camera.baseline))
+        {
+            log_WARNING_LO_VoCameraChanged();
+            delete vo;
+            vo = nullptr;
+        }
+
+        if (!vo)
+        {
+            vo = new Vo::System(Transform(), model);
+            m_vo_camera = model;
+            m_vo_lost = false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool tracked = vo->trackStereo(left.get(), right.get());
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        tlmWrite_VoTrackTime(static_cast<U32>(
+                std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+        tlmWrite_TrackPoints(vo->getTracked());
+        tlmWrite_VoInliers(vo->getInliers());
+
+        if (!tracked)
+        {
+            // The first frame only finds keypoints
+            if (!m_vo_lost && vo->getTracked() > 0)
+            {
+                log_WARNING_LO_VoLost(vo->getTracked(), vo->getInliers());
+                m_vo_lost = true;
+            }
+
+            return;
+        }
+
+        if (m_vo_lost)
+        {
+            log_ACTIVITY_LO_VoRecovered();
+            m_vo_lost = false;
+        }
+
+        cv::Vec3f position = vo->getPosition();
+        cv::Vec4f attitude = vo->getAttitude();
+        tlmWrite_VoPosition(Vector3(position[0], position[1], position[2]));
+        tlmWrite_VoAttitude(Quaternion(attitude[0], attitude[1], attitude[2], attitude[3]));
+
+        const cv::Matx66f& covariance = vo->getCovariance();
+        MotionCovariance diagonal;
+        for (U32 i = 0; i < MotionCovariance::SIZE; i++)
+        {
+            diagonal[i] = covariance(i, i);
+        }
+
+        tlmWrite_VoCovariance(diagonal);
+    }
+
+    void Nav::stixels_handler(NATIVE_INT_TYPE portNum, U32 frameId,
+                              const StixelDepths& depth, const StixelBases& base)
+    {
+        (void) frameId;
+        (void) base;
+
+        F32 nearest = 0;
+        U8 bin = 0;
+        for (U32 i = 0; i < StixelDepths::SIZE; i++)
+        {
+            if (depth[i] > 0 && (nearest == 0 || depth[i] < nearest))
+            {
+                nearest = depth[i];
+                bin = static_cast<U8>(i);
+            }
+        }
+
+        tlmWrite_NearestObstacle(nearest);
+        tlmWrite_NearestObstacleBin(bin);
+    }
+
+    void Nav::cloud_handler(NATIVE_INT_TYPE portNum, U32 frameId, const Mat& cloud)
+    {
+        const cv::Mat& points = cloud.get();
+        FW_ASSERT(points.type() == CV_32F && points.cols == 3, points.type(), points.cols);
+        FW_ASSERT(points.rows <= NAV_CLOUD_POINT_MAX, points.rows, NAV_CLOUD_POINT_MAX);
+
+        // The points live in the Vis arena, copy them so the pipeline is not held up
+        U32 slot = NAV_CLOUD_BUFFER_N;
+        {
+            std::lock_guard<std::mutex> lock(m_cloud_mutex);
+            for (U32 i = 0; i < NAV_CLOUD_BUFFER_N; i++)
+            {
+                if (!m_cloud[i].queued)
+                {
+                    m_cloud[i].queued = true;
+                    slot = i;
+                    break;
+                }
+            }
+
+            if (slot == NAV_CLOUD_BUFFER_N)
+            {
+                tlmWrite_CloudDropped(++m_cloud_dropped);
+                return;
+            }
+        }
+
+        if (points.rows > 0)
+        {
+            points.copyTo(m_cloud[slot].points.rowRange(0, points.rows));
+        }
+
+        cloudReady_internalInterfaceInvoke(frameId, slot, static_cast<U32>(points.rows));
+    }
+
+    void Nav::cloudReady_internalInterfaceHandler(U32 frameId, U32 slot, U32 n)
+    {
+        (void) frameId;
+        FW_ASSERT(slot < NAV_CLOUD_BUFFER_N, slot);
+
+        integrate(m_cloud[slot].points.rowRange(0, static_cast<I32>(n)));
+
+        std::lock_guard<std::mutex> lock(m_cloud_mutex);
+        m_cloud[slot].queued = false;
+    }
+
+    void Nav::integrate(const cv::Mat& points)
+    {
+        F32 nearest = 0;
+        for (I32 i = 0; i < points.rows; i++)
+        {
+            const F32* p = points.ptr<F32>(i);
+            F32 range = std::sqrt(p[0] * p[0] + p[1] * p[1]);
+            nearest = i == 0 ? range : std::min(nearest, range);
+        }
+
+        tlmWrite_CloudPoints(points.rows);
+        tlmWrite_CloudNearest(nearest);
+
+        if (!isConnected_getQuality_OutputPort(0) ||
+            getQuality_out(0) == SappQuality::INVALID)
+        {
+            if (!m_pose_warned)
+            {
+                log_WARNING_LO_OccupancyNoPose();
+                m_pose_warned = true;
+            }
+
+            return;
+        }
+
+        m_pose_warned = false;
+
+        Vector3 position = getPosition_out(0);
+        Quaternion q = getAttitude_out(0);
+
+        cv::Vec3f origin(position.getx() * POSITION_TO_CLOUD,
+                         position.gety() * POSITION_TO_CLOUD,
+                         position.getz() * POSITION_TO_CLOUD);
+
+        F32 x = q.getx(), y = q.gety(), z = q.getz(), w = q.getw();
+        cv::Matx33f R(
+                1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w),
+                2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w),
+                2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)
+        );
+
+        // Body (MECH) points into the world frame
+        m_world.create(points.rows, 3, CV_32F);
+        for (I32 i = 0; i < points.rows; i++)
+        {
+            const F32* p = points.ptr<F32>(i);
+            cv::Vec3f world = R * cv::Vec3f(p[0], p[1], p[2]) + origin;
+
+            F32* o = m_world.ptr<F32>(i);
+            o[0] = world[0];
+            o[1] = world[1];
+            o[2] = world[2];
+        }
+
+        m_grid.move(origin);
+        m_grid.insert(origin, m_world);
+
+        tlmWrite_OccupiedCells(m_grid.occupied());
+        tlmWrite_OccupancyUpdated(m_grid.updated());
     }
 
     void Nav::STOP_cmdHandler(U32 opCode, U32 cmdSeq)
     {
-        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+        delete vo;
+        vo = nullptr;
+        m_tracking = false;
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
     void Nav::TRACK_cmdHandler(U32 opCode, U32 cmdSeq)
     {
-        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+        // Frames are only passed in while the guard is held
+        // The system is created on the next frame with its camera model
+        delete vo;
+        vo = nullptr;
+        m_tracking = true;
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Nav::OCCUPANCY_RESET_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        Fw::ParamValid valid;
+        F32 cell_size = paramGet_OCCUPANCY_CELL_SIZE(valid);
+        if (cell_size <= 0)
+        {
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::VALIDATION_ERROR);
+            return;
+        }
+
+        m_grid.reset(cell_size);
+        tlmWrite_OccupiedCells(m_grid.occupied());
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Nav::OCCUPANCY_QUERY_cmdHandler(U32 opCode, U32 cmdSeq, F32 x, F32 y, F32 z)
+    {
+        cv::Vec3f position(x, y, z);
+
+        Nav_Occupancy state;
+        switch (m_grid.state(position))
+        {
+            case OccupancyGrid::FREE:
+                state = Nav_Occupancy::FREE;
+                break;
+            case OccupancyGrid::OCCUPIED:
+                state = Nav_Occupancy::OCCUPIED;
+                break;
+            default:
+                state = Nav_Occupancy::UNKNOWN;
+                break;
+        }
+
+        log_ACTIVITY_HI_OccupancyCell(x, y, z, state, m_grid.log_odds(position));
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
     Nav::~Nav()
@@ -6,8 +6,11 @@
 #define STEREO_HELI_NAV_HPP
 
 #include <Heli/Nav/NavComponentAc.hpp>
+#include <Heli/Nav/Occupancy.hpp>
 #include "Vo.hpp"
 
+#include <mutex>
+
 namespace Heli
 {
     class Nav : public NavComponentBase
@@ -23,12 +26,41 @@ namespace Heli
 
     PRIVATE:
         Vo::System* vo;
+        Vo::Camera m_vo_camera; //!< Model vo was created with
+        bool m_tracking;        //!< TRACK was sent, vo is created on the next frame
 
+        void preamble() override;
         void frame_handler(NATIVE_INT_TYPE portNum, U32 frameId) override;
+        void stixels_handler(NATIVE_INT_TYPE portNum, U32 frameId,
+                             const StixelDepths& depth, const StixelBases& base) override;
+        void cloud_handler(NATIVE_INT_TYPE portNum, U32 frameId, const Mat& cloud) override;
+        void cloudReady_internalInterfaceHandler(U32 frameId, U32 slot, U32 n) override;
+
+        //! Move the occupancy grid to the pose and insert MECH frame points
+        void integrate(const cv::Mat& points);
+        void stereo_handler(NATIVE_INT_TYPE portNum, const Mat& left, const Mat& right,
+                            const StereoCamera& camera) override;
         void STOP_cmdHandler(U32 opCode, U32 cmdSeq) override;
         void TRACK_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void OCCUPANCY_RESET_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void OCCUPANCY_QUERY_cmdHandler(U32 opCode, U32 cmdSeq, F32 x, F32 y, F32 z) override;
 
     PRIVATE:
+        //! Point clouds copied off the Vis pipeline, integrated on the Nav thread
+        struct CloudBuffer
+        {
+            cv::Mat points;     //!< NAV_CLOUD_POINT_MAX x 3 CV_32F
+            bool queued;        //!< Waiting for cloudReady, guarded by m_cloud_mutex
+        };
+
+        std::mutex m_cloud_mutex;
+        CloudBuffer m_cloud[NAV_CLOUD_BUFFER_N];
+        U32 m_cloud_dropped;
+
+        OccupancyGrid m_grid;
+        cv::Mat m_world;        //!< Last point cloud in the world frame
+        bool m_pose_warned;     //!< OccupancyNoPose was sent since the pose was last valid
+        bool m_vo_lost;         //!< VoLost was sent since the last tracked frame
     };
 }
 
@@ -0,0 +1,273 @@
+//
+// Created by tumbar on 4/14/23.
+//
+
+#include <Heli/Nav/Occupancy.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace Heli
+{
+    static_assert((NAV_OCCUPANCY_XY_N & (NAV_OCCUPANCY_XY_N - 1)) == 0,
+                  "Occupancy cells are wrapped with a mask");
+    static_assert((NAV_OCCUPANCY_Z_N & (NAV_OCCUPANCY_Z_N - 1)) == 0,
+                  "Occupancy cells are wrapped with a mask");
+
+    static const I32 s_size[3] = {NAV_OCCUPANCY_XY_N, NAV_OCCUPANCY_XY_N, NAV_OCCUPANCY_Z_N};
+
+    OccupancyGrid::OccupancyGrid(F32 cell_size)
+            : m_cell_size(0), m_inv_cell_size(0),
+              m_min(0, 0, 0), m_placed(false),
+              m_cells(CELL_N, 0), m_stamps(CELL_N, 0), m_stamp(0),
+              m_occupied(0), m_updated(0)
+    {
+        reset(cell_size);
+    }
+
+    void OccupancyGrid::reset(F32 cell_size)
+    {
+        FW_ASSERT(cell_size > 0);
+
+        m_cell_size = cell_size;
+        m_inv_cell_size = 1.0f / cell_size;
+        m_placed = false;
+
+        std::fill(m_cells.begin(), m_cells.end(), 0);
+        m_occupied = 0;
+        m_updated = 0;
+    }
+
+    cv::Vec3i OccupancyGrid::cell(const cv::Vec3f& position) const
+    {
+        return {
+                static_cast<I32>(std::floor(position[0] * m_inv_cell_size)),
+                static_cast<I32>(std::floor(position[1] * m_inv_cell_size)),
+                static_cast<I32>(std::floor(position[2] * m_inv_cell_size)),
+        };
+    }
+
+    bool OccupancyGrid::inside(const cv::Vec3i& c) const
+    {
+        // Unsigned compare folds both bounds into one
+        return static_cast<U32>(c[0] - m_min[0]) < static_cast<U32>(NAV_OCCUPANCY_XY_N) &&
+               static_cast<U32>(c[1] - m_min[1]) < static_cast<U32>(NAV_OCCUPANCY_XY_N) &&
+               static_cast<U32>(c[2] - m_min[2]) < static_cast<U32>(NAV_OCCUPANCY_Z_N);
+    }
+
+    U32 OccupancyGrid::index(const cv::Vec3i& c)
+    {
+        // World cells wrap around the ring buffer
+        U32 x = static_cast<U32>(c[0]) & XY_MASK;
+        U32 y = static_cast<U32>(c[1]) & XY_MASK;
+        U32 z = static_cast<U32>(c[2]) & Z_MASK;
+        return (z * NAV_OCCUPANCY_XY_N + y) * NAV_OCCUPANCY_XY_N + x;
+    }
+
+    void OccupancyGrid::clear_slab(I32 axis, I32 value)
+    {
+        // Only the fixed axis is restricted to the slab
+        I32 lo[3] = {0, 0, 0};
+        I32 hi[3] = {s_size[0], s_size[1], s_size[2]};
+        lo[axis] = value & (s_size[axis] - 1);
+        hi[axis] = lo[axis] + 1;
+
+        for (I32 z = lo[2]; z < hi[2]; z++)
+        {
+            for (I32 y = lo[1]; y < hi[1]; y++)
+            {
+                for (I32 x = lo[0]; x < hi[0]; x++)
+                {
+                    I8& v = m_cells[index(cv::Vec3i(x, y, z))];
+                    if (v > NAV_OCCUPANCY_OCCUPIED) m_occupied--;
+                    v = 0;
+                }
+            }
+        }
+    }
+
+    void OccupancyGrid::move(const cv::Vec3f& position)
+    {
+        cv::Vec3i center = cell(position);
+        cv::Vec3i min(center[0] - NAV_OCCUPANCY_XY_N / 2,
+                      center[1] - NAV_OCCUPANCY_XY_N / 2,
+                      center[2] - NAV_OCCUPANCY_Z_N / 2);
+
+        if (!m_placed)
+        {
+            m_min = min;
+            m_placed = true;
+            return;
+        }
+
+        for (I32 a = 0; a < 3; a++)
+        {
+            I32 delta = min[a] - m_min[a];
+            if (std::abs(delta) >= s_size[a])
+            {
+                // Nothing of the old window is left
+                reset(m_cell_size);
+                m_min = min;
+                m_placed = true;
+                return;
+            }
+
+            // Cells entering the window reuse the storage of the cells leaving it
+            if (delta > 0)
+            {
+                for (I32 v = m_min[a] + s_size[a]; v < min[a] + s_size[a]; v++) clear_slab(a, v);
+            }
+            else
+            {
+                for (I32 v = min[a]; v < m_min[a]; v++) clear_slab(a, v);
+            }
+
+            m_min[a] = min[a];
+        }
+    }
+
+    void OccupancyGrid::update(const cv::Vec3i& c, I32 delta)
+    {
+        if (!inside(c))
+        {
+            return;
+        }
+
+        U32 i = index(c);
+        if (m_stamps[i] == m_stamp)
+        {
+            return;
+        }
+
+        m_stamps[i] = m_stamp;
+
+        // Saturated cells do not change
+        I32 old = m_cells[i];
+        I32 v = std::max<I32>(NAV_OCCUPANCY_MIN, std::min<I32>(NAV_OCCUPANCY_MAX, old + delta));
+        if (v == old)
+        {
+            return;
+        }
+
+        m_cells[i] = static_cast<I8>(v);
+        m_updated++;
+
+        if (old > NAV_OCCUPANCY_OCCUPIED && v <= NAV_OCCUPANCY_OCCUPIED) m_occupied--;
+        else if (old <= NAV_OCCUPANCY_OCCUPIED && v > NAV_OCCUPANCY_OCCUPIED) m_occupied++;
+    }
+
+    void OccupancyGrid::march(const cv::Vec3f& from, const cv::Vec3f& to)
+    {
+        // Amanatides & Woo voxel traversal
+        cv::Vec3i c = cell(from);
+        const cv::Vec3i end = cell(to);
+        const cv::Vec3f d = to - from;
+
+        I32 step[3];
+        F32 t_max[3];
+        F32 t_delta[3];
+        const F32 inf = std::numeric_limits<F32>::infinity();
+
+        for (I32 a = 0; a < 3; a++)
+        {
+            if (d[a] > 0)
+            {
+                step[a] = 1;
+                t_max[a] = (static_cast<F32>(c[a] + 1) * m_cell_size - from[a]) / d[a];
+                t_delta[a] = m_cell_size / d[a];
+            }
+            else if (d[a] < 0)
+            {
+                step[a] = -1;
+                t_max[a] = (static_cast<F32>(c[a]) * m_cell_size - from[a]) / d[a];
+                t_delta[a] = -m_cell_size / d[a];
+            }
+            else
+            {
+                step[a] = 0;
+                t_max[a] = inf;
+                t_delta[a] = inf;
+            }
+        }
+
+        // A ray crosses at most every cell of the window once per axis
+        const I32 max_steps = 2 * NAV_OCCUPANCY_XY_N + NAV_OCCUPANCY_Z_N;
+        for (I32 i = 0; i < max_steps && c != end; i++)
+        {
+            // The sensor is inside the window, a ray never comes back once it leaves
+            if (!inside(c))
+            {
+                return;
+            }
+
+            update(c, NAV_OCCUPANCY_MISS);
+
+            I32 a = t_max[0] < t_max[1] ?
+                    (t_max[0] < t_max[2] ? 0 : 2) :
+                    (t_max[1] < t_max[2] ? 1 : 2);
+
+            if (t_max[a] > 1)
+            {
+                // Rounding left the end cell one step away
+                return;
+            }
+
+            c[a] += step[a];
+            t_max[a] += t_delta[a];
+        }
+    }
+
+    void OccupancyGrid::insert(const cv::Vec3f& origin, const cv::Mat& points)
+    {
+        FW_ASSERT(points.empty() || (points.cols == 3 && points.type() == CV_32F),
+                  points.cols, points.type());
+
+        if (!m_placed)
+        {
+            move(origin);
+        }
+
+        // Stamps only repeat after every cell was cleared
+        if (++m_stamp == 0)
+        {
+            std::fill(m_stamps.begin(), m_stamps.end(), 0);
+            m_stamp = 1;
+        }
+
+        m_updated = 0;
+
+        // Hits first so that rays through a point's cell do not carve it out
+        for (I32 i = 0; i < points.rows; i++)
+        {
+            const F32* p = points.ptr<F32>(i);
+            update(cell(cv::Vec3f(p[0], p[1], p[2])), NAV_OCCUPANCY_HIT);
+        }
+
+        for (I32 i = 0; i < points.rows; i++)
+        {
+            const F32* p = points.ptr<F32>(i);
+            march(origin, cv::Vec3f(p[0], p[1], p[2]));
+        }
+    }
+
+    OccupancyGrid::State OccupancyGrid::state(const cv::Vec3f& position) const
+    {
+        I8 v = log_odds(position);
+        if (v > NAV_OCCUPANCY_OCCUPIED) return OCCUPIED;
+        if (v < NAV_OCCUPANCY_FREE) return FREE;
+        return UNKNOWN;
+    }
+
+    I8 OccupancyGrid::log_odds(const cv::Vec3f& position) const
+    {
+        cv::Vec3i c = cell(position);
+        if (!m_placed || !inside(c))
+        {
+            return 0;
+        }
+
+        return m_cells[index(c)];
+    }
+}
@@ -0,0 +1,111 @@
+//
+// Created by tumbar on 4/14/23.
+//
+
+#ifndef STEREO_HELI_OCCUPANCY_HPP
+#define STEREO_HELI_OCCUPANCY_HPP
+
+#include <NavCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+namespace Heli
+{
+    /**
+     * Rolling 3D occupancy grid around the vehicle.
+     *
+     * Cells hold saturated log-odds of being occupied. The grid covers a
+     * fixed window of world cells centered on the vehicle and is stored
+     * as a ring buffer: a world cell always lives at its coordinates
+     * modulo the grid size. Moving the window only clears the slabs of
+     * cells that enter it, nothing is copied.
+     *
+     * Queries are a single array lookup. Cells outside the window are
+     * unknown.
+     */
+    class OccupancyGrid
+    {
+    public:
+        enum State
+        {
+            UNKNOWN,
+            FREE,
+            OCCUPIED,
+        };
+
+        /**
+         * @param cell_size cell edge length in point units
+         */
+        explicit OccupancyGrid(F32 cell_size);
+
+        //! Forget every cell and change the cell size
+        void reset(F32 cell_size);
+
+        /**
+         * Center the window on the vehicle
+         * @param position vehicle position in world units
+         */
+        void move(const cv::Vec3f& position);
+
+        /**
+         * Integrate a point cloud
+         * The cell of each point is marked as hit and the cells between
+         * the sensor and the point as missed. Each cell is updated at most
+         * once per cloud, hits take precedence over misses.
+         * @param origin sensor position in world units
+         * @param points N x 3 CV_32F points in world units
+         */
+        void insert(const cv::Vec3f& origin, const cv::Mat& points);
+
+        //! Occupancy of the cell holding a world position
+        State state(const cv::Vec3f& position) const;
+
+        //! Log-odds of the cell holding a world position, 0 if outside the window
+        I8 log_odds(const cv::Vec3f& position) const;
+
+        //! Cells that are currently occupied
+        U32 occupied() const { return m_occupied; }
+
+        //! Cells changed by the last insert
+        U32 updated() const { return m_updated; }
+
+    PRIVATE:
+        enum
+        {
+            XY_MASK = NAV_OCCUPANCY_XY_N - 1,
+            Z_MASK = NAV_OCCUPANCY_Z_N - 1,
+            CELL_N = NAV_OCCUPANCY_XY_N * NAV_OCCUPANCY_XY_N * NAV_OCCUPANCY_Z_N,
+        };
+
+        cv::Vec3i cell(const cv::Vec3f& position) const;
+        bool inside(const cv::Vec3i& c) const;
+        static U32 index(const cv::Vec3i& c);
+
+        //! Add to a cell unless it was already updated by this cloud
+        void update(const cv::Vec3i& c, I32 delta);
+
+        //! Mark the cells between two cells as missed, the end cell is skipped
+        void march(const cv::Vec3f& from, const cv::Vec3f& to);
+
+        //! Forget the cells of a world axis slab
+        void clear_slab(I32 axis, I32 value);
+
+        F32 m_cell_size;
+        F32 m_inv_cell_size;
+
+        cv::Vec3i m_min;                    //!< First world cell inside the window
+        bool m_placed;                      //!< Window was centered at least once
+
+        std::vector<I8> m_cells;
+        std::vector<U8> m_stamps;           //!< Cloud each cell was last updated in
+        U8 m_stamp;
+
+        U32 m_occupied;
+        U32 m_updated;
+    };
+}
+
+#endif //STEREO_HELI_OCCUPANCY_HPP
@@ -7,102 +7,137 @@
 
 #include <Heli/parallel/parallel.hpp>
 
+#include <algorithm>
+#include <cstdlib>
+
 namespace Vo
 {
     enum
     {
-        STEREO_JOBS = 4,
         STEREO_MIN_JOB_POINTS = 8,
     };
 
-    struct JobArgs
-    {
-        const cv::Mat &left;
-        const cv::Mat &right;
-        const cv::Mat &left_kps;
-        cv::Mat &right_kps;
-
-        JobArgs(
-                const cv::Mat &left_,
-                const cv::Mat &right_,
-                const cv::Mat &left_kps_,
-                cv::Mat &right_kps_
-        ) : left(left_), right(right_), left_kps(left_kps_), right_kps(right_kps_) {}
-    };
-
     struct StereoMatcherImpl
     {
-        libparallel::Parallelize<STEREO_JOBS, JobArgs> executor;
-
         U8 windowSize;
         U16 textureThreshold;
+        U8 uniquenessRatio;
         I16 min_disp;
         I16 max_disp;
 
         StereoMatcherImpl()
-                : executor([this](JobArgs args)
-                           { compute(args); }),
-                  windowSize(11), textureThreshold(20),
+                : windowSize(11), textureThreshold(20), uniquenessRatio(10),
                   min_disp(5), max_disp(800)
         {
         }
 
-        inline void compute(JobArgs args) const
+        inline void compute(const cv::Mat &left,
+                            const cv::Mat &right,
+                            const cv::Mat &left_kps,
+                            cv::Mat &disparity,
+                            I32 begin, I32 end) const
         {
-            // TODO(tumbar) Offload buffer initialization
-            U16 sad_buffer_data[windowSize][args.left.cols];
+            // Jobs own disjoint rows of the output
+            for (I32 i = begin; i < end; i++)
+            {
+                I32 x = left_kps.at<I16>(i, 0);
+                I32 y = left_kps.at<I16>(i, 1);
+                disparity.at<F32>(i) = match(left, right, x, y);
+            }
+        }
 
-            cv::Mat sad_buffer(windowSize, args.left.cols, CV_16U);
+        /**
+         * Match a single point of the left frame
+         * @return sub-pixel disparity or -1 if the point could not be matched
+         */
+        inline F32 match(const cv::Mat &left, const cv::Mat &right, I32 x, I32 y) const
+        {
+            const I32 h = windowSize / 2;
+            const I32 w = 2 * h + 1;
 
-            for (I32 i = 0; i < args.left_kps.rows; i++)
+            // Windows must be entirely inside the frame
+            if (x - h < 0 || x + h >= left.cols || y - h < 0 || y + h >= left.rows)
             {
-                // Clear the buffer by setting everything to highest possible value
-                // This is used so
-                std::memset(sad_buffer_data, 0xFF, sizeof(sad_buffer_data));
+                return -1;
+            }
 
-                // Get the point of interest
-                int xpoi = args.left_kps.at<I16>(i, 0);
-                int ypoi = args.left_kps.at<I16>(i, 1);
+            // Flat regions match everywhere along the row
+            U32 texture = 0;
+            for (I32 r = y - h; r <= y + h; r++)
+            {
+                const U8* l = left.ptr<U8>(r);
+                for (I32 c = x - h; c < x + h; c++)
+                {
+                    texture += std::abs(l[c + 1] - l[c]);
+                }
+            }
 
-                // Generate range that we should perform SAD over
-                int x0 = xpoi + min_disp - windowSize;
-                int x1 = xpoi + max_disp + windowSize;
+            if (texture < textureThreshold)
+            {
+                return -1;
+            }
 
-                int y0 = ypoi - windowSize;
-                int y1 = ypoi + windowSize;
+            // Keep the right window inside the frame
+            I32 d0 = std::max<I32>(min_disp, x + h - (right.cols - 1));
+            I32 d1 = std::min<I32>(max_disp, x - h);
+            if (d1 < d0)
+            {
+                return -1;
+            }
 
-                // Bound to the edges of the image
-                // TODO(tumbar) Skip this point if its an edge point?
-                x0 = (x0 < 0) ? 0 : x0;
-                x1 = (x1 >= args.left.cols) ? args.left.cols - 1 : x1;
-                y0 = (y0 < 0) ? 0 : y0;
-                y1 = (y0 >= args.left.rows) ? args.right.rows - 1 : y1;
+            // Sum of absolute differences at each disparity
+            U32 sad[StereoMatcher::MAX_DISPARITIES];
+            const I32 D = d1 - d0 + 1;
+            I32 best = 0;
 
-                // Fill the buffer with absolute differences between left and right ranges
-                compute_ad(args.left, args.right, sad_buffer,
-                           x0, y0, x1, y1);
+            for (I32 d = 0; d < D; d++)
+            {
+                compute_sad(left, right, x - h, x - h - d0 - d, y - h, w, sad[d]);
+                if (sad[d] < sad[best])
+                {
+                    best = d;
+                }
+            }
 
-                // Find the best match coordinate
-//                int best_x;
+            // Reject ambiguous matches
+            for (I32 d = 0; d < D; d++)
+            {
+                if (std::abs(d - best) > 1 &&
+                    static_cast<U64>(sad[d]) * (100 - uniquenessRatio) < static_cast<U64>(sad[best]) * 100)
+                {
+                    return -1;
+                }
+            }
 
+            // Sub-pixel refinement with a parabola through the neighbours
+            F32 disparity = static_cast<F32>(d0 + best);
+            if (best > 0 && best + 1 < D)
+            {
+                I32 denom = static_cast<I32>(sad[best - 1] + sad[best + 1]) - 2 * static_cast<I32>(sad[best]);
+                if (denom > 0)
+                {
+                    disparity += 0.5f * static_cast<F32>(static_cast<I32>(sad[best - 1]) -
+                                                         static_cast<I32>(sad[best + 1])) / static_cast<F32>(denom);
+                }
             }
+
+            return disparity;
         }
 
         static inline void
-        compute_ad(const cv::Mat &left,
-                   const cv::Mat &right,
-                   cv::Mat &sad_buffer,
-                   int x0, int y0,
-                   int x1, int y1)
+        compute_sad(const cv::Mat &left,
+                    const cv::Mat &right,
+                    I32 xl, I32 xr, I32 y0, I32 w,
+                    U32 &sad)
         {
-            for (int i = y0; i < y1; i++)
+            sad = 0;
+            for (I32 i = y0; i < y0 + w; i++)
             {
-                U16* d = reinterpret_cast<U16*>(sad_buffer.row(i - y0).data);
-                U8* l = left.row(i).data + x0;
-                U8* r = right.row(i).data + x0;
-                for (int j = x0; j < x1; d++, l++, r++, j++)
+                const U8* l = left.ptr<U8>(i) + xl;
+                const U8* r = right.ptr<U8>(i) + xr;
+                for (I32 j = 0; j < w; j++)
                 {
-                    *d = std::abs(*l - *r);
+                    sad += std::abs(l[j] - r[j]);
                 }
             }
         }
@@ -121,43 +156,46 @@ namespace Vo
     void StereoMatcher::compute(const cv::Mat &left,
                                 const cv::Mat &right,
                                 const cv::Mat &left_kps,
-                                cv::Mat &right_kps)
+                                cv::Mat &disparity)
     {
-        FW_ASSERT(left_kps.cols == 2);
+        FW_ASSERT(left_kps.cols == 2 && left_kps.type() == CV_16S, left_kps.cols, left_kps.type());
+        FW_ASSERT(left.type() == CV_8U && right.type() == CV_8U, left.type(), right.type());
+        FW_ASSERT(left.size() == right.size());
 
-        right_kps = cv::Mat::zeros(left_kps.size(), CV_16U);
+        // Only reallocated if the number of points changed
+        disparity.create(left_kps.rows, 1, CV_32F);
 
-        U32 points_per_thread = left_kps.rows / STEREO_JOBS;
-        if (points_per_thread >= STEREO_MIN_JOB_POINTS)
-        {
-            libparallel::Awaitable* awaiters[STEREO_JOBS];
-            U32 t = 0;
-            for (auto& awaiter : awaiters)
-            {
-                awaiter = &impl->executor.feed(JobArgs(left, right, left_kps, right_kps), t++);
-            }
-
-            // Wait for the jobs to finish up
-            for (auto& awaiter : awaiters)
-            {
-                awaiter->await();
-            }
-        }
-        else
-        {
-            // Run on the job on the main thread since there
-            // are not enough points to justify running on separate threads
-            impl->compute(JobArgs(left, right, left_kps, right_kps));
-        }
+        // Too few points are matched on the caller
+        libparallel::parallel_for(
+                0, left_kps.rows, STEREO_MIN_JOB_POINTS,
+                [&](I32 begin, I32 end)
+                {
+                    impl->compute(left, right, left_kps, disparity, begin, end);
+                });
     }
 
     void StereoMatcher::setWindowSize(U8 windowSize)
     {
-        impl->windowSize = windowSize;
+        // Windows are centered on the point
+        impl->windowSize = windowSize | 1;
     }
 
     void StereoMatcher::setTextureThreshold(U16 textureThreshold)
     {
         impl->textureThreshold = textureThreshold;
     }
+
+    void StereoMatcher::setDisparityRange(I16 min_disp, I16 max_disp)
+    {
+        FW_ASSERT(min_disp <= max_disp, min_disp, max_disp);
+        FW_ASSERT(max_disp - min_disp < MAX_DISPARITIES, min_disp, max_disp);
+
+        impl->min_disp = min_disp;
+        impl->max_disp = max_disp;
+    }
+
+    void StereoMatcher::setUniquenessRatio(U8 uniquenessRatio)
+    {
+        impl->uniquenessRatio = std::min<U8>(uniquenessRatio, 100);
+    }
 }
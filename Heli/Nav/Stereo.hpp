@@ -11,21 +11,48 @@
 namespace Vo
 {
     struct StereoMatcherImpl;
+
+    /**
+     * Sparse stereo matcher.
+     *
+     * Only the requested points of the left frame are matched. Each point
+     * is searched along its row of the right frame and the match minimizes
+     * the sum of absolute differences over a square window. The cost scales
+     * with the number of points instead of the frame area.
+     */
     class StereoMatcher
     {
     public:
+        enum
+        {
+            MAX_DISPARITIES = 1024,     //!< Widest disparity range searched per point
+        };
 
         StereoMatcher();
         ~StereoMatcher();
 
+        /**
+         * Match points of the left frame
+         * Frames must be rectified
+         * @param left CV_8U left frame
+         * @param right CV_8U right frame
+         * @param left_kps N x 2 CV_16S pixel coordinates (x, y) of the left frame
+         * @param disparity N x 1 CV_32F sub-pixel disparity of each point, negative if not matched
+         */
         void compute(const cv::Mat& left,
                      const cv::Mat& right,
                      const cv::Mat& left_kps,
-                     cv::Mat& right_kps);
+                     cv::Mat& disparity);
 
         void setWindowSize(U8 windowSize);
         void setTextureThreshold(U16 textureThreshold);
 
+        //! Search disparities from min_disp to max_disp inclusive
+        void setDisparityRange(I16 min_disp, I16 max_disp);
+
+        //! Margin in percent by which the best match must beat every other match
+        void setUniquenessRatio(U8 uniquenessRatio);
+
     PRIVATE:
 
         StereoMatcherImpl* impl;
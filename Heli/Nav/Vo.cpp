@@ -3,60 +3,165 @@
 //
 
 #include "Vo.hpp"
+#include "Stereo.hpp"
+
+#include <NavCfg.hpp>
+#include <Fw/Types/Assert.hpp>
+#include <opencv2/calib3d.hpp>
 #include <opencv2/features2d.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/video/tracking.hpp>
 
+#include <algorithm>
+#include <cmath>
+
 namespace Vo
 {
+    //! Largest reprojection error of a PnP inlier in pixels
+    static const F32 PNP_REPROJECTION_ERROR = 2.0f;
+    static const F64 PNP_CONFIDENCE = 0.99;
+
+    static cv::Vec4f quaternion(const cv::Matx44d& T)
+    {
+        F64 trace = T(0, 0) + T(1, 1) + T(2, 2);
+        F64 x, y, z, w;
+        if (trace > 0)
+        {
+            F64 s = 0.5 / std::sqrt(trace + 1.0);
+            w = 0.25 / s;
+            x = (T(2, 1) - T(1, 2)) * s;
+            y = (T(0, 2) - T(2, 0)) * s;
+            z = (T(1, 0) - T(0, 1)) * s;
+        }
+        else if (T(0, 0) > T(1, 1) && T(0, 0) > T(2, 2))
+        {
+            F64 s = 2.0 * std::sqrt(1.0 + T(0, 0) - T(1, 1) - T(2, 2));
+            w = (T(2, 1) - T(1, 2)) / s;
+            x = 0.25 * s;
+            y = (T(0, 1) + T(1, 0)) / s;
+            z = (T(0, 2) + T(2, 0)) / s;
+        }
+        else if (T(1, 1) > T(2, 2))
+        {
+            F64 s = 2.0 * std::sqrt(1.0 + T(1, 1) - T(0, 0) - T(2, 2));
+            w = (T(0, 2) - T(2, 0)) / s;
+            x = (T(0, 1) + T(1, 0)) / s;
+            y = 0.25 * s;
+            z = (T(1, 2) + T(2, 1)) / s;
+        }
+        else
+        {
+            F64 s = 2.0 * std::sqrt(1.0 + T(2, 2) - T(0, 0) - T(1, 1));
+            w = (T(1, 0) - T(0, 1)) / s;
+            x = (T(0, 2) + T(2, 0)) / s;
+            y = (T(1, 2) + T(2, 1)) / s;
+            z = 0.25 * s;
+        }
+
+        return {static_cast<F32>(x), static_cast<F32>(y),
+                static_cast<F32>(z), static_cast<F32>(w)};
+    }
+
     struct SystemImpl
     {
         cv::Ptr<cv::Feature2D> features;
+        Camera camera;
+        cv::Matx33d K;
+
+        Heli::Transform origin;
         Heli::Transform pose;
+        cv::Matx44d motion;             //!< Left camera relative to the origin
+        cv::Matx66f covariance;
 
         cv::Size opticalFlowWindowSize;
         cv::TermCriteria term_criteria;
 
-        cv::Mat last_left;
-        cv::Mat last_right;
+        StereoMatcher stereo;
 
-        explicit SystemImpl(const Heli::Transform &pose_)
-                : features(cv::FastFeatureDetector::create()), pose(pose_),
-                  opticalFlowWindowSize(31, 31),
-                  term_criteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 20, 0.03)
+        // Pyramids of the previous and current left frame
+        // The current pyramid is the previous one of the next frame
+        std::vector<cv::Mat> pyramids[2];
+        U32 current;
+
+        // Ranged keypoints of the previous frame
+        std::vector<cv::Point2f> last_points;
+        std::vector<cv::Point3f> last_object;
+
+        // Per frame buffers, kept to avoid allocating at camera rate
+        cv::Mat gray_left;
+        cv::Mat gray_right;
+        std::vector<cv::KeyPoint> keypoints;
+        std::vector<cv::KeyPoint> tile_keypoints;
+        cv::Mat keypoint_px;
+        cv::Mat disparity;
+        std::vector<cv::Point2f> next_points;
+        std::vector<uchar> status;
+        std::vector<F32> err;
+        std::vector<cv::Point3f> object;
+        std::vector<cv::Point2f> image;
+        std::vector<I32> inliers;
+        cv::Mat rvec;
+        cv::Mat tvec;
+        bool guess;                     //!< Last motion seeds the next PnP
+
+        U32 tracked;
+        U32 inlier_n;
+
+        explicit SystemImpl(const Heli::Transform &pose_, const Camera& camera_)
+                : features(cv::FastFeatureDetector::create()),
+                  camera(camera_),
+                  K(camera_.fx, 0, camera_.cx,
+                    0, camera_.fy, camera_.cy,
+                    0, 0, 1),
+                  origin(pose_), pose(pose_),
+                  motion(cv::Matx44d::eye()),
+                  covariance(cv::Matx66f::zeros()),
+                  opticalFlowWindowSize(NAV_VO_FLOW_WINDOW, NAV_VO_FLOW_WINDOW),
+                  term_criteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 20, 0.03),
+                  current(0),
+                  rvec(cv::Mat::zeros(3, 1, CV_64F)),
+                  tvec(cv::Mat::zeros(3, 1, CV_64F)),
+                  guess(false),
+                  tracked(0), inlier_n(0)
         {
+            stereo.setWindowSize(NAV_VO_STEREO_WINDOW);
+            stereo.setDisparityRange(NAV_VO_MIN_DISPARITY, NAV_VO_MAX_DISPARITY);
         }
 
         /**
          * Divide the image up into equally sized tiles.
-         * Extract the top 10 features from each tile and
+         * Extract the strongest features from each tile and
          * concatenate them into the keypoints vector
+         * Tiles spread the keypoints over the frame, the strongest
+         * NAV_VO_POINT_MAX over all tiles are kept
          * @param image full left image to extract keypoints for
-         * @param keypoints output keypoints
          * @param tile_h tile height in px
          * @param tile_w tile width in px
          */
         void extractKeypoints(const cv::Mat &image,
-                              std::vector<cv::KeyPoint> &keypoints,
-                              I32 tile_h, I32 tile_w) const
+                              I32 tile_h, I32 tile_w)
         {
+            auto stronger = [](const cv::KeyPoint &c1, const cv::KeyPoint &c2)
+            { return c1.response > c2.response; };
+
+            keypoints.clear();
             for (I32 y = 0; y < image.rows; y += tile_h)
             {
                 for (I32 x = 0; x < image.cols; x += tile_w)
                 {
-                    auto sub_image = image(cv::Rect(x, y, tile_w, tile_h));
-
-                    std::vector<cv::KeyPoint> current_kps;
-                    features->detect(sub_image, current_kps);
+                    // Edge tiles are cut to the image
+                    cv::Rect tile(x, y,
+                                  std::min(tile_w, image.cols - x),
+                                  std::min(tile_h, image.rows - y));
+                    features->detect(image(tile), tile_keypoints);
 
-                    // Sort the keypoints in descending order
-                    std::sort(current_kps.begin(), current_kps.end(),
-                              [](const cv::KeyPoint &c1, const cv::KeyPoint &c2)
-                              { return c1.response > c2.response; });
+                    size_t n = std::min<size_t>(NAV_VO_TILE_KP_N, tile_keypoints.size());
+                    std::partial_sort(tile_keypoints.begin(), tile_keypoints.begin() + n,
+                                      tile_keypoints.end(), stronger);
 
-                    // Take the 10 best keypoints (if there exists 10)
-                    for (U32 i = 0; i < 10 && i < current_kps.size(); i++)
+                    for (size_t i = 0; i < n; i++)
                     {
-                        auto &kp = current_kps.at(i);
+                        auto &kp = tile_keypoints[i];
 
                         // Adjust the sub image coordinates to adjust to the entire image
                         kp.pt += cv::Point2f(static_cast<F32>(x), static_cast<F32>(y));
@@ -65,50 +170,219 @@ namespace Vo
                     }
                 }
             }
+
+            if (keypoints.size() > NAV_VO_POINT_MAX)
+            {
+                std::nth_element(keypoints.begin(), keypoints.begin() + NAV_VO_POINT_MAX,
+                                 keypoints.end(), stronger);
+                keypoints.resize(NAV_VO_POINT_MAX);
+            }
         }
 
         /**
-         * Track keypoints from the previous to current image
-         * @param prev i-1th image
-         * @param curr i-th image
-         * @param kp_prev_initial keypoints in the previous image
-         * @param tracked_prev Points tracked from previous image
-         * @param tracked_curr Points tracked in current image
+         * Find and range the keypoints of a frame
+         * Only the keypoints are matched instead of the whole frame
+         * @param left left rectified frame
+         * @param right right rectified frame
+         */
+        void rangeKeypoints(const cv::Mat &left, const cv::Mat &right)
+        {
+            extractKeypoints(left, NAV_VO_TILE_H, NAV_VO_TILE_W);
+
+            keypoint_px.create(static_cast<I32>(keypoints.size()), 2, CV_16S);
+            for (I32 i = 0; i < keypoint_px.rows; i++)
+            {
+                keypoint_px.at<I16>(i, 0) = static_cast<I16>(cvRound(keypoints[i].pt.x));
+                keypoint_px.at<I16>(i, 1) = static_cast<I16>(cvRound(keypoints[i].pt.y));
+            }
+
+            last_points.clear();
+            last_object.clear();
+            if (keypoint_px.rows == 0)
+            {
+                return;
+            }
+
+            stereo.compute(left, right, keypoint_px, disparity);
+
+            // Project the matched keypoints into the left camera frame
+            F32 fb = camera.fx * camera.baseline;
+            for (I32 i = 0; i < keypoint_px.rows; i++)
+            {
+                F32 d = disparity.at<F32>(i);
+                if (d <= 0)
+                {
+                    continue;
+                }
+
+                F32 u = keypoint_px.at<I16>(i, 0);
+                F32 v = keypoint_px.at<I16>(i, 1);
+                F32 z = fb / d;
+
+                last_points.emplace_back(u, v);
+                last_object.emplace_back((u - camera.cx) * z / camera.fx,
+                                         (v - camera.cy) * z / camera.fy,
+                                         z);
+            }
+        }
+
+        /**
+         * Track the ranged keypoints of the previous frame into the current one
+         * Fills object with the 3D points of the previous frame and image
+         * with where they are seen in the current frame
+         * @param size current frame size
          * @param maxError The maximum acceptable error
          */
-        void trackKeypoints(const cv::Mat &prev, const cv::Mat &curr,
-                            const std::vector<cv::Point2f> &kp_prev_initial,
-                            std::vector<cv::Point2f> &tracked_prev,
-                            std::vector<cv::Point2f> &tracked_curr,
-                            float maxError = 4.0) const
+        void trackKeypoints(const cv::Size &size, float maxError = 4.0)
         {
-            std::vector<uchar> status;
-            std::vector<F32> err;
-            std::vector<cv::Point2f> kp_next_initial;
-            cv::calcOpticalFlowPyrLK(prev, curr, kp_prev_initial, kp_next_initial, status, err,
-                                     opticalFlowWindowSize, 3, term_criteria, 0, 0.001);
+            object.clear();
+            image.clear();
+            if (last_points.empty())
+            {
+                return;
+            }
+
+            cv::calcOpticalFlowPyrLK(pyramids[current ^ 1], pyramids[current],
+                                     last_points, next_points, status, err,
+                                     opticalFlowWindowSize, NAV_VO_FLOW_LEVELS,
+                                     term_criteria, 0, 0.001);
 
             // Grab only the points that were matched
             // Filter out bad points
             // Filter out points outside the image bounds
-            for (U32 i = 0; i < kp_prev_initial.size(); i++)
+            for (U32 i = 0; i < last_points.size(); i++)
             {
-                if (status[i])
+                const cv::Point2f& p = next_points[i];
+                if (status[i] && err[i] < maxError &&
+                    p.x >= 0 && p.x < static_cast<F32>(size.width) &&
+                    p.y >= 0 && p.y < static_cast<F32>(size.height))
                 {
-                    // Check if this point is any good
-                    if (err[i] < maxError)
-                    {
-                        // Place the tracking point directly on a pixel coordinate
-                        auto realigned = cv::Point2f (std::round(kp_next_initial[i].x), std::round(kp_next_initial[i].y));
-
-                        // Check if the point is in bound
-                        if (realigned.x >= 0 && realigned.x < prev.cols
-                            && realigned.y >= 0 && realigned.y < prev.rows)
-                        {
-                            tracked_prev.push_back(kp_prev_initial[i]);
-                            tracked_curr.push_back(realigned);
-                        }
-                    }
+                    object.push_back(last_object[i]);
+                    image.push_back(p);
+                }
+            }
+        }
+
+        /**
+         * Solve the motion of the camera from the tracked keypoints
+         * @return false if too few keypoints agree on a motion
+         */
+        bool solveMotion()
+        {
+            inlier_n = 0;
+            if (object.size() < NAV_VO_MIN_INLIERS)
+            {
+                guess = false;
+                return false;
+            }
+
+            if (!guess)
+            {
+                rvec.setTo(0);
+                tvec.setTo(0);
+            }
+
+            // Maps points of the previous camera frame into the current one
+            bool solved = cv::solvePnPRansac(object, image, K, cv::noArray(),
+                                             rvec, tvec, guess,
+                                             NAV_VO_RANSAC_ITERATIONS,
+                                             PNP_REPROJECTION_ERROR, PNP_CONFIDENCE,
+                                             inliers, cv::SOLVEPNP_ITERATIVE);
+
+            if (!solved || inliers.size() < NAV_VO_MIN_INLIERS)
+            {
+                guess = false;
+                return false;
+            }
+
+            inlier_n = inliers.size();
+            guess = true;
+
+            estimateCovariance();
+
+            // Camera motion is the inverse of the point motion
+            cv::Matx33d R;
+            cv::Rodrigues(rvec, R);
+            cv::Vec3d t(tvec.at<F64>(0), tvec.at<F64>(1), tvec.at<F64>(2));
+
+            cv::Matx33d Rt = R.t();
+            cv::Vec3d c = -(Rt * t);
+            cv::Matx44d step(
+                    Rt(0, 0), Rt(0, 1), Rt(0, 2), c[0],
+                    Rt(1, 0), Rt(1, 1), Rt(1, 2), c[1],
+                    Rt(2, 0), Rt(2, 1), Rt(2, 2), c[2],
+                    0, 0, 0, 1);
+
+            motion = motion * step;
+            updatePose();
+            return true;
+        }
+
+        /**
+         * Linearize the reprojection of the inliers around the motion
+         * Covariance is the residual variance over the information of the motion
+         */
+        void estimateCovariance()
+        {
+            std::vector<cv::Point3f> in_object;
+            std::vector<cv::Point2f> in_image;
+            in_object.reserve(inliers.size());
+            in_image.reserve(inliers.size());
+            for (I32 i : inliers)
+            {
+                in_object.push_back(object[i]);
+                in_image.push_back(image[i]);
+            }
+
+            std::vector<cv::Point2f> projected;
+            cv::Mat jacobian;
+            cv::projectPoints(in_object, rvec, tvec, K, cv::noArray(), projected, jacobian);
+
+            F64 residual = 0;
+            for (size_t i = 0; i < projected.size(); i++)
+            {
+                cv::Point2f e = projected[i] - in_image[i];
+                residual += e.x * e.x + e.y * e.y;
+            }
+
+            // Rotation vector and translation columns
+            cv::Mat J = jacobian.colRange(0, 6);
+            cv::Mat information = J.t() * J;
+
+            F64 sigma2 = residual / std::max<F64>(1.0, 2.0 * in_object.size() - 6.0);
+            cv::Mat inverse;
+            if (cv::invert(information, inverse, cv::DECOMP_CHOLESKY) == 0)
+            {
+                // Degenerate geometry, the motion is unconstrained
+                covariance = cv::Matx66f::eye() * 1e6f;
+                return;
+            }
+
+            // Written straight into the covariance
+            cv::Mat out(6, 6, CV_32F, covariance.val);
+            inverse *= sigma2;
+            inverse.convertTo(out, CV_32F);
+        }
+
+        void updatePose()
+        {
+            cv::Mat4f rows(4, 1);
+            for (I32 i = 0; i < 4; i++)
+            {
+                rows(i) = cv::Vec4f(static_cast<F32>(motion(i, 0)), static_cast<F32>(motion(i, 1)),
+                                    static_cast<F32>(motion(i, 2)), static_cast<F32>(motion(i, 3)));
+            }
+
+            pose = origin * Heli::Transform(rows);
+
+            // The pose seen from the origin must give the motion back
+            Heli::Transform step = origin.inverse() * pose;
+            for (I32 i = 0; i < 3; i++)
+            {
+                for (I32 j = 0; j < 4; j++)
+                {
+                    F64 expected = motion(i, j);
+                    FW_ASSERT(std::abs(step(i, j) - expected) <= 1e-3 * (1 + std::abs(expected)), i, j);
                 }
             }
         }
@@ -119,43 +393,53 @@ namespace Vo
          * pose to current pose.
          * @param left_r left rectified image frame
          * @param right_r right rectified image frame
+         * @return true if the pose was updated
          */
-        void trackStereo(const cv::Mat &left_r,
+        bool trackStereo(const cv::Mat &left_r,
                          const cv::Mat &right_r)
         {
-            // We need a sequence of images to perform tracking
-            // Wait for the next frame
-            if (last_left.size != left_r.size)
+            const cv::Mat* left = &left_r;
+            const cv::Mat* right = &right_r;
+            if (left_r.type() == CV_8UC3)
             {
-                left_r.copyTo(last_left);
-                right_r.copyTo(last_right);
-                return;
+                cv::cvtColor(left_r, gray_left, cv::COLOR_BGR2GRAY);
+                cv::cvtColor(right_r, gray_right, cv::COLOR_BGR2GRAY);
+                left = &gray_left;
+                right = &gray_right;
             }
 
-            // Find keypoints from the last frame
-            // We can't use the tracked from the last image
-            // because there will be new points in view as the camera moves
-            std::vector<cv::KeyPoint> keypoints;
-            extractKeypoints(last_left, keypoints, 10, 20);
+            // The pyramid is reused as the previous frame of the next call
+            current ^= 1;
+            cv::buildOpticalFlowPyramid(*left, pyramids[current],
+                                        opticalFlowWindowSize, NAV_VO_FLOW_LEVELS);
 
-            // Convert the keypoints to points
-            std::vector<cv::Point2f> keypoints_points;
-            for (const auto& kp : keypoints)
+            // We need a sequence of images to perform tracking
+            // Wait for the next frame
+            bool updated = false;
+            const std::vector<cv::Mat>& last = pyramids[current ^ 1];
+            if (!last.empty() && last[0].size() == left->size())
             {
-                keypoints_points.push_back(kp.pt);
+                trackKeypoints(left->size());
+                tracked = object.size();
+                updated = solveMotion();
+            }
+            else
+            {
+                tracked = 0;
+                inlier_n = 0;
+                guess = false;
             }
 
-            // Track the keypoints from the last image to the current frame
-            std::vector<cv::Point2f> kp_1, kp_2;
-            trackKeypoints(last_left, left_r, keypoints_points, kp_1, kp_2);
-
-            // Compute the depth only on the keypoints
-
+            // Find keypoints from this frame for the next one
+            // We can't use the tracked from the last image
+            // because there will be new points in view as the camera moves
+            rangeKeypoints(*left, *right);
+            return updated;
         }
     };
 
-    System::System(const Heli::Transform &pose)
-            : impl(new SystemImpl(pose))
+    System::System(const Heli::Transform &pose, const Camera& camera)
+            : impl(new SystemImpl(pose, camera))
     {
     }
 
@@ -164,14 +448,42 @@ namespace Vo
         delete impl;
     }
 
-    void System::trackStereo(const cv::Mat &left_r,
+    bool System::trackStereo(const cv::Mat &left_r,
                              const cv::Mat &right_r)
     {
-        impl->trackStereo(left_r, right_r);
+        return impl->trackStereo(left_r, right_r);
     }
 
     const Heli::Transform &System::getPose() const
     {
         return impl->pose;
     }
+
+    cv::Vec3f System::getPosition() const
+    {
+        const cv::Matx44d& T = impl->motion;
+        return {static_cast<F32>(T(0, 3)),
+                static_cast<F32>(T(1, 3)),
+                static_cast<F32>(T(2, 3))};
+    }
+
+    cv::Vec4f System::getAttitude() const
+    {
+        return quaternion(impl->motion);
+    }
+
+    const cv::Matx66f& System::getCovariance() const
+    {
+        return impl->covariance;
+    }
+
+    U32 System::getTracked() const
+    {
+        return impl->tracked;
+    }
+
+    U32 System::getInliers() const
+    {
+        return impl->inlier_n;
+    }
 }
@@ -9,21 +9,38 @@
 
 namespace Vo
 {
+    //! Pinhole model of the rectified left camera
+    struct Camera
+    {
+        F32 fx;         //!< Horizontal focal length in pixels
+        F32 fy;         //!< Vertical focal length in pixels
+        F32 cx;         //!< Principal point in pixels
+        F32 cy;
+        F32 baseline;   //!< Distance between the cameras, positions are in the same units
+    };
+
     struct SystemImpl;
     struct System
     {
         SystemImpl* impl;
 
-        explicit System(const Heli::Transform &pose);
+        /**
+         * @param pose initial pose of the left camera
+         * @param camera model of the frames passed to trackStereo
+         */
+        System(const Heli::Transform &pose, const Camera& camera);
         ~System();
 
         /**
          * Process the given stereo pair frame.
          * Images must be synchronized and rectified.
+         * Keypoints of the previous frame are ranged with sparse stereo, tracked into
+         * this frame with optical flow and the motion is solved with PnP RANSAC.
          * @param imLeft RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale
          * @param imRight RGB (CV_8UC3) or grayscale (CV_8U). RGB is converted to grayscale
+         * @return true if the pose was updated, false on the first frame or if tracking was lost
          */
-        void trackStereo(
+        bool trackStereo(
                 const cv::Mat &left_r,
                 const cv::Mat &right_r
         );
@@ -35,6 +52,24 @@ namespace Vo
          * @return Pose with respect to the site frame pose
          */
         const Heli::Transform& getPose() const;
+
+        //! Position of the left camera relative to the initial pose
+        cv::Vec3f getPosition() const;
+
+        //! Attitude of the left camera relative to the initial pose as a (x, y, z, w) quaternion
+        cv::Vec4f getAttitude() const;
+
+        /**
+         * Covariance of the last frame to frame motion
+         * Rotation vector (rad) then translation, in the previous camera frame
+         */
+        const cv::Matx66f& getCovariance() const;
+
+        //! Keypoints tracked into the last frame
+        U32 getTracked() const;
+
+        //! Tracked keypoints agreeing with the last motion
+        U32 getInliers() const;
     };
 
 }
@@ -4,6 +4,7 @@
 
 #include "Sapp.hpp"
 #include "SappCfg.hpp"
+#include <Heli/parallel/policy.hpp>
 #include <Eigen/Eigen>
 
 namespace Heli
@@ -24,6 +25,11 @@ namespace Heli
         SappComponentBase::init(queueDepth, instance);
     }
 
+    void Sapp::preamble()
+    {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CONTROL, "sapp");
+    }
+
     Quaternion Sapp::getAttitude_handler(NATIVE_INT_TYPE portNum)
     {
         // TODO(tumbar) Projection using angular velocity integral?
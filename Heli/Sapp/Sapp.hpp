@@ -20,6 +20,8 @@ namespace Heli
                 );
 
     PRIVATE:
+        void preamble() override;
+
         void schedIn_handler(NATIVE_INT_TYPE portNum,
                              NATIVE_UINT_TYPE context) override;
 
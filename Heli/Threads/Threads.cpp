@@ -0,0 +1,116 @@
+//
+// Created by tumbar on 4/16/23.
+//
+
+#include "Threads.hpp"
+
+#include <algorithm>
+
+namespace Heli
+{
+    using libparallel::ThreadPolicy;
+
+    static_assert(PARALLEL_THREAD_N == Threads_THREAD_N,
+                  "Thread telemetry must cover every policy slot");
+    static_assert(ThreadPolicy::CONTROL == ThreadClass::CONTROL &&
+                  ThreadPolicy::CAMERA == ThreadClass::CAMERA &&
+                  ThreadPolicy::VISION == ThreadClass::VISION &&
+                  ThreadPolicy::ENCODER == ThreadClass::ENCODER &&
+                  ThreadPolicy::GROUND == ThreadClass::GROUND,
+                  "Thread classes must match the policy classes");
+
+    Threads::Threads(const char* compName)
+            : ThreadsComponentBase(compName),
+              m_samples(), m_last(std::chrono::steady_clock::now()),
+              m_generation(0)
+    {
+    }
+
+    void Threads::init(NATIVE_INT_TYPE instance)
+    {
+        ThreadsComponentBase::init(instance);
+    }
+
+    void Threads::schedIn_handler(NATIVE_INT_TYPE portNum, NATIVE_UINT_TYPE context)
+    {
+        auto now = std::chrono::steady_clock::now();
+        U64 elapsed_us = std::max<U64>(
+                1, std::chrono::duration_cast<std::chrono::microseconds>(now - m_last).count());
+        m_last = now;
+
+        ThreadCpus cpu;
+        ThreadSwitches involuntary;
+        ThreadSwitches voluntary;
+
+        ThreadPolicy& policy = ThreadPolicy::get();
+        for (U32 i = 0; i < PARALLEL_THREAD_N; i++)
+        {
+            cpu[i] = 0;
+            involuntary[i] = 0;
+            voluntary[i] = 0;
+
+            ThreadPolicy::Thread thread;
+            ThreadPolicy::Usage usage;
+            if (!policy.thread(i, thread) || !policy.usage(i, usage))
+            {
+                m_samples[i].tid = 0;
+                continue;
+            }
+
+            // A new thread in the slot has no previous sample
+            Sample& last = m_samples[i];
+            if (last.tid == thread.tid)
+            {
+                cpu[i] = static_cast<U16>(std::min<U64>(
+                        (usage.cpu_us - last.usage.cpu_us) * 1000 / elapsed_us, 0xFFFF));
+                involuntary[i] = static_cast<U32>(usage.involuntary - last.usage.involuntary);
+                voluntary[i] = static_cast<U32>(usage.voluntary - last.usage.voluntary);
+            }
+
+            last.tid = thread.tid;
+            last.usage = usage;
+        }
+
+        tlmWrite_ThreadCpu(cpu);
+        tlmWrite_ThreadInvoluntary(involuntary);
+        tlmWrite_ThreadVoluntary(voluntary);
+
+        // Report threads once they register
+        U32 generation = policy.generation();
+        if (generation != m_generation)
+        {
+            m_generation = generation;
+            report();
+        }
+    }
+
+    void Threads::THREADS_LIST_cmdHandler(FwOpcodeType opCode, U32 cmdSeq)
+    {
+        m_generation = ThreadPolicy::get().generation();
+        report();
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Threads::report()
+    {
+        U32 failures = 0;
+        for (U32 i = 0; i < PARALLEL_THREAD_N; i++)
+        {
+            ThreadPolicy::Thread thread;
+            if (!ThreadPolicy::get().thread(i, thread))
+            {
+                continue;
+            }
+
+            failures += !thread.applied;
+            Fw::LogStringArg name(thread.name);
+            log_ACTIVITY_LO_ThreadInfo(i, name,
+                                       static_cast<ThreadClass::T>(thread.cls),
+                                       ThreadPolicy::cpus(thread.cls),
+                                       ThreadPolicy::priority(thread.cls),
+                                       thread.applied);
+        }
+
+        tlmWrite_ThreadPolicyFailures(failures);
+    }
+}
@@ -0,0 +1,42 @@
+//
+// Created by tumbar on 4/16/23.
+//
+
+#ifndef STEREO_HELI_THREADS_HPP
+#define STEREO_HELI_THREADS_HPP
+
+#include <Heli/Threads/ThreadsComponentAc.hpp>
+#include <Heli/parallel/policy.hpp>
+
+#include <chrono>
+
+namespace Heli
+{
+    class Threads : public ThreadsComponentBase
+    {
+    public:
+        explicit Threads(const char* compName);
+
+        void init(NATIVE_INT_TYPE instance);
+
+    PRIVATE:
+        void schedIn_handler(NATIVE_INT_TYPE portNum, NATIVE_UINT_TYPE context) override;
+
+        void THREADS_LIST_cmdHandler(FwOpcodeType opCode, U32 cmdSeq) override;
+
+        void report();
+
+        //! Counters of the thread that held a slot at the last sample
+        struct Sample
+        {
+            I32 tid;
+            libparallel::ThreadPolicy::Usage usage;
+        };
+
+        Sample m_samples[PARALLEL_THREAD_N];
+        std::chrono::steady_clock::time_point m_last;
+        U32 m_generation;
+    };
+}
+
+#endif //STEREO_HELI_THREADS_HPP
@@ -3,6 +3,7 @@
 #include <csignal>
 
 #include <Heli/Top/HeliTopologyAc.hpp>
+#include <Heli/parallel/policy.hpp>
 #include <getopt.h>
 
 static std::atomic<bool> is_alive = true;
@@ -63,6 +64,8 @@ I32 main(int argc, char* argv[])
     // Otherwise shutdown immediately
     if (Heli::Init::status)
     {
+        // This thread drives the rate groups
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::CONTROL, "main");
         Heli::linuxTimer.startTimer(100);
     }
 
@@ -0,0 +1,233 @@
+//
+// Created by tumbar on 4/5/23.
+//
+
+#include <Heli/Trace/FrameTrace.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace Heli
+{
+    FrameTrace& FrameTrace::get()
+    {
+        static FrameTrace trace;
+        return trace;
+    }
+
+    U64 FrameTrace::now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    FrameTrace::FrameTrace()
+            : m_active{}, m_active_valid{false}, m_seq(0),
+              m_history_head(0), m_history_n(0),
+              m_window_head{0}, m_window_n{0}
+    {
+    }
+
+    void FrameTrace::begin(U32 frame_id, U64 sensor_ns)
+    {
+        FW_ASSERT(frame_id < CAMERA_BUFFER_MAX_N, frame_id);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        Record& record = m_active[frame_id];
+        if (m_active_valid[frame_id])
+        {
+            complete(record);
+        }
+
+        std::memset(&record, 0, sizeof(record));
+        record.frame_id = frame_id;
+        record.seq = m_seq++;
+        record.sensor = sensor_ns;
+        m_active_valid[frame_id] = true;
+    }
+
+    void FrameTrace::mark(U32 frame_id, Hop hop, U32 index)
+    {
+        if (frame_id >= CAMERA_BUFFER_MAX_N)
+        {
+            return;
+        }
+
+        Record& record = m_active[frame_id];
+        U64 t = now();
+
+        switch (hop)
+        {
+            case CAM_OUT:
+                record.cam_out = t;
+                break;
+            case PIPE:
+                if (index < TRACE_PIPE_STAGE_N) record.pipe[index] = t;
+                break;
+            case VIS_START:
+                if (index < TRACE_VIS_STAGE_N) record.vis_start[index] = t;
+                break;
+            case VIS_END:
+                if (index < TRACE_VIS_STAGE_N) record.vis_end[index] = t;
+                break;
+            case ENCODER:
+                record.encoder = t;
+                break;
+        }
+    }
+
+    void FrameTrace::complete(const Record& record)
+    {
+        m_history[m_history_head] = record;
+        m_history_head = (m_history_head + 1) % TRACE_HISTORY_N;
+        m_history_n = std::min<U32>(m_history_n + 1, TRACE_HISTORY_N);
+
+        sample(W_CAM_OUT, record.sensor, record.cam_out);
+        for (U32 i = 0; i < TRACE_PIPE_STAGE_N; i++)
+        {
+            sample(static_cast<Window>(W_PIPE + i), record.sensor, record.pipe[i]);
+        }
+
+        // Vision is finished once the last stage that ran has finished
+        U64 vis_end = 0;
+        for (U64 t : record.vis_end)
+        {
+            vis_end = std::max(vis_end, t);
+        }
+
+        sample(W_VIS, record.sensor, vis_end);
+        sample(W_ENCODER, record.sensor, record.encoder);
+    }
+
+    void FrameTrace::sample(Window w, U64 sensor, U64 t)
+    {
+        // Hop was never reached by this frame
+        if (!t || t < sensor)
+        {
+            return;
+        }
+
+        m_window[w][m_window_head[w]] = static_cast<U32>(std::min<U64>((t - sensor) / 1000, 0xFFFFFFFF));
+        m_window_head[w] = (m_window_head[w] + 1) % TRACE_WINDOW_N;
+        m_window_n[w] = std::min<U32>(m_window_n[w] + 1, TRACE_WINDOW_N);
+    }
+
+    I32 FrameTrace::window_of(Hop hop, U32 index)
+    {
+        switch (hop)
+        {
+            case CAM_OUT:
+                return W_CAM_OUT;
+            case PIPE:
+                return index < TRACE_PIPE_STAGE_N ? W_PIPE + static_cast<I32>(index) : -1;
+            case VIS_END:
+                return W_VIS;
+            case ENCODER:
+                return W_ENCODER;
+            default:
+                return -1;
+        }
+    }
+
+    FrameTrace::Percentiles FrameTrace::latency(Hop hop, U32 index)
+    {
+        I32 w = window_of(hop, index);
+        FW_ASSERT(w >= 0, hop, index);
+
+        U32 samples[TRACE_WINDOW_N];
+        U32 n;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            n = m_window_n[w];
+            std::copy(m_window[w], m_window[w] + n, samples);
+        }
+
+        Percentiles out = {0, 0, 0, n};
+        if (n == 0)
+        {
+            return out;
+        }
+
+        auto percentile = [&samples, n](U32 p) {
+            U32 k = std::min(n - 1, (n * p) / 100);
+            std::nth_element(samples, samples + k, samples + n);
+            return samples[k];
+        };
+
+        out.p50 = percentile(50);
+        out.p95 = percentile(95);
+        out.p99 = percentile(99);
+        return out;
+    }
+
+    U32 FrameTrace::dump(const std::string& path)
+    {
+        std::ofstream out(path);
+        if (!out)
+        {
+            throw std::runtime_error("failed to open " + path);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        out << "seq,frame_id,sensor_ns,cam_out_us";
+        for (U32 i = 0; i < TRACE_PIPE_STAGE_N; i++)
+        {
+            out << ",pipe" << i << "_us";
+        }
+        for (U32 i = 0; i < TRACE_VIS_STAGE_N; i++)
+        {
+            out << ",vis" << i << "_start_us,vis" << i << "_end_us";
+        }
+        out << ",encoder_us\n";
+
+        // Hops that were never reached are left empty
+        auto rel = [&out](const Record& r, U64 t) {
+            out << ',';
+            if (t && t >= r.sensor)
+            {
+                out << (t - r.sensor) / 1000;
+            }
+        };
+
+        U32 start = (m_history_head + TRACE_HISTORY_N - m_history_n) % TRACE_HISTORY_N;
+        for (U32 i = 0; i < m_history_n; i++)
+        {
+            const Record& r = m_history[(start + i) % TRACE_HISTORY_N];
+            out << r.seq << ',' << r.frame_id << ',' << r.sensor;
+            rel(r, r.cam_out);
+            for (U64 t : r.pipe) rel(r, t);
+            for (U32 j = 0; j < TRACE_VIS_STAGE_N; j++)
+            {
+                rel(r, r.vis_start[j]);
+                rel(r, r.vis_end[j]);
+            }
+            rel(r, r.encoder);
+            out << '\n';
+        }
+
+        if (!out)
+        {
+            throw std::runtime_error("failed to write " + path);
+        }
+
+        return m_history_n;
+    }
+
+    void FrameTrace::clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_history_head = 0;
+        m_history_n = 0;
+        for (U32 w = 0; w < W_N; w++)
+        {
+            m_window_head[w] = 0;
+            m_window_n[w] = 0;
+        }
+    }
+}
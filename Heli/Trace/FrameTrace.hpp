@@ -0,0 +1,135 @@
+//
+// Created by tumbar on 4/5/23.
+//
+
+#ifndef STEREO_HELI_FRAMETRACE_HPP
+#define STEREO_HELI_FRAMETRACE_HPP
+
+#include <CamCfg.hpp>
+#include <TraceCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+
+#include <mutex>
+#include <string>
+
+namespace Heli
+{
+    /**
+     * Per-frame latency tracing shared by every component that touches a camera frame.
+     *
+     * Each camera buffer slot (frame id) owns a single in-flight record. Components
+     * stamp the record as the frame passes through them. Every hop is written by one
+     * thread at a time so stamping is a single clock read and a store.
+     *
+     * A record is completed when its slot is reused for the next frame. This is always
+     * after the last reference to the previous frame was dropped, so all the hops
+     * are in. Completed records are pushed into a history ring for dumping and
+     * into sliding windows for latency percentiles.
+     *
+     * All timestamps are CLOCK_MONOTONIC nanoseconds, the same clock as the sensor.
+     */
+    class FrameTrace
+    {
+    public:
+        enum Hop
+        {
+            CAM_OUT,        //!< Cam::frame_out
+            PIPE,           //!< FramePipe sent the frame to a stage (index is the stage)
+            VIS_START,      //!< VisStage::process start (index is the stage)
+            VIS_END,        //!< VisStage::process end (index is the stage)
+            ENCODER,        //!< H264 encoder released the input buffer
+        };
+
+        struct Record
+        {
+            U32 frame_id;
+            U32 seq;                            //!< Order the frame was captured in
+            U64 sensor;
+            U64 cam_out;
+            U64 pipe[TRACE_PIPE_STAGE_N];
+            U64 vis_start[TRACE_VIS_STAGE_N];
+            U64 vis_end[TRACE_VIS_STAGE_N];
+            U64 encoder;
+        };
+
+        //! Latency from sensor exposure to a hop in microseconds
+        struct Percentiles
+        {
+            U32 p50;
+            U32 p95;
+            U32 p99;
+            U32 count;          //!< Samples in the window
+        };
+
+        static FrameTrace& get();
+
+        //! Current time on the sensor timestamp clock
+        static U64 now();
+
+        /**
+         * Start tracing a new frame in a buffer slot
+         * Completes the last frame traced in this slot
+         * @param frame_id camera buffer id
+         * @param sensor_ns sensor timestamp of the frame
+         */
+        void begin(U32 frame_id, U64 sensor_ns);
+
+        /**
+         * Stamp the current time on a frame
+         * @param frame_id camera buffer id
+         * @param hop hop the frame reached
+         * @param index pipeline or vision stage index
+         */
+        void mark(U32 frame_id, Hop hop, U32 index = 0);
+
+        /**
+         * Latency percentiles over the last TRACE_WINDOW_N completed frames
+         * @param hop CAM_OUT, PIPE, VIS_END (last vision stage) or ENCODER
+         * @param index pipeline stage for PIPE
+         */
+        Percentiles latency(Hop hop, U32 index = 0);
+
+        /**
+         * Write the completed frame history as CSV, oldest first
+         * Timestamps are written relative to the sensor timestamp
+         * @param path output file
+         * @return number of frames written
+         */
+        U32 dump(const std::string& path);
+
+        //! Drop all history and windows
+        void clear();
+
+    PRIVATE:
+        FrameTrace();
+
+        enum Window
+        {
+            W_CAM_OUT,
+            W_PIPE,
+            W_VIS = W_PIPE + TRACE_PIPE_STAGE_N,
+            W_ENCODER,
+            W_N
+        };
+
+        void complete(const Record& record);
+        void sample(Window w, U64 sensor, U64 t);
+        static I32 window_of(Hop hop, U32 index);
+
+        Record m_active[CAMERA_BUFFER_MAX_N];
+        bool m_active_valid[CAMERA_BUFFER_MAX_N];
+        U32 m_seq;
+
+        std::mutex m_mutex;
+
+        Record m_history[TRACE_HISTORY_N];
+        U32 m_history_head;
+        U32 m_history_n;
+
+        U32 m_window[W_N][TRACE_WINDOW_N];
+        U32 m_window_head[W_N];
+        U32 m_window_n[W_N];
+    };
+}
+
+#endif //STEREO_HELI_FRAMETRACE_HPP
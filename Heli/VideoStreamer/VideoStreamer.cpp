@@ -2,6 +2,9 @@
 #include "encoder/h264_encoder.hpp"
 #include "output/net_output.hpp"
 #include "Logger.hpp"
+#include <Heli/Trace/FrameTrace.hpp>
+#include <Heli/parallel/policy.hpp>
+#include <Fw/Types/Assert.hpp>
 #include <preview/preview.hpp>
 #include <functional>
 
@@ -16,14 +19,30 @@ namespace Heli
         std::unique_ptr<Output> net;
     };
 
+    static cv::Mat frame_mat(CamFrame& frame)
+    {
+        return cv::Mat((I32) frame.getInfo().height,
+                       (I32) frame.getInfo().width,
+                       CV_8U,
+                       frame.getData(),
+                       frame.getInfo().stride);
+    }
+
     VideoStreamer::VideoStreamer(const char* compName)
             : VideoStreamerComponentBase(compName),
-              is_capturing(false),
               is_showing(false),
               m_displaying(VideoStreamer_DisplayLocation::NONE),
               m_eye(CamSelect::LEFT),
               m_impl(new VideoStreamerImpl),
-              tlm_total_frames(0)
+              tlm_total_frames(0),
+              m_capture({
+                      [this](CamSelect camera, const char* file)
+                      { log_ACTIVITY_LO_CaptureCompleted(camera, file); },
+                      [this](const char* file, const char* error)
+                      { log_WARNING_LO_CaptureFailed(file, error); },
+                      [this](FwOpcodeType opCode, U32 cmdSeq, bool ok)
+                      { cmdResponse_out(opCode, cmdSeq, ok ? Fw::CmdResponse::OK : Fw::CmdResponse::EXECUTION_ERROR); }
+              })
     {
     }
 
@@ -70,88 +89,15 @@ namespace Heli
         tlmWrite_FramesPerSecond(static_cast<U32>(1.0 / period));
         m_last_frame = current_time;
 
-        if (is_capturing)
+        // The writer copies the frames before the buffer is returned
+        if (m_capture.frame(frame_mat(left), frame_mat(right)))
         {
-            std::string filename = m_capture.location.toChar();
-            std::string extension;
-
-            switch (m_capture.encoding.e)
-            {
-                case ImageEncoding::JPEG:
-                    extension = ".jpg";
-                    break;
-                case ImageEncoding::PNG:
-                    extension = ".png";
-                    break;
-                case ImageEncoding::TIFF:
-                    extension = ".tiff";
-                    break;
-            }
-
-            switch (m_capture.eye.e)
-            {
-                case CamSelect::LEFT:
-                {
-                    cv::Mat image((I32) left.getInfo().height,
-                                  (I32) left.getInfo().width,
-                                  CV_8U,
-                                  left.getData(),
-                                  left.getInfo().stride);
-
-                    log_ACTIVITY_LO_CaptureCompleted(CamSelect::LEFT, (filename + extension).c_str());
-                    cv::imwrite(filename + extension, image);
-                }
-                    break;
-                case CamSelect::RIGHT:
-                {
-                    cv::Mat image((I32) right.getInfo().height,
-                                  (I32) right.getInfo().width,
-                                  CV_8U,
-                                  right.getData(),
-                                  right.getInfo().stride);
-
-                    log_ACTIVITY_LO_CaptureCompleted(CamSelect::RIGHT, (filename + extension).c_str());
-                    cv::imwrite(filename + extension, image);
-                }
-                    break;
-                case CamSelect::BOTH:
-                {
-                    cv::Mat image_l((I32) left.getInfo().height,
-                                    (I32) left.getInfo().width,
-                                    CV_8U,
-                                    left.getData(),
-                                    left.getInfo().stride);
-                    cv::Mat image_r((I32) right.getInfo().height,
-                                    (I32) right.getInfo().width,
-                                    CV_8U,
-                                    right.getData(),
-                                    right.getInfo().stride);
-
-                    if (m_capture.encoding == ImageEncoding::TIFF)
-                    {
-                        // Store both images in a single tiff file
-                        std::vector<cv::Mat> layers;
-                        layers.push_back(image_l);
-                        layers.push_back(image_r);
-
-                        log_ACTIVITY_LO_CaptureCompleted(CamSelect::BOTH, (filename + extension).c_str());
-                        cv::imwrite(filename + extension, layers);
-                    }
-                    else
-                    {
-                        // Store both images in separate files
-                        log_ACTIVITY_LO_CaptureCompleted(CamSelect::LEFT, (filename + "-left" + extension).c_str());
-                        cv::imwrite(filename + "-left" + extension, image_l);
-
-                        log_ACTIVITY_LO_CaptureCompleted(CamSelect::RIGHT, (filename + "-right" + extension).c_str());
-                        cv::imwrite(filename + "-right" + extension, image_r);
-                    }
-                }
-                    break;
-            }
-
-            is_capturing = false;
-            cmdResponse_out(m_capture.opCode, m_capture.cmdSeq, Fw::CmdResponse::OK);
+            log_WARNING_LO_CaptureQueueFull_ThrottleClear();
+        }
+        else
+        {
+            // Try again on the next frame
+            log_WARNING_LO_CaptureQueueFull();
         }
 
         if ((m_displaying == VideoStreamer_DisplayLocation::BOTH ||
@@ -179,6 +125,8 @@ namespace Heli
                                                         return;
                                                     }
 
+                                                    FrameTrace::get().mark(encoding_buffers.front(), FrameTrace::ENCODER);
+
                                                     // Drop the reference to the oldest frame buffer we sent to the encoder
                                                     // This assumed that the H264 encoding will reply with in order frames...
                                                     incdec_out(0, encoding_buffers.front(),
@@ -240,6 +188,7 @@ namespace Heli
     void VideoStreamer::preamble()
     {
         ActiveComponentBase::preamble();
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::ENCODER, "streamer");
         clean();
         m_last_frame = getTime();
     }
@@ -281,42 +230,27 @@ namespace Heli
     void
     VideoStreamer::CAPTURE_cmdHandler(FwOpcodeType opCode, U32 cmdSeq,
                                       const Fw::CmdStringArg &location, Heli::CamSelect eye,
-                                      Heli::ImageEncoding encoding)
+                                      Heli::ImageEncoding encoding, U8 count)
     {
-        if (is_capturing)
+        switch (m_capture.start(opCode, cmdSeq, location, eye, encoding, count))
         {
-            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::BUSY);
-            return;
+            case CaptureWriter::Burst::STARTED:
+                break;
+            case CaptureWriter::Burst::INVALID_COUNT:
+                cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::VALIDATION_ERROR);
+                break;
+            case CaptureWriter::Burst::BUSY:
+                cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::BUSY);
+                break;
         }
-
-        m_capture.request_time = getTime();
-
-        m_capture.opCode = opCode;
-        m_capture.cmdSeq = cmdSeq;
-
-        m_capture.location = location;
-        m_capture.eye = eye;
-        m_capture.encoding = encoding;
-
-        is_capturing = true;
     }
 
     void VideoStreamer::sched_handler(NATIVE_INT_TYPE portNum, NATIVE_UINT_TYPE context)
     {
-        if (is_capturing)
+        Fw::String location;
+        if (m_capture.expired(location))
         {
-            Fw::Time cur_time = getTime();
-            Fw::Time difference = Fw::Time::sub(
-                    cur_time,
-                    m_capture.request_time);
-
-            // TODO(tumbar) Do we want variable timeout?
-            if (difference >= Fw::Time(cur_time.getTimeBase(), 3, 0))
-            {
-                is_capturing = false;
-                log_WARNING_LO_CaptureTimeout(m_capture.location);
-                cmdResponse_out(m_capture.opCode, m_capture.cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
-            }
+            log_WARNING_LO_CaptureTimeout(location);
         }
     }
 }
@@ -9,7 +9,9 @@
 #include <output/output.hpp>
 
 #include <Fw/Types/String.hpp>
+#include <Heli/Capture/CaptureWriter.hpp>
 
+#include <memory>
 #include <vector>
 #include <queue>
 
@@ -36,25 +38,14 @@ namespace Heli
         void CAPTURE_cmdHandler(FwOpcodeType opCode, U32 cmdSeq,
                                 const Fw::CmdStringArg &location,
                                 Heli::CamSelect eye,
-                                Heli::ImageEncoding encoding) override;
+                                Heli::ImageEncoding encoding,
+                                U8 count) override;
 
         void sched_handler(NATIVE_INT_TYPE portNum, NATIVE_UINT_TYPE context) override;
 
     PRIVATE:
         void clean();
 
-        bool is_capturing;
-        struct {
-            Fw::Time request_time;
-
-            Fw::String location;
-            Heli::CamSelect eye;
-            Heli::ImageEncoding encoding;
-
-            FwOpcodeType opCode;
-            U32 cmdSeq;
-        } m_capture;
-
         bool is_showing;
         CamFrame m_showing;
         VideoStreamer_DisplayLocation m_displaying;
@@ -66,6 +57,9 @@ namespace Heli
 
         Fw::Time m_last_frame;          //!< Last sent frame for calculate frame rate
         U32 tlm_total_frames;
+
+        //! Writer callbacks finish captures off the component thread
+        CaptureWriter::Burst m_capture;
     };
 }
 
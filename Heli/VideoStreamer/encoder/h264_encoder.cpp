@@ -20,6 +20,7 @@
 #include <cstring>
 
 #include "h264_encoder.hpp"
+#include <Heli/parallel/policy.hpp>
 
 static int xioctl(int fd, unsigned long ctl, void* arg)
 {
@@ -218,6 +219,7 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void* mem, StreamInfo const
 
 void H264Encoder::pollThread()
 {
+    libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::ENCODER, "h264-poll");
     while (true)
     {
         pollfd p = {fd_, POLLIN, 0};
@@ -282,6 +284,7 @@ void H264Encoder::pollThread()
 
 void H264Encoder::outputThread()
 {
+    libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::ENCODER, "h264-out");
     OutputItem item;
     while (true)
     {
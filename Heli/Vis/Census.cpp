@@ -0,0 +1,706 @@
+//
+// Created by tumbar on 4/8/23.
+//
+
+#include <Heli/Vis/Census.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace Heli
+{
+    cv::Ptr<CensusStereo> CensusStereo::create(bool sgm)
+    {
+        return cv::makePtr<CensusStereo>(sgm);
+    }
+
+    CensusStereo::CensusStereo(bool sgm)
+            : m_sgm(sgm),
+              m_min_disparity(0),
+              m_num_disparities(16),
+              m_block_size(5),
+              m_speckle_window_size(0),
+              m_speckle_range(0),
+              m_disp12_max_diff(1),
+              m_uniqueness_ratio(10),
+              m_p1(4),
+              m_p2(20)
+    {
+    }
+
+    void CensusStereo::census(const cv::Mat& src, cv::Mat& dst)
+    {
+        dst.create(src.size(), CV_32S);
+        dst.setTo(0);
+
+        const I32 r = CENSUS_RADIUS;
+        for (I32 y = r; y < src.rows - r; y++)
+        {
+            U32* out = dst.ptr<U32>(y);
+            for (I32 x = r; x < src.cols - r; x++)
+            {
+                const U8 center = src.at<U8>(y, x);
+
+                U32 bits = 0;
+                for (I32 dy = -r; dy <= r; dy++)
+                {
+                    const U8* row = src.ptr<U8>(y + dy);
+                    for (I32 dx = -r; dx <= r; dx++)
+                    {
+                        if (dx == 0 && dy == 0)
+                        {
+                            continue;
+                        }
+
+                        bits = (bits << 1) | (row[x + dx] < center);
+                    }
+                }
+
+                out[x] = bits;
+            }
+        }
+    }
+
+    void CensusStereo::cost_row(const U32* left, const U32* right, U8* cost) const
+    {
+        const I32 cols = m_census_left.cols;
+        const I32 D = m_num_disparities;
+
+        for (I32 x = 0; x < cols; x++)
+        {
+            U8* c = &cost[x * D];
+            I32 d = 0;
+
+#if defined(__ARM_NEON)
+            // Eight disparities at a time
+            // Increasing disparity walks right to left along the right image
+            const uint32x4_t l = vdupq_n_u32(left[x]);
+            for (; d + 8 <= D; d += 8)
+            {
+                I32 xr = x - m_min_disparity - d;
+                if (xr - 7 < 0 || xr >= cols)
+                {
+                    for (I32 i = 0; i < 8; i++)
+                    {
+                        I32 xri = xr - i;
+                        c[d + i] = (xri >= 0 && xri < cols) ?
+                                   static_cast<U8>(__builtin_popcount(left[x] ^ right[xri])) :
+                                   static_cast<U8>(MAX_COST);
+                    }
+
+                    continue;
+                }
+
+                uint32x4_t r0 = vld1q_u32(&right[xr - 3]);
+                uint32x4_t r1 = vld1q_u32(&right[xr - 7]);
+
+                // Reverse so lane i holds disparity d + i
+                r0 = vrev64q_u32(r0);
+                r0 = vcombine_u32(vget_high_u32(r0), vget_low_u32(r0));
+                r1 = vrev64q_u32(r1);
+                r1 = vcombine_u32(vget_high_u32(r1), vget_low_u32(r1));
+
+                uint32x4_t c0 = vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(veorq_u32(l, r0)))));
+                uint32x4_t c1 = vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(veorq_u32(l, r1)))));
+
+                vst1_u8(&c[d], vmovn_u16(vcombine_u16(vmovn_u32(c0), vmovn_u32(c1))));
+            }
+#endif
+
+            for (; d < D; d++)
+            {
+                I32 xr = x - m_min_disparity - d;
+                c[d] = (xr >= 0 && xr < cols) ?
+                       static_cast<U8>(__builtin_popcount(left[x] ^ right[xr])) :
+                       static_cast<U8>(MAX_COST);
+            }
+        }
+    }
+
+    void CensusStereo::compute(cv::InputArray left_, cv::InputArray right_, cv::OutputArray disparity_)
+    {
+        cv::Mat left = left_.getMat();
+        cv::Mat right = right_.getMat();
+
+        FW_ASSERT(left.type() == CV_8U && right.type() == CV_8U, left.type(), right.type());
+        FW_ASSERT(left.size() == right.size());
+        FW_ASSERT(m_num_disparities > 0, m_num_disparities);
+
+        disparity_.create(left.size(), CV_16S);
+        cv::Mat disparity = disparity_.getMat();
+
+        census(left, m_census_left);
+        census(right, m_census_right);
+
+        // No-op unless the frame size changed
+        m_best.resize(left.cols);
+        m_best_right.resize(left.cols);
+
+        if (m_sgm)
+        {
+            aggregate_sgm(left, right, disparity);
+        }
+        else
+        {
+            aggregate_box(left, right, disparity);
+        }
+
+        if (m_speckle_window_size > 0)
+        {
+            cv::filterSpeckles(disparity,
+                               (m_min_disparity - 1) * cv::StereoMatcher::DISP_SCALE,
+                               m_speckle_window_size,
+                               cv::StereoMatcher::DISP_SCALE * m_speckle_range,
+                               m_speckle_buffer);
+        }
+    }
+
+    void CensusStereo::refine(cv::InputArray left_, cv::InputArray right_,
+                              const cv::Mat& coarse, I32 scale, I32 coarse_min, I32 radius,
+                              cv::OutputArray disparity_)
+    {
+        cv::Mat left = left_.getMat();
+        cv::Mat right = right_.getMat();
+
+        FW_ASSERT(left.type() == CV_8U && right.type() == CV_8U, left.type(), right.type());
+        FW_ASSERT(left.size() == right.size());
+        FW_ASSERT(coarse.type() == CV_16S, coarse.type());
+        FW_ASSERT(scale > 0, scale);
+        FW_ASSERT(radius >= 0 && radius <= REFINE_RADIUS_MAX, radius);
+
+        disparity_.create(left.size(), CV_16S);
+        cv::Mat disparity = disparity_.getMat();
+
+        census(left, m_census_left);
+        census(right, m_census_right);
+
+        const I32 rows = left.rows;
+        const I32 cols = left.cols;
+        const I32 K = 2 * radius + 1;
+        const I32 lo = m_min_disparity;
+        const I32 hi = m_min_disparity + m_num_disparities - 1;
+        const I32 coarse_valid = coarse_min * cv::StereoMatcher::DISP_SCALE;
+        const I16 invalid = static_cast<I16>((m_min_disparity - 1) * cv::StereoMatcher::DISP_SCALE);
+        const I32 no_guide = std::numeric_limits<I32>::min();
+
+        // Search centre of each pixel from the coarse pixel covering it
+        m_guide.create(left.size(), CV_32S);
+        for (I32 y = 0; y < rows; y++)
+        {
+            const I16* c = coarse.ptr<I16>(std::min(y / scale, coarse.rows - 1));
+            I32* g = m_guide.ptr<I32>(y);
+            for (I32 x = 0; x < cols; x++)
+            {
+                I32 v = c[std::min(x / scale, coarse.cols - 1)];
+                if (v < coarse_valid)
+                {
+                    g[x] = no_guide;
+                    continue;
+                }
+
+                I32 d = (v * scale + cv::StereoMatcher::DISP_SCALE / 2) >> cv::StereoMatcher::DISP_SHIFT;
+                g[x] = std::max(lo, std::min(hi, d));
+            }
+        }
+
+        // One cost image per offset from the guide
+        // Neighbours in the window are compared at the centre pixel's offset
+        // which holds wherever the coarse disparity is locally smooth
+        m_refine_sum.resize(K);
+        m_refine_cost.create(left.size(), CV_8U);
+        for (I32 k = 0; k < K; k++)
+        {
+            const I32 offset = k - radius;
+            for (I32 y = 0; y < rows; y++)
+            {
+                const U32* l = m_census_left.ptr<U32>(y);
+                const U32* r = m_census_right.ptr<U32>(y);
+                const I32* g = m_guide.ptr<I32>(y);
+                U8* c = m_refine_cost.ptr<U8>(y);
+
+                for (I32 x = 0; x < cols; x++)
+                {
+                    I32 d = g[x] + offset;
+                    I32 xr = x - d;
+                    c[x] = (g[x] != no_guide && d >= lo && d <= hi && xr >= 0 && xr < cols) ?
+                           static_cast<U8>(__builtin_popcount(l[x] ^ r[xr])) :
+                           static_cast<U8>(MAX_COST);
+                }
+            }
+
+            cv::boxFilter(m_refine_cost, m_refine_sum[k], CV_16U,
+                          cv::Size(m_block_size, m_block_size),
+                          cv::Point(-1, -1), false, cv::BORDER_REPLICATE);
+        }
+
+        for (I32 y = 0; y < rows; y++)
+        {
+            const U16* sums[2 * REFINE_RADIUS_MAX + 1];
+            for (I32 k = 0; k < K; k++)
+            {
+                sums[k] = m_refine_sum[k].ptr<U16>(y);
+            }
+
+            const I32* g = m_guide.ptr<I32>(y);
+            I16* out = disparity.ptr<I16>(y);
+
+            for (I32 x = 0; x < cols; x++)
+            {
+                out[x] = invalid;
+                if (g[x] == no_guide)
+                {
+                    continue;
+                }
+
+                I32 s[2 * REFINE_RADIUS_MAX + 1];
+                I32 best = 0;
+                for (I32 k = 0; k < K; k++)
+                {
+                    s[k] = sums[k][x];
+                    if (s[k] < s[best]) best = k;
+                }
+
+                I32 d = g[x] + best - radius;
+                if (d < lo || d > hi)
+                {
+                    continue;
+                }
+
+                // Reject ambiguous matches (same test as select_row)
+                bool unique = true;
+                for (I32 k = 0; k < K && unique; k++)
+                {
+                    if (std::abs(k - best) > 1 &&
+                        s[k] * (100 - m_uniqueness_ratio) < s[best] * 100)
+                    {
+                        unique = false;
+                    }
+                }
+
+                if (!unique)
+                {
+                    continue;
+                }
+
+                I32 d16 = d * cv::StereoMatcher::DISP_SCALE;
+                if (best > 0 && best + 1 < K)
+                {
+                    I32 denom2 = std::max(s[best - 1] + s[best + 1] - 2 * s[best], 1);
+                    d16 += ((s[best - 1] - s[best + 1]) * cv::StereoMatcher::DISP_SCALE + denom2) / (denom2 * 2);
+                }
+
+                out[x] = static_cast<I16>(d16);
+            }
+        }
+
+        if (m_speckle_window_size > 0)
+        {
+            cv::filterSpeckles(disparity, invalid,
+                               m_speckle_window_size,
+                               cv::StereoMatcher::DISP_SCALE * m_speckle_range,
+                               m_speckle_buffer);
+        }
+    }
+
+    void CensusStereo::aggregate_box(const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity)
+    {
+        const I32 rows = left.rows;
+        const I32 cols = left.cols;
+        const I32 D = m_num_disparities;
+        const I32 r = m_block_size / 2;
+        const size_t row_size = cols * D;
+
+        // Pixel costs are only kept for the rows the window spans while sliding down
+        const I32 window = 2 * r + 2;
+        m_cost.resize(window * row_size);
+        auto cost = [&](I32 y) { return &m_cost[(y % window) * row_size]; };
+
+        m_column.assign(row_size, 0);
+        m_sum.resize(row_size);
+
+        // Window column sums start with the rows below the first row
+        for (I32 y = 0; y <= std::min(r, rows - 1); y++)
+        {
+            U8* c = cost(y);
+            cost_row(m_census_left.ptr<U32>(y), m_census_right.ptr<U32>(y), c);
+            for (size_t i = 0; i < row_size; i++)
+            {
+                m_column[i] += c[i];
+            }
+        }
+
+        std::vector<U32> acc(D);
+        for (I32 y = 0; y < rows; y++)
+        {
+            // Slide the window along the row
+            std::fill(acc.begin(), acc.end(), 0);
+            for (I32 x = 0; x <= std::min(r, cols - 1); x++)
+            {
+                for (I32 d = 0; d < D; d++) acc[d] += m_column[x * D + d];
+            }
+
+            for (I32 x = 0; x < cols; x++)
+            {
+                U16* s = &m_sum[x * D];
+                for (I32 d = 0; d < D; d++) s[d] = static_cast<U16>(acc[d]);
+
+                if (x + r + 1 < cols)
+                {
+                    const U16* add = &m_column[(x + r + 1) * D];
+                    for (I32 d = 0; d < D; d++) acc[d] += add[d];
+                }
+
+                if (x - r >= 0)
+                {
+                    const U16* sub = &m_column[(x - r) * D];
+                    for (I32 d = 0; d < D; d++) acc[d] -= sub[d];
+                }
+            }
+
+            select_row(m_sum.data(), disparity.ptr<I16>(y));
+
+            // Slide the window down
+            // The new row replaces the one that left the window on the last row
+            if (y + r + 1 < rows)
+            {
+                U8* c = cost(y + r + 1);
+                cost_row(m_census_left.ptr<U32>(y + r + 1), m_census_right.ptr<U32>(y + r + 1), c);
+                for (size_t i = 0; i < row_size; i++) m_column[i] += c[i];
+            }
+
+            if (y - r >= 0)
+            {
+                const U8* c = cost(y - r);
+                for (size_t i = 0; i < row_size; i++) m_column[i] -= c[i];
+            }
+        }
+    }
+
+    void CensusStereo::path_step(const U8* cost, const U16* prev, U16* cur, U16* sum) const
+    {
+        const I32 D = m_num_disparities;
+        const U16 min_prev = *std::min_element(prev, prev + D);
+        const U32 jump = min_prev + m_p2;
+
+        for (I32 d = 0; d < D; d++)
+        {
+            U32 v = prev[d];
+            if (d > 0) v = std::min<U32>(v, prev[d - 1] + m_p1);
+            if (d + 1 < D) v = std::min<U32>(v, prev[d + 1] + m_p1);
+            v = std::min(v, jump);
+
+            cur[d] = static_cast<U16>(cost[d] + v - min_prev);
+        }
+
+        if (sum == nullptr)
+        {
+            return;
+        }
+
+        for (I32 d = 0; d < D; d++)
+        {
+            sum[d] += cur[d];
+        }
+    }
+
+    void CensusStereo::aggregate_sgm(const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity)
+    {
+        const I32 rows = left.rows;
+        const I32 cols = left.cols;
+        const I32 D = m_num_disparities;
+        const size_t row_size = cols * D;
+
+        // The top to bottom path of a row must be known when the bottom to top
+        // path reaches it. Rather than keeping it for every row, it is kept at
+        // the first row of each block and recomputed one block at a time on
+        // the way back up. Memory is O(sqrt(rows)) rows for one extra path.
+        const I32 block = static_cast<I32>(std::ceil(std::sqrt(static_cast<F64>(rows))));
+        const I32 blocks = (rows + block - 1) / block;
+
+        m_checkpoint.resize(blocks * row_size);
+        m_down.resize(block * row_size);
+        m_cost.resize(block * row_size);
+        m_sum.resize(row_size);
+
+        // Two vertical path rows, the horizontal path of the previous pixel
+        // and a scratch path for the current pixel
+        m_path.resize(2 * row_size + 3 * D);
+
+        // Path start is the pixel cost alone
+        auto start = [D](const U8* cost, U16* path, U16* sum) {
+            for (I32 d = 0; d < D; d++)
+            {
+                path[d] = cost[d];
+                sum[d] += cost[d];
+            }
+        };
+
+        // Top to bottom pass, only the first row of each block is kept
+        U16* down = m_path.data();
+        U16* down_next = down + row_size;
+        for (I32 y = 0; y < rows; y++)
+        {
+            U8* c = m_cost.data();
+            cost_row(m_census_left.ptr<U32>(y), m_census_right.ptr<U32>(y), c);
+
+            if (y == 0) std::copy(c, c + row_size, down);
+            else
+            {
+                for (I32 x = 0; x < cols; x++)
+                {
+                    path_step(&c[x * D], &down[x * D], &down_next[x * D], nullptr);
+                }
+
+                std::swap(down, down_next);
+            }
+
+            if (y % block == 0)
+            {
+                std::memcpy(&m_checkpoint[(y / block) * row_size], down, row_size * sizeof(U16));
+            }
+        }
+
+        U16* up = m_path.data();
+        U16* horizontal = up + 2 * row_size;
+        U16* scratch = horizontal + D;
+        U16* next = scratch + D;
+
+        for (I32 b = blocks - 1; b >= 0; b--)
+        {
+            const I32 first = b * block;
+            const I32 n = std::min(block, rows - first);
+
+            // Top to bottom path of the block from its first row
+            for (I32 i = 0; i < n; i++)
+            {
+                U8* c = &m_cost[i * row_size];
+                cost_row(m_census_left.ptr<U32>(first + i), m_census_right.ptr<U32>(first + i), c);
+
+                U16* v = &m_down[i * row_size];
+                if (i == 0) std::memcpy(v, &m_checkpoint[b * row_size], row_size * sizeof(U16));
+                else
+                {
+                    for (I32 x = 0; x < cols; x++)
+                    {
+                        path_step(&c[x * D], &v[x * D - row_size], &v[x * D], nullptr);
+                    }
+                }
+            }
+
+            // Remaining paths, bottom to top
+            for (I32 i = n - 1; i >= 0; i--)
+            {
+                const I32 y = first + i;
+                const U8* c = &m_cost[i * row_size];
+                U16* s = m_sum.data();
+                std::memcpy(s, &m_down[i * row_size], row_size * sizeof(U16));
+
+                // Left to right
+                for (I32 x = 0; x < cols; x++)
+                {
+                    if (x == 0) start(&c[x * D], horizontal, &s[x * D]);
+                    else
+                    {
+                        path_step(&c[x * D], horizontal, next, &s[x * D]);
+                        std::swap(horizontal, next);
+                    }
+                }
+
+                // Right to left
+                for (I32 x = cols - 1; x >= 0; x--)
+                {
+                    if (x == cols - 1) start(&c[x * D], horizontal, &s[x * D]);
+                    else
+                    {
+                        path_step(&c[x * D], horizontal, next, &s[x * D]);
+                        std::swap(horizontal, next);
+                    }
+                }
+
+                // Bottom to top
+                for (I32 x = 0; x < cols; x++)
+                {
+                    U16* v = &up[x * D];
+                    if (y == rows - 1) start(&c[x * D], v, &s[x * D]);
+                    else
+                    {
+                        path_step(&c[x * D], v, scratch, &s[x * D]);
+                        std::memcpy(v, scratch, D * sizeof(U16));
+                    }
+                }
+
+                select_row(s, disparity.ptr<I16>(y));
+            }
+        }
+    }
+
+    void CensusStereo::select_row(const U16* sum, I16* disparity)
+    {
+        const I32 cols = m_census_left.cols;
+        const I32 D = m_num_disparities;
+        const I16 invalid = static_cast<I16>((m_min_disparity - 1) * cv::StereoMatcher::DISP_SCALE);
+
+        for (I32 x = 0; x < cols; x++)
+        {
+            const U16* s = &sum[x * D];
+            I32 best = static_cast<I32>(std::min_element(s, s + D) - s);
+            I32 xr = x - m_min_disparity - best;
+
+            m_best[x] = -1;
+            disparity[x] = invalid;
+
+            // Best match is outside the right image
+            if (xr < 0 || xr >= cols)
+            {
+                continue;
+            }
+
+            // Reject ambiguous matches (same test as StereoSGBM)
+            bool unique = true;
+            for (I32 d = 0; d < D && unique; d++)
+            {
+                if (std::abs(d - best) > 1 &&
+                    static_cast<I32>(s[d]) * (100 - m_uniqueness_ratio) < static_cast<I32>(s[best]) * 100)
+                {
+                    unique = false;
+                }
+            }
+
+            if (!unique)
+            {
+                continue;
+            }
+
+            // Sub-pixel refinement with a parabola through the neighbours
+            I32 d16 = (m_min_disparity + best) * cv::StereoMatcher::DISP_SCALE;
+            if (best > 0 && best + 1 < D)
+            {
+                I32 denom2 = std::max(s[best - 1] + s[best + 1] - 2 * s[best], 1);
+                d16 += ((s[best - 1] - s[best + 1]) * cv::StereoMatcher::DISP_SCALE + denom2) / (denom2 * 2);
+            }
+
+            m_best[x] = best;
+            disparity[x] = static_cast<I16>(d16);
+        }
+
+        if (m_disp12_max_diff < 0)
+        {
+            return;
+        }
+
+        // Best match of each right image pixel using the same aggregated costs
+        for (I32 xr = 0; xr < cols; xr++)
+        {
+            I32 best = -1;
+            U32 best_cost = ~0U;
+            for (I32 d = 0; d < D; d++)
+            {
+                I32 xl = xr + m_min_disparity + d;
+                if (xl < 0 || xl >= cols) continue;
+
+                U32 cost = sum[xl * D + d];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best = d;
+                }
+            }
+
+            m_best_right[xr] = best;
+        }
+
+        // Left-right consistency
+        for (I32 x = 0; x < cols; x++)
+        {
+            if (m_best[x] < 0) continue;
+
+            I32 xr = x - m_min_disparity - m_best[x];
+            I32 r = m_best_right[xr];
+            if (r >= 0 && std::abs(r - m_best[x]) > m_disp12_max_diff)
+            {
+                disparity[x] = invalid;
+            }
+        }
+    }
+
+    I32 CensusStereo::getMinDisparity() const
+    {
+        return m_min_disparity;
+    }
+
+    void CensusStereo::setMinDisparity(I32 minDisparity)
+    {
+        m_min_disparity = minDisparity;
+    }
+
+    I32 CensusStereo::getNumDisparities() const
+    {
+        return m_num_disparities;
+    }
+
+    void CensusStereo::setNumDisparities(I32 numDisparities)
+    {
+        m_num_disparities = numDisparities;
+    }
+
+    I32 CensusStereo::getBlockSize() const
+    {
+        return m_block_size;
+    }
+
+    void CensusStereo::setBlockSize(I32 blockSize)
+    {
+        m_block_size = blockSize;
+    }
+
+    I32 CensusStereo::getSpeckleWindowSize() const
+    {
+        return m_speckle_window_size;
+    }
+
+    void CensusStereo::setSpeckleWindowSize(I32 speckleWindowSize)
+    {
+        m_speckle_window_size = speckleWindowSize;
+    }
+
+    I32 CensusStereo::getSpeckleRange() const
+    {
+        return m_speckle_range;
+    }
+
+    void CensusStereo::setSpeckleRange(I32 speckleRange)
+    {
+        m_speckle_range = speckleRange;
+    }
+
+    I32 CensusStereo::getDisp12MaxDiff() const
+    {
+        return m_disp12_max_diff;
+    }
+
+    void CensusStereo::setDisp12MaxDiff(I32 disp12MaxDiff)
+    {
+        m_disp12_max_diff = disp12MaxDiff;
+    }
+
+    void CensusStereo::setUniquenessRatio(I32 uniquenessRatio)
+    {
+        m_uniqueness_ratio = uniquenessRatio;
+    }
+
+    void CensusStereo::setPenalties(I32 p1, I32 p2)
+    {
+        // Large jumps should never be cheaper than small ones
+        m_p1 = std::max(0, p1);
+        m_p2 = std::max(m_p1, p2);
+    }
+}
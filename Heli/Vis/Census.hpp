@@ -0,0 +1,144 @@
+//
+// Created by tumbar on 4/8/23.
+//
+
+#ifndef STEREO_HELI_CENSUS_HPP
+#define STEREO_HELI_CENSUS_HPP
+
+#include <Fw/Types/BasicTypes.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+#include <vector>
+
+namespace Heli
+{
+    /**
+     * Census transform stereo matcher.
+     *
+     * Each pixel is described by a 5x5 census bit string (which of its
+     * neighbours are darker than it). The matching cost is the Hamming
+     * distance between the left and right descriptors, which only depends
+     * on the local ordering of intensities and is robust to exposure
+     * and gain differences between the two sensors.
+     *
+     * Costs are aggregated either with a square box window (fast) or with
+     * four path semi-global matching (left, right, up and down). The output
+     * follows the OpenCV convention: CV_16S disparity with 4 fractional bits
+     * and (minDisparity - 1) * 16 on invalid pixels, so it can replace
+     * StereoBM/StereoSGBM anywhere in the pipeline.
+     *
+     * The cost volume is never materialised. Pixel costs are computed
+     * per row as the aggregation reaches them. The box window keeps
+     * block size + 1 rows of costs. SGM keeps about 2 * sqrt(rows) rows
+     * of path costs and recomputes the top to bottom path once, about
+     * 4.7 MB at 640x480 with 64 disparities against 59 MB for the volume.
+     *
+     * All working memory is kept between frames and only reallocated
+     * when the frame size or disparity range changes.
+     */
+    class CensusStereo : public cv::StereoMatcher
+    {
+    public:
+        enum
+        {
+            CENSUS_RADIUS = 2,              //!< 5x5 window
+            CENSUS_BITS = 24,               //!< Neighbours compared per pixel
+            MAX_COST = CENSUS_BITS + 1,     //!< Cost of matching outside the image
+            REFINE_RADIUS_MAX = 8,          //!< Widest refinement search on either side of the guide
+        };
+
+        /**
+         * Create a census matcher
+         * @param sgm aggregate with 4 path semi-global matching instead of a box window
+         */
+        static cv::Ptr<CensusStereo> create(bool sgm);
+
+        explicit CensusStereo(bool sgm);
+
+        void compute(cv::InputArray left, cv::InputArray right, cv::OutputArray disparity) override;
+
+        /**
+         * Refine a disparity map matched on downsampled frames
+         * Each pixel only searches the disparities within radius of its
+         * upsampled coarse disparity so the cost does not grow with the
+         * disparity range. Costs are aggregated with a box window and the
+         * output covers the disparity range of this matcher.
+         * @param left full resolution left frame
+         * @param right full resolution right frame
+         * @param coarse CV_16S disparity of the frames downsampled by scale
+         * @param scale downsampling factor of the coarse frames
+         * @param coarse_min minimum disparity of the coarse match, lower values are invalid
+         * @param radius disparities searched on either side of the coarse disparity
+         * @param disparity CV_16S output disparity
+         */
+        void refine(cv::InputArray left, cv::InputArray right,
+                    const cv::Mat& coarse, I32 scale, I32 coarse_min, I32 radius,
+                    cv::OutputArray disparity);
+
+        I32 getMinDisparity() const override;
+        void setMinDisparity(I32 minDisparity) override;
+
+        I32 getNumDisparities() const override;
+        void setNumDisparities(I32 numDisparities) override;
+
+        I32 getBlockSize() const override;
+        void setBlockSize(I32 blockSize) override;
+
+        I32 getSpeckleWindowSize() const override;
+        void setSpeckleWindowSize(I32 speckleWindowSize) override;
+
+        I32 getSpeckleRange() const override;
+        void setSpeckleRange(I32 speckleRange) override;
+
+        I32 getDisp12MaxDiff() const override;
+        void setDisp12MaxDiff(I32 disp12MaxDiff) override;
+
+        void setUniquenessRatio(I32 uniquenessRatio);
+
+        //! Semi-global penalties for disparity changes of one and more than one pixel
+        void setPenalties(I32 p1, I32 p2);
+
+    PRIVATE:
+        static void census(const cv::Mat& src, cv::Mat& dst);
+
+        void cost_row(const U32* left, const U32* right, U8* cost) const;
+        void aggregate_box(const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity);
+        void aggregate_sgm(const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity);
+
+        void path_step(const U8* cost, const U16* prev, U16* cur, U16* sum) const;
+        void select_row(const U16* sum, I16* disparity);
+
+        bool m_sgm;
+
+        I32 m_min_disparity;
+        I32 m_num_disparities;
+        I32 m_block_size;
+        I32 m_speckle_window_size;
+        I32 m_speckle_range;
+        I32 m_disp12_max_diff;
+        I32 m_uniqueness_ratio;
+        I32 m_p1;
+        I32 m_p2;
+
+        cv::Mat m_census_left;          //!< CV_32S descriptors
+        cv::Mat m_census_right;
+        cv::Mat m_speckle_buffer;
+
+        std::vector<U8> m_cost;         //!< Pixel costs of the rows in flight, cols * D per row
+        std::vector<U16> m_sum;         //!< Aggregated costs of one row, cols * D
+        std::vector<U16> m_column;      //!< Box window column sums, cols * D
+        std::vector<U16> m_path;        //!< Semi-global path costs
+        std::vector<U16> m_checkpoint;  //!< Top to bottom path at the first row of each SGM block
+        std::vector<U16> m_down;        //!< Top to bottom path of the rows of one SGM block
+        std::vector<I32> m_best;        //!< Left to right best disparity index per column
+        std::vector<I32> m_best_right;  //!< Right to left best disparity index per column
+
+        cv::Mat m_guide;                //!< CV_32S disparity each pixel is refined around
+        cv::Mat m_refine_cost;          //!< CV_8U pixel costs of one guide offset
+        std::vector<cv::Mat> m_refine_sum;  //!< CV_16U aggregated costs per guide offset
+    };
+}
+
+#endif //STEREO_HELI_CENSUS_HPP
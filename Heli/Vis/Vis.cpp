@@ -3,14 +3,34 @@
 //
 
 #include <Heli/Vis/Vis.hpp>
-#include <opencv2/imgcodecs.hpp>
+#include <Heli/Vis/FppConstantsAc.hpp>
+#include <Heli/Nav/FppConstantsAc.hpp>
+#include <Heli/Trace/FrameTrace.hpp>
+#include <Heli/parallel/policy.hpp>
+#include <Fw/Types/Assert.hpp>
 
+#include <algorithm>
 #include <vector>
 
 namespace Heli
 {
+    static_assert(VIS_PROFILE_STAGE_N == Vis_PROFILE_STAGE_N,
+                  "Stage timing telemetry must cover every profiled stage");
+    static_assert(VIS_STIXEL_N == Nav_STIXEL_N,
+                  "Stixel telemetry must cover every column bin");
+
     Vis::Vis(const char* componentName)
-            : VisComponentBase(componentName), is_capturing(false)
+            : VisComponentBase(componentName),
+              m_pipeline([this](VisFrame& frame) { frame_complete(frame); }),
+              m_fx_scale(1.0), m_fy_scale(1.0), m_disparity(false), m_depth(false), m_allocations(0), m_profile_frames(0),
+              m_capture({
+                      [this](CamSelect camera, const char* file)
+                      { log_ACTIVITY_LO_CaptureCompleted(camera, file); },
+                      [this](const char* file, const char* error)
+                      { log_WARNING_LO_CaptureFailed(file, error); },
+                      [this](FwOpcodeType opCode, U32 cmdSeq, bool ok)
+                      { cmdResponse_out(opCode, cmdSeq, ok ? Fw::CmdResponse::OK : Fw::CmdResponse::EXECUTION_ERROR); }
+              })
     {
     }
 
@@ -19,6 +39,11 @@ namespace Heli
         VisComponentBase::init(queueDepth, instance);
     }
 
+    void Vis::preamble()
+    {
+        libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::VISION, "vis");
+    }
+
     void Vis::frame_handler(NATIVE_INT_TYPE portNum, U32 frameId)
     {
         CamFrame leftFrame, rightFrame;
@@ -44,87 +69,190 @@ namespace Heli
                       rightFrame.getData(),
                       rightFrame.getInfo().stride);
 
-        for (auto &stage: m_stages)
+        // Stages may still be working on the frames before this one
+        VisFrame& frame = m_pipeline.acquire(frameId);
+        frame.left = left;
+        frame.right = right;
+        m_pipeline.push(frame);
+    }
+
+    void Vis::frame_complete(VisFrame& frame)
+    {
+        // Should settle at zero once the arena is warm
+        U32 total_allocations = VisArena::allocations();
+        tlmWrite_FrameAllocations(total_allocations - m_allocations);
+        tlmWrite_Allocations(total_allocations);
+        m_allocations = total_allocations;
+
+        // Frames complete on the worker of their slot
+        const cv::Mat& samples = m_arena.samples();
+        if (!samples.empty())
         {
-            // Process is performed in-place
-            stage->process(left, right);
+            publish_samples(samples);
         }
 
-        if (is_capturing)
+        const cv::Mat& stixels = m_arena.stixels();
+        if (!stixels.empty())
         {
-            std::string filename = m_capture.location.toChar();
-            std::string extension;
+            publish_stixels(frame.id, stixels);
+        }
 
-            switch (m_capture.encoding.e)
-            {
-                case ImageEncoding::JPEG:
-                    extension = ".jpg";
-                    break;
-                case ImageEncoding::PNG:
-                    extension = ".png";
-                    break;
-                case ImageEncoding::TIFF:
-                    extension = ".tiff";
-                    break;
-            }
+        const cv::Mat& cloud = m_arena.cloud();
+        if (!cloud.empty())
+        {
+            publish_cloud(frame.id, cloud, m_arena.cloud_n());
+        }
 
-            switch (m_capture.eye.e)
+        if (++m_profile_frames >= VIS_PROFILE_PUBLISH_PERIOD)
+        {
+            m_profile_frames = 0;
+            publish_profile();
+        }
+
+        // Capture snapshots are copies made on request, not pipeline allocations
+        bool counted = VisArena::count(false);
+        bool queued = m_capture.frame(frame.left, frame.right);
+        VisArena::count(counted);
+
+        if (queued)
+        {
+            log_WARNING_LO_CaptureQueueFull_ThrottleClear();
+        }
+        else
+        {
+            // Try again on the next frame
+            log_WARNING_LO_CaptureQueueFull();
+        }
+
+        frameOut_out(0, frame.id);
+    }
+
+    void Vis::publish_profile()
+    {
+        VisStageTimings timings;
+        for (U32 i = 0; i < VIS_PROFILE_STAGE_N; i++)
+        {
+            VisProfile::Summary p = m_pipeline.profile(i);
+            timings[i] = VisStageTiming(p.min, p.mean, p.max, p.p95);
+        }
+
+        tlmWrite_StageTiming(timings);
+    }
+
+    void Vis::publish_samples(const cv::Mat& samples)
+    {
+        F32 nearest = 0;
+        U32 valid = 0;
+        for (I32 i = 0; i < samples.rows; i++)
+        {
+            F32 depth = samples.at<F32>(i, 2);
+            if (depth > 0)
             {
-                case CamSelect::LEFT:
-                {
-                    log_ACTIVITY_LO_CaptureCompleted(CamSelect::LEFT, (filename + extension).c_str());
-                    cv::imwrite(filename + extension, left);
-                }
-                    break;
-                case CamSelect::RIGHT:
-                {
-                    log_ACTIVITY_LO_CaptureCompleted(CamSelect::RIGHT, (filename + extension).c_str());
-                    cv::imwrite(filename + extension, right);
-                }
-                    break;
-                case CamSelect::BOTH:
-                {
-                    if (m_capture.encoding == ImageEncoding::TIFF)
-                    {
-                        // Store both images in a single tiff file
-                        std::vector<cv::Mat> layers;
-                        layers.push_back(left);
-                        layers.push_back(right);
-
-                        log_ACTIVITY_LO_CaptureCompleted(CamSelect::BOTH, (filename + extension).c_str());
-                        cv::imwrite(filename + extension, layers);
-                    }
-                    else
-                    {
-                        // Store both images in separate files
-                        log_ACTIVITY_LO_CaptureCompleted(CamSelect::LEFT, (filename + "-left" + extension).c_str());
-                        cv::imwrite(filename + "-left" + extension, left);
-
-                        log_ACTIVITY_LO_CaptureCompleted(CamSelect::RIGHT, (filename + "-right" + extension).c_str());
-                        cv::imwrite(filename + "-right" + extension, right);
-                    }
-                }
-                    break;
+                nearest = valid == 0 ? depth : std::min(nearest, depth);
+                valid++;
             }
+        }
+
+        tlmWrite_SparseNearest(nearest);
+        tlmWrite_SparseValid(valid);
+    }
+
+    void Vis::publish_stixels(U32 frameId, const cv::Mat& stixels)
+    {
+        StixelDepths depth;
+        StixelBases base;
+        for (U32 i = 0; i < VIS_STIXEL_N; i++)
+        {
+            depth[i] = stixels.at<F32>(0, static_cast<I32>(i));
+            base[i] = static_cast<I16>(stixels.at<F32>(1, static_cast<I32>(i)));
+        }
+
+        if (isConnected_stixels_OutputPort(0))
+        {
+            stixels_out(0, frameId, depth, base);
+        }
+
+        tlmWrite_StixelDepth(depth);
+        tlmWrite_StixelBase(base);
+    }
+
+    void Vis::publish_cloud(U32 frameId, const cv::Mat& cloud, U32 n)
+    {
+        // Nav copies the points out of the arena during the call
+        if (isConnected_cloud_OutputPort(0))
+        {
+            cv::Mat points = cloud.rowRange(0, static_cast<I32>(n));
+            cloud_out(0, frameId, Mat(points));
+        }
+
+        tlmWrite_CloudPoints(n);
+    }
 
-            is_capturing = false;
-            cmdResponse_out(m_capture.opCode, m_capture.cmdSeq, Fw::CmdResponse::OK);
+    void Vis::PROFILE_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        U32 stage_n = std::min<U32>(m_stages.size(), VIS_PROFILE_STAGE_N);
+
+        VisProfile::Summary summaries[VIS_PROFILE_STAGE_N];
+        U32 total = 0;
+        U32 frames = 0;
+        for (U32 i = 0; i < stage_n; i++)
+        {
+            summaries[i] = m_pipeline.profile(i);
+            total += summaries[i].mean;
+            frames = std::max(frames, summaries[i].count);
         }
 
-        frameOut_out(0, frameId);
+        for (U32 i = 0; i < stage_n; i++)
+        {
+            const VisProfile::Summary& p = summaries[i];
+            F32 share = total > 0 ? 100.0f * static_cast<F32>(p.mean) / static_cast<F32>(total) : 0.0f;
+            log_ACTIVITY_HI_StageProfile(i, m_stages[i]->name(),
+                                         p.min, p.mean, p.max, p.p95, share);
+        }
+
+        log_ACTIVITY_HI_FrameProfile(stage_n, frames, total);
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
     void Vis::CLEAR_cmdHandler(U32 opCode, U32 cmdSeq)
     {
+        m_pipeline.stop();
         m_stages.clear();
+        m_fx_scale = 1.0;
+        m_fy_scale = 1.0;
+        m_disparity = false;
+        m_depth = false;
+        reset_arena();
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
+    void Vis::reset_arena()
+    {
+        m_arena.clear();
+
+        // Frames are sized by the camera model
+        // Stages that change the size reallocate on their first frame
+        if (m_calib.isValid())
+        {
+            m_arena.reserve(m_calib.size, CV_8U);
+        }
+    }
+
+    void Vis::add_stage(VisStage* stage)
+    {
+        // Stages cannot change under frames in flight
+        m_pipeline.stop();
+        m_stages.emplace_back(stage);
+        m_pipeline.start(m_stages);
+    }
+
     void Vis::RECTIFY_cmdHandler(U32 opCode, U32 cmdSeq)
     {
         if (m_calib.isValid())
         {
-            m_stages.emplace_back(new RectifyStage(m_calib));
+            add_stage(new RectifyStage(m_arena, m_calib));
+            m_disparity = false;
+            m_depth = false;
             cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
         }
         else
@@ -134,31 +262,258 @@ namespace Heli
         }
     }
 
+    void Vis::RECTIFY_SCALE_cmdHandler(U32 opCode, U32 cmdSeq, F32 fx, F32 fy, Heli::Vis_Interpolation interp)
+    {
+        if (m_calib.isValid())
+        {
+            add_stage(new RectifyStage(m_arena, m_calib, fx, fy, interp));
+            m_fx_scale *= fx;
+            m_fy_scale *= fy;
+            m_disparity = false;
+            m_depth = false;
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+        }
+        else
+        {
+            log_WARNING_HI_NoValidCameraModel();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+        }
+    }
+
+    StereoParams Vis::stereo_params()
+    {
+        Fw::ParamValid valid;
+
+        StereoParams params;
+        params.pre_filter_cap = paramGet_STEREO_PRE_FILTER_CAP(valid);
+        params.block_size = paramGet_STEREO_BLOCK_SIZE(valid);
+        params.min_disparity = paramGet_STEREO_MIN_DISPARITY(valid);
+        params.num_disparities = paramGet_STEREO_NUM_DISPARITIES(valid);
+        params.uniqueness_ratio = paramGet_STEREO_UNIQUENESS_RATIO(valid);
+        params.speckle_window_size = paramGet_STEREO_SPECKLE_WINDOW_SIZE(valid);
+        params.speckle_range = paramGet_STEREO_SPECKLE_RANGE(valid);
+        params.bm_texture_threshold = paramGet_STEREO_BM_TEXTURE_THRESHOLD(valid);
+        params.census_p1 = paramGet_STEREO_CENSUS_P1(valid);
+        params.census_p2 = paramGet_STEREO_CENSUS_P2(valid);
+        params.bands = paramGet_STEREO_BANDS(valid);
+        params.seed_margin = paramGet_STEREO_SEED_MARGIN(valid);
+        params.seed_motion = paramGet_STEREO_SEED_MOTION(valid);
+        params.pyramid_levels = paramGet_STEREO_PYRAMID_LEVELS(valid);
+        params.pyramid_radius = paramGet_STEREO_PYRAMID_RADIUS(valid);
+        return params;
+    }
+
     void Vis::STEREO_cmdHandler(U32 opCode, U32 cmdSeq, Heli::Vis_StereoAlgorithm algorithm)
     {
-        m_stages.emplace_back(new StereoStage(this, algorithm));
+        add_stage(new StereoStage(m_arena, stereo_params(), algorithm));
+        m_disparity = true;
+        m_depth = false;
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
     void Vis::COLORMAP_cmdHandler(U32 opCode, U32 cmdSeq, Vis_ColorMap colormap, CamSelect select)
     {
-        m_stages.emplace_back(new ColormapStage(colormap, select));
+        add_stage(new ColormapStage(m_arena, colormap, select));
+        if (select == CamSelect::RIGHT || select == CamSelect::BOTH)
+        {
+            m_disparity = false;
+            m_depth = false;
+        }
+
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Vis::SPARSE_ROI_cmdHandler(U32 opCode, U32 cmdSeq, U16 x, U16 y, U16 width, U16 height)
+    {
+        if (m_sparse_rois.size() >= VIS_SPARSE_ROI_N)
+        {
+            log_WARNING_LO_SparseRoiFull(VIS_SPARSE_ROI_N);
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        m_sparse_rois.emplace_back(x, y, width, height);
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Vis::SPARSE_ROI_CLEAR_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        m_sparse_rois.clear();
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Vis::SPARSE_cmdHandler(U32 opCode, U32 cmdSeq, U16 step)
+    {
+        if (!m_calib.isValid())
+        {
+            log_WARNING_HI_NoValidCameraModel();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        if (step == 0)
+        {
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::VALIDATION_ERROR);
+            return;
+        }
+
+        Fw::ParamValid valid;
+        SparseParams params;
+        params.window_size = paramGet_SPARSE_WINDOW_SIZE(valid);
+        params.texture_threshold = paramGet_SPARSE_TEXTURE_THRESHOLD(valid);
+        params.uniqueness_ratio = paramGet_SPARSE_UNIQUENESS_RATIO(valid);
+        params.min_disparity = paramGet_STEREO_MIN_DISPARITY(valid);
+        params.num_disparities = paramGet_STEREO_NUM_DISPARITIES(valid);
+
+        auto lTr = transformGet_out(0, Fm_Frame::CAM_R, Fm_Frame::CAM_L);
+        add_stage(new SparseStage(m_arena, m_calib, std::abs(lTr.t()(0)), m_fx_scale,
+                                  params, m_sparse_rois, step));
+
+        // The right frame is replaced by the N x 3 samples
+        m_disparity = false;
+        m_depth = false;
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Vis::STIXEL_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        if (!m_calib.isValid())
+        {
+            log_WARNING_HI_NoValidCameraModel();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        // The stage scans the depth map in the right frame
+        if (!m_depth)
+        {
+            log_WARNING_HI_StixelWithoutDepth();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        Fw::ParamValid valid;
+        StixelParams params;
+        params.camera_height = paramGet_STIXEL_CAMERA_HEIGHT(valid);
+        params.ground_margin = paramGet_STIXEL_GROUND_MARGIN(valid);
+        params.min_run = paramGet_STIXEL_MIN_RUN(valid);
+
+        add_stage(new StixelStage(m_arena, m_calib, m_fy_scale, params));
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Vis::CLOUD_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        if (!m_calib.isValid())
+        {
+            log_WARNING_HI_NoValidCameraModel();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        // The stage reprojects the depth map in the right frame
+        if (!m_depth)
+        {
+            log_WARNING_HI_CloudWithoutDepth();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        // Camera mount is fixed so the transform is only looked up once
+        auto mTc = transformGet_out(0, Fm_Frame::CAM_L, Fm_Frame::MECH);
+        if (!mTc.is_valid())
+        {
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        cv::Matx44f transform;
+        for (I32 i = 0; i < 4; i++)
+        {
+            for (I32 j = 0; j < 4; j++)
+            {
+                transform(i, j) = mTc(i, j);
+            }
+        }
+
+        Fw::ParamValid valid;
+        CloudParams params;
+        params.voxel_size = paramGet_CLOUD_VOXEL_SIZE(valid);
+        params.max_depth = paramGet_CLOUD_MAX_DEPTH(valid);
+        params.stride = paramGet_CLOUD_STRIDE(valid);
+
+        add_stage(new PointCloudStage(m_arena, m_calib, m_fx_scale, m_fy_scale, transform, params));
+        cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
+    }
+
+    void Vis::TRACK_cmdHandler(U32 opCode, U32 cmdSeq)
+    {
+        if (!isConnected_stereo_OutputPort(0))
+        {
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        if (!m_calib.isValid())
+        {
+            log_WARNING_HI_NoValidCameraModel();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        auto lTr = transformGet_out(0, Fm_Frame::CAM_R, Fm_Frame::CAM_L);
+        if (!lTr.is_valid())
+        {
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
+        // Left camera after the rectification and scaling stages so far
+        cv::Matx33d k = m_calib.left.scaled(m_fx_scale, m_fy_scale);
+        StereoCamera camera(
+                static_cast<F32>(k(0, 0)),
+                static_cast<F32>(k(1, 1)),
+                static_cast<F32>(k(0, 2)),
+                static_cast<F32>(k(1, 2)),
+                static_cast<F32>(std::abs(lTr.t()(0))));
+
+        // Nav tracks on the stage's task, the frames are not copied
+        add_stage(new TrackStage([this, camera](const cv::Mat& left, const cv::Mat& right) {
+            cv::Mat l = left, r = right;
+            stereo_out(0, Mat(l), Mat(r), camera);
+        }));
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
-    void Vis::DEPTH_cmdHandler(U32 opCode, U32 cmdSeq)
+    void Vis::DEPTH_cmdHandler(U32 opCode, U32 cmdSeq, Vis_DepthFormat format)
     {
+        // The 8-bit disparity frame saturates, only the arena disparity has full range
+        if (!m_disparity)
+        {
+            log_WARNING_HI_DepthWithoutDisparity();
+            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
+            return;
+        }
+
         Fw::ParamValid valid;
         I32 pix = paramGet_DEPTH_LEFT_MASK_PIX(valid);
+        I32 minDisparity = paramGet_STEREO_MIN_DISPARITY(valid);
+        I32 numDisparity = paramGet_STEREO_NUM_DISPARITIES(valid);
 
         auto lTr = transformGet_out(0, Fm_Frame::CAM_R, Fm_Frame::CAM_L);
-        m_stages.emplace_back(new DepthStage(m_calib, std::abs(lTr.t()(0)), pix));
+        add_stage(new DepthStage(m_arena, m_calib, std::abs(lTr.t()(0)), pix, m_fx_scale,
+                                             minDisparity, numDisparity, format));
+        m_depth = true;
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
     void Vis::SCALE_cmdHandler(U32 opCode, U32 cmdSeq, F32 fx, F32 fy, Heli::Vis_Interpolation interp)
     {
-        m_stages.emplace_back(new ScaleStage(fx, fy, interp));
+        add_stage(new ScaleStage(m_arena, fx, fy, interp));
+        m_fx_scale *= fx;
+        m_fy_scale *= fy;
+        m_disparity = false;
+        m_depth = false;
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
@@ -195,47 +550,44 @@ namespace Heli
     void Vis::MODEL_SIZE_cmdHandler(U32 opCode, U32 cmdSeq, U32 width, U32 height)
     {
         m_calib.size = cv::Size(static_cast<I32>(width), static_cast<I32>(height));
+
+        // Stages hold on to their scratch slots
+        m_pipeline.stop();
+        if (m_stages.empty())
+        {
+            reset_arena();
+        }
+        else
+        {
+            m_arena.reserve(m_calib.size, CV_8U);
+        }
+        m_pipeline.start(m_stages);
         cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::OK);
     }
 
     void Vis::CAPTURE_cmdHandler(FwOpcodeType opCode, U32 cmdSeq,
                                  const Fw::CmdStringArg &location, Heli::CamSelect eye,
-                                 Heli::ImageEncoding encoding)
+                                 Heli::ImageEncoding encoding, U8 count)
     {
-        if (is_capturing)
+        switch (m_capture.start(opCode, cmdSeq, location, eye, encoding, count))
         {
-            cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::BUSY);
-            return;
+            case CaptureWriter::Burst::STARTED:
+                break;
+            case CaptureWriter::Burst::INVALID_COUNT:
+                cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::VALIDATION_ERROR);
+                break;
+            case CaptureWriter::Burst::BUSY:
+                cmdResponse_out(opCode, cmdSeq, Fw::CmdResponse::BUSY);
+                break;
         }
-
-        m_capture.request_time = getTime();
-
-        m_capture.opCode = opCode;
-        m_capture.cmdSeq = cmdSeq;
-
-        m_capture.location = location;
-        m_capture.eye = eye;
-        m_capture.encoding = encoding;
-
-        is_capturing = true;
     }
 
     void Vis::sched_handler(NATIVE_INT_TYPE portNum, NATIVE_UINT_TYPE context)
     {
-        if (is_capturing)
+        Fw::String location;
+        if (m_capture.expired(location))
         {
-            Fw::Time cur_time = getTime();
-            Fw::Time difference = Fw::Time::sub(
-                    cur_time,
-                    m_capture.request_time);
-
-            // TODO(tumbar) Do we want variable timeout?
-            if (difference >= Fw::Time(cur_time.getTimeBase(), 3, 0))
-            {
-                is_capturing = false;
-                log_WARNING_LO_CaptureTimeout(m_capture.location);
-                cmdResponse_out(m_capture.opCode, m_capture.cmdSeq, Fw::CmdResponse::EXECUTION_ERROR);
-            }
+            log_WARNING_LO_CaptureTimeout(location);
         }
     }
 }
@@ -7,7 +7,11 @@
 
 #include <Heli/Vis/VisComponentAc.hpp>
 #include <Heli/Vis/VisStage.hpp>
+#include <Heli/Vis/VisArena.hpp>
+#include <Heli/Vis/VisPipeline.hpp>
+#include <Heli/Capture/CaptureWriter.hpp>
 
+#include <memory>
 #include <vector>
 
 namespace Heli
@@ -16,7 +20,6 @@ namespace Heli
     {
         friend VisStage;
         friend RectifyStage;
-        friend StereoStage;
         friend DepthStage;
     public:
         explicit Vis(const char* componentName);
@@ -27,6 +30,8 @@ namespace Heli
         );
 
     PRIVATE:
+        void preamble() override;
+
         void frame_handler(
                 NATIVE_INT_TYPE portNum, /*!< The port number*/
                 U32 frameId
@@ -35,34 +40,60 @@ namespace Heli
         void CLEAR_cmdHandler(U32 opCode, U32 cmdSeq) override;
         void SCALE_cmdHandler(U32 opCode, U32 cmdSeq, F32 fx, F32 fy, Heli::Vis_Interpolation interp) override;
         void RECTIFY_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void RECTIFY_SCALE_cmdHandler(U32 opCode, U32 cmdSeq, F32 fx, F32 fy, Heli::Vis_Interpolation interp) override;
         void STEREO_cmdHandler(U32 opCode, U32 cmdSeq,
                                Vis_StereoAlgorithm algorithm) override;
-        void DEPTH_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void DEPTH_cmdHandler(U32 opCode, U32 cmdSeq, Vis_DepthFormat format) override;
         void COLORMAP_cmdHandler(U32 opCode, U32 cmdSeq, Vis_ColorMap colormap, CamSelect select) override;
+        void SPARSE_ROI_cmdHandler(U32 opCode, U32 cmdSeq, U16 x, U16 y, U16 width, U16 height) override;
+        void SPARSE_ROI_CLEAR_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void SPARSE_cmdHandler(U32 opCode, U32 cmdSeq, U16 step) override;
+        void STIXEL_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void CLOUD_cmdHandler(U32 opCode, U32 cmdSeq) override;
+        void TRACK_cmdHandler(U32 opCode, U32 cmdSeq) override;
 
         void MODEL_SIZE_cmdHandler(U32 opCode, U32 cmdSeq, U32 width, U32 height) override;
+        void PROFILE_cmdHandler(U32 opCode, U32 cmdSeq) override;
 
         void CAPTURE_cmdHandler(FwOpcodeType opCode, U32 cmdSeq,
                                 const Fw::CmdStringArg &location, Heli::CamSelect eye,
-                                Heli::ImageEncoding encoding) override;
+                                Heli::ImageEncoding encoding, U8 count) override;
 
         void sched_handler(NATIVE_INT_TYPE portNum, NATIVE_UINT_TYPE context) override;
 
     PRIVATE:
-        Calibration m_calib;
-        std::vector<std::unique_ptr<VisStage>> m_stages;
+        void reset_arena();
+        StereoParams stereo_params();
+        void add_stage(VisStage* stage);
+
+        //! Finish a frame once it went through every stage
+        void frame_complete(VisFrame& frame);
+
+        void publish_profile();
 
-        bool is_capturing;
-        struct {
-            Fw::Time request_time;
+        //! Publish the nearest sparse sample of the frame
+        void publish_samples(const cv::Mat& samples);
 
-            Fw::String location;
-            Heli::CamSelect eye;
-            Heli::ImageEncoding encoding;
+        //! Send the column obstacles of the frame to Nav and the ground
+        void publish_stixels(U32 frameId, const cv::Mat& stixels);
+
+        //! Send the point cloud of the frame to Nav
+        void publish_cloud(U32 frameId, const cv::Mat& cloud, U32 n);
+
+        Calibration m_calib;
+        VisArena m_arena;
+        std::vector<std::unique_ptr<VisStage>> m_stages;
+        VisPipeline m_pipeline;
+        F32 m_fx_scale;     //!< Horizontal scale applied by the stages so far
+        F32 m_fy_scale;     //!< Vertical scale applied by the stages so far
+        bool m_disparity;   //!< A stereo disparity at the current frame size is in the arena
+        bool m_depth;       //!< DEPTH was the last stage to write the right frame
+        U32 m_allocations;  //!< Allocation count when the last frame completed
+        U32 m_profile_frames;   //!< Frames since stage timing telemetry was published
+        std::vector<cv::Rect> m_sparse_rois;    //!< Regions of the next sparse stage
 
-            FwOpcodeType opCode;
-            U32 cmdSeq;
-        } m_capture;
+        //! Frames complete on the pipeline workers
+        CaptureWriter::Burst m_capture;
     };
 }
 
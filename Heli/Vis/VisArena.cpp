@@ -0,0 +1,212 @@
+//
+// Created by tumbar on 4/6/23.
+//
+
+#include <Heli/Vis/VisArena.hpp>
+#include <Fw/Types/Assert.hpp>
+
+namespace Heli
+{
+    static thread_local U32 s_slot = 0;
+    static thread_local bool s_counted = false;
+
+    /**
+     * Counts allocations of threads processing frames and hands them to the default OpenCV allocator
+     * Freed memory is returned directly to the default allocator
+     */
+    class CountingAllocator : public cv::MatAllocator
+    {
+    public:
+        CountingAllocator()
+                : m_base(cv::Mat::getStdAllocator()), m_count(0)
+        {
+        }
+
+        cv::UMatData* allocate(int dims, const int* sizes, int type,
+                               void* data, size_t* step,
+                               cv::AccessFlag flags,
+                               cv::UMatUsageFlags usageFlags) const override
+        {
+            // User provided memory is not a heap allocation
+            if (!data && s_counted)
+            {
+                m_count++;
+            }
+
+            return m_base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        }
+
+        bool allocate(cv::UMatData* data, cv::AccessFlag accessflags,
+                      cv::UMatUsageFlags usageFlags) const override
+        {
+            return m_base->allocate(data, accessflags, usageFlags);
+        }
+
+        void deallocate(cv::UMatData* data) const override
+        {
+            m_base->deallocate(data);
+        }
+
+        U32 count() const
+        {
+            return m_count;
+        }
+
+    private:
+        cv::MatAllocator* m_base;
+        mutable std::atomic<U32> m_count;
+    };
+
+    static CountingAllocator& counting_allocator()
+    {
+        static CountingAllocator allocator;
+        return allocator;
+    }
+
+    VisArena::VisArena()
+            : m_scratch_n(0)
+    {
+        cv::Mat::setDefaultAllocator(&counting_allocator());
+        clear();
+    }
+
+    VisArena::~VisArena()
+    {
+        clear();
+    }
+
+    U32 VisArena::bind(U32 slot)
+    {
+        FW_ASSERT(slot < SLOT_N, slot);
+        U32 previous = s_slot;
+        s_slot = slot;
+        return previous;
+    }
+
+    U32 VisArena::current()
+    {
+        return s_slot;
+    }
+
+    bool VisArena::count(bool counted)
+    {
+        bool previous = s_counted;
+        s_counted = counted;
+        return previous;
+    }
+
+    void VisArena::reserve(const cv::Size& size, I32 type)
+    {
+        for (auto& slot : m_frames)
+        {
+            for (auto& eye : slot)
+            {
+                for (auto& frame : eye)
+                {
+                    frame.create(size, type);
+                }
+            }
+        }
+    }
+
+    cv::Mat& VisArena::target(U32 eye, const cv::Mat& current, const cv::Size& size, I32 type)
+    {
+        FW_ASSERT(eye < EYE_N, eye);
+
+        // Only one of the buffers can hold the current frame
+        // Camera memory is never held by either
+        cv::Mat (&frames)[2] = m_frames[VisArena::current()][eye];
+        cv::Mat& out = frames[0].data == current.data ? frames[1] : frames[0];
+
+        // No-op if the buffer is already the right shape
+        out.create(size, type);
+        return out;
+    }
+
+    cv::Mat& VisArena::scratch(U32 slot, const cv::Size& size, I32 type)
+    {
+        FW_ASSERT(slot < m_scratch_n, slot, m_scratch_n);
+
+        cv::Mat& out = m_scratch[slot];
+        out.create(size, type);
+        return out;
+    }
+
+    U32 VisArena::reserve_scratch()
+    {
+        FW_ASSERT(m_scratch_n < SCRATCH_N, m_scratch_n);
+        return m_scratch_n++;
+    }
+
+    cv::Mat& VisArena::disparity()
+    {
+        return m_disparity[current()];
+    }
+
+    cv::Mat& VisArena::samples()
+    {
+        return m_samples[current()];
+    }
+
+    cv::Mat& VisArena::stixels()
+    {
+        return m_stixels[current()];
+    }
+
+    cv::Mat& VisArena::cloud()
+    {
+        return m_cloud[current()];
+    }
+
+    U32& VisArena::cloud_n()
+    {
+        return m_cloud_n[current()];
+    }
+
+    void VisArena::clear()
+    {
+        for (auto& slot : m_frames)
+        {
+            for (auto& eye : slot)
+            {
+                for (auto& frame : eye)
+                {
+                    frame.release();
+                }
+            }
+        }
+
+        for (auto& s : m_scratch)
+        {
+            s.release();
+        }
+
+        for (auto& d : m_disparity)
+        {
+            d.release();
+        }
+
+        for (auto& s : m_samples)
+        {
+            s.release();
+        }
+
+        for (auto& s : m_stixels)
+        {
+            s.release();
+        }
+
+        for (U32 i = 0; i < SLOT_N; i++)
+        {
+            m_cloud[i].release();
+            m_cloud_n[i] = 0;
+        }
+
+        m_scratch_n = 0;
+    }
+
+    U32 VisArena::allocations()
+    {
+        return counting_allocator().count();
+    }
+}
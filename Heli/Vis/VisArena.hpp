@@ -0,0 +1,140 @@
+//
+// Created by tumbar on 4/6/23.
+//
+
+#ifndef STEREO_HELI_VISARENA_HPP
+#define STEREO_HELI_VISARENA_HPP
+
+#include <VisCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+#include <opencv2/core.hpp>
+
+#include <atomic>
+
+namespace Heli
+{
+    /**
+     * Preallocated frame memory shared by the stages of a vision pipeline.
+     *
+     * Stages that cannot work in place write into the ping-pong buffer of
+     * each eye that is not currently holding the frame. Stages that need
+     * temporaries borrow scratch slots. Buffers are created once and reused
+     * for every frame afterwards so that the steady state does not allocate.
+     *
+     * cv::Mat allocations made by threads processing frames are counted so
+     * that telemetry can show allocations made while a frame is processed.
+     * Other threads of the process (Nav, capture, video) are not counted.
+     *
+     * Frames in flight through a pipelined executor each own a slot of
+     * ping-pong buffers and disparity. A thread binds the slot of the frame
+     * it is processing before running a stage. Scratch slots belong to a
+     * single stage which only ever processes one frame at a time.
+     */
+    class VisArena
+    {
+    public:
+        enum
+        {
+            EYE_N = 2,
+            SCRATCH_N = 8,
+            SLOT_N = VIS_PIPELINE_DEPTH,
+        };
+
+        VisArena();
+        ~VisArena();
+
+        /**
+         * Select the frame slot used by the calling thread
+         * @param slot slot of the frame about to be processed
+         * @return slot bound before
+         */
+        static U32 bind(U32 slot);
+
+        //! Frame slot bound to the calling thread
+        static U32 current();
+
+        /**
+         * Select whether cv::Mat allocations of the calling thread are counted
+         * @param counted true while the thread processes frames
+         * @return setting of the thread before
+         */
+        static bool count(bool counted);
+
+        /**
+         * Preallocate the ping-pong buffers of both eyes in every slot
+         * @param size frame size
+         * @param type frame element type
+         */
+        void reserve(const cv::Size& size, I32 type);
+
+        /**
+         * Get the ping-pong buffer of an eye not holding the current frame
+         * The buffer is only allocated if the size or type changed
+         * @param eye eye index
+         * @param current frame currently held by this eye
+         * @param size requested output size
+         * @param type requested output type
+         * @return preallocated output buffer
+         */
+        cv::Mat& target(U32 eye, const cv::Mat& current, const cv::Size& size, I32 type);
+
+        /**
+         * Borrow a scratch buffer
+         * Slots are owned by a single stage (see reserve_scratch)
+         * @param slot scratch slot
+         * @param size requested size
+         * @param type requested type
+         * @return preallocated scratch buffer
+         */
+        cv::Mat& scratch(U32 slot, const cv::Size& size, I32 type);
+
+        //! Reserve a scratch slot for a stage
+        U32 reserve_scratch();
+
+        /**
+         * Fixed point (CV_16S, 4 fractional bits) disparity of the current frame
+         * Written by the stereo stage and read by the stages after it
+         */
+        cv::Mat& disparity();
+
+        /**
+         * Sparse depth samples of the current frame
+         * N x 3 CV_32F rows of (u, v, depth) written by the sparse stage
+         */
+        cv::Mat& samples();
+
+        /**
+         * Stixels of the current frame
+         * 2 x VIS_STIXEL_N CV_32F of nearest obstacle depth and obstacle base row
+         */
+        cv::Mat& stixels();
+
+        /**
+         * Point cloud of the current frame
+         * VIS_CLOUD_POINT_MAX x 3 CV_32F voxel centroids written by the point cloud stage
+         * The buffer keeps its capacity, only the first cloud_n() rows are points
+         */
+        cv::Mat& cloud();
+
+        //! Points in the cloud of the current frame
+        U32& cloud_n();
+
+        //! Drop all buffers and scratch slots
+        void clear();
+
+        //! Total cv::Mat allocations made while processing frames
+        static U32 allocations();
+
+    PRIVATE:
+        cv::Mat m_frames[SLOT_N][EYE_N][2];
+        cv::Mat m_scratch[SCRATCH_N];
+        U32 m_scratch_n;
+        cv::Mat m_disparity[SLOT_N];
+        cv::Mat m_samples[SLOT_N];
+        cv::Mat m_stixels[SLOT_N];
+        cv::Mat m_cloud[SLOT_N];
+        U32 m_cloud_n[SLOT_N];
+    };
+}
+
+#endif //STEREO_HELI_VISARENA_HPP
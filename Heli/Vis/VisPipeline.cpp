@@ -0,0 +1,285 @@
+//
+// Created by tumbar on 4/9/23.
+//
+
+#include <Heli/Vis/VisPipeline.hpp>
+#include <Heli/Trace/FrameTrace.hpp>
+#include <Fw/Types/Assert.hpp>
+
+#include <algorithm>
+#include <chrono>
+
+namespace Heli
+{
+    static U32 elapsed_us(std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<U32>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+
+    VisPipeline::VisPipeline(Complete complete)
+            : m_complete(std::move(complete)),
+              m_busy{false}, m_next(0),
+              m_in_flight(0)
+    {
+        for (U32 i = 0; i < VisArena::SLOT_N; i++)
+        {
+            m_frames[i].slot = i;
+        }
+    }
+
+    VisPipeline::~VisPipeline()
+    {
+        stop();
+    }
+
+    void VisPipeline::start(const std::vector<std::unique_ptr<VisStage>>& stages)
+    {
+        FW_ASSERT(m_workers.empty());
+
+        for (auto& profile : m_profile)
+        {
+            profile.clear();
+        }
+
+        for (U32 i = 0; i < stages.size(); i++)
+        {
+            VisStage* stage = stages[i].get();
+            m_stages.push_back(stage);
+
+            // Chain per-eye stages onto the previous per-eye step
+            bool per_eye = stage->input() == VisStage::PER_EYE;
+            if (per_eye && !m_workers.empty() && m_workers.back()->per_eye)
+            {
+                m_workers.back()->n++;
+                continue;
+            }
+
+            auto worker = std::make_unique<Worker>();
+            worker->first = i;
+            worker->n = 1;
+            worker->per_eye = per_eye;
+            worker->running = false;
+            m_workers.push_back(std::move(worker));
+        }
+    }
+
+    void VisPipeline::stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_in_flight > 0)
+            {
+                m_free.wait(lock);
+            }
+        }
+
+        // A task may still be finding its queue empty
+        for (auto& worker : m_workers)
+        {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            while (worker->running)
+            {
+                worker->cv.wait(lock);
+            }
+        }
+
+        m_workers.clear();
+        m_stages.clear();
+    }
+
+    VisFrame& VisPipeline::acquire(U32 id)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_busy[m_next])
+        {
+            m_free.wait(lock);
+        }
+
+        VisFrame& frame = m_frames[m_next];
+        m_busy[m_next] = true;
+        m_next = (m_next + 1) % VisArena::SLOT_N;
+        m_in_flight++;
+
+        frame.id = id;
+        return frame;
+    }
+
+    void VisPipeline::push(VisFrame& frame)
+    {
+        if (m_workers.empty())
+        {
+            complete(frame);
+        }
+        else
+        {
+            send(0, &frame);
+        }
+    }
+
+    U32 VisPipeline::in_flight() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_in_flight;
+    }
+
+    VisProfile::Summary VisPipeline::profile(U32 stage) const
+    {
+        FW_ASSERT(stage < VIS_PROFILE_STAGE_N, stage);
+        return m_profile[stage].summary();
+    }
+
+    void VisPipeline::send(U32 index, VisFrame* frame)
+    {
+        Worker& worker = *m_workers[index];
+
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.queue.push_back(frame);
+            if (worker.running)
+            {
+                // Picked up by the task already draining the stage
+                return;
+            }
+
+            worker.running = true;
+        }
+
+        // Detached so a stage waiting on its own tasks never ends up draining another stage
+        libparallel::Pool::get().submit([this, index]() { drain(index); }, nullptr);
+    }
+
+    void VisPipeline::complete(VisFrame& frame)
+    {
+        m_complete(frame);
+
+        // Drop the references to the camera buffer
+        frame.left.release();
+        frame.right.release();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_busy[frame.slot] = false;
+        m_in_flight--;
+        m_free.notify_all();
+    }
+
+    void VisPipeline::drain(U32 index)
+    {
+        Worker& worker = *m_workers[index];
+
+        // Threads waiting on a task group may run this in the middle of another stage
+        U32 outer = VisArena::bind(0);
+        bool counted = VisArena::count(true);
+
+        while (true)
+        {
+            VisFrame* frame;
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                if (worker.queue.empty())
+                {
+                    VisArena::bind(outer);
+                    VisArena::count(counted);
+                    worker.running = false;
+                    worker.cv.notify_all();
+                    return;
+                }
+
+                frame = worker.queue.front();
+                worker.queue.pop_front();
+            }
+
+            // Process is performed in-place
+            VisArena::bind(frame->slot);
+            if (worker.per_eye)
+            {
+                run_eyes(worker, *frame);
+            }
+            else
+            {
+                run(worker.first, *frame);
+            }
+
+            if (index + 1 < m_workers.size())
+            {
+                send(index + 1, frame);
+            }
+            else
+            {
+                complete(*frame);
+            }
+        }
+    }
+
+    void VisPipeline::run(U32 stage, VisFrame& frame)
+    {
+        FrameTrace& trace = FrameTrace::get();
+        trace.mark(frame.id, FrameTrace::VIS_START, stage);
+
+        auto start = std::chrono::steady_clock::now();
+        m_stages[stage]->process(frame.left, frame.right);
+        U32 elapsed = elapsed_us(start);
+
+        trace.mark(frame.id, FrameTrace::VIS_END, stage);
+
+        if (stage < VIS_PROFILE_STAGE_N)
+        {
+            m_profile[stage].add(elapsed);
+        }
+    }
+
+    void VisPipeline::run_eyes(const Worker& worker, VisFrame& frame)
+    {
+        U32 elapsed[T_N][VIS_PROFILE_STAGE_N] = {};
+
+        libparallel::TaskGroup group;
+        U32* left_elapsed = elapsed[T_LEFT];
+        group.run([this, &worker, &frame, left_elapsed]() {
+            U32 outer = VisArena::bind(frame.slot);
+            bool counted = VisArena::count(true);
+            chain(worker, T_LEFT, frame, left_elapsed, false);
+            VisArena::count(counted);
+            VisArena::bind(outer);
+        });
+
+        // Only this thread stamps the trace, the chain ends once both eyes are done
+        chain(worker, T_RIGHT, frame, elapsed[T_RIGHT], true);
+        group.wait();
+
+        U32 last = worker.first + worker.n - 1;
+        FrameTrace::get().mark(frame.id, FrameTrace::VIS_END, last);
+
+        // A stage takes as long as its slower eye
+        for (U32 i = worker.first; i <= last && i < VIS_PROFILE_STAGE_N; i++)
+        {
+            m_profile[i].add(std::max(elapsed[T_LEFT][i], elapsed[T_RIGHT][i]));
+        }
+    }
+
+    void VisPipeline::chain(const Worker& worker, U32 eye, VisFrame& frame,
+                            U32* elapsed, bool trace)
+    {
+        cv::Mat& image = eye == T_LEFT ? frame.left : frame.right;
+        for (U32 i = worker.first; i < worker.first + worker.n; i++)
+        {
+            if (trace)
+            {
+                FrameTrace::get().mark(frame.id, FrameTrace::VIS_START, i);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            m_stages[i]->process_eye(eye, image);
+            U32 us = elapsed_us(start);
+
+            if (i < VIS_PROFILE_STAGE_N)
+            {
+                elapsed[i] = us;
+            }
+
+            if (trace)
+            {
+                FrameTrace::get().mark(frame.id, FrameTrace::VIS_END, i);
+            }
+        }
+    }
+}
@@ -0,0 +1,140 @@
+//
+// Created by tumbar on 4/9/23.
+//
+
+#ifndef STEREO_HELI_VISPIPELINE_HPP
+#define STEREO_HELI_VISPIPELINE_HPP
+
+#include <Heli/Vis/VisStage.hpp>
+#include <Heli/Vis/VisArena.hpp>
+#include <Heli/Vis/VisProfile.hpp>
+#include <Heli/parallel/parallel.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Heli
+{
+    //! Frame in flight through the vision stages
+    struct VisFrame
+    {
+        U32 id;             //!< Camera frame id
+        U32 slot;           //!< Arena slot holding the stage outputs
+        cv::Mat left;
+        cv::Mat right;
+    };
+
+    /**
+     * Runs every vision stage as a task on the shared thread pool so
+     * that consecutive frames overlap. Frame k + 1 can be rectified while
+     * frame k is matched and frame k - 1 is projected to depth.
+     *
+     * A step has at most one task draining its queue at a time and
+     * processes frames in the order they were pushed so frames complete
+     * in order. Threads are bounded by the pool, not the stage count. The number of frames in flight is
+     * bounded by the arena slots. Frames also hold their camera buffer
+     * until they complete which bounds them by the camera buffer pool.
+     *
+     * Consecutive PER_EYE stages form a single step. The stages of a frame
+     * form a graph where each eye is an independent chain up to the next
+     * JOINT stage. Each eye runs through its whole chain back to back and
+     * the eyes are only joined before the stage that needs both.
+     */
+    class VisPipeline
+    {
+    public:
+        //! Called on the last stage's task once a frame went through every stage
+        using Complete = std::function<void(VisFrame& frame)>;
+
+        explicit VisPipeline(Complete complete);
+        ~VisPipeline();
+
+        /**
+         * Start accepting frames for the stages
+         * The stages must not change until the pipeline is stopped
+         * @param stages stages to run in order
+         */
+        void start(const std::vector<std::unique_ptr<VisStage>>& stages);
+
+        //! Wait for the frames in flight to complete and the stage tasks to finish
+        void stop();
+
+        /**
+         * Get the next free frame slot
+         * Blocks until the oldest frame in flight completes if all slots are in use
+         * @param id camera frame id
+         * @return frame to fill in and push
+         */
+        VisFrame& acquire(U32 id);
+
+        /**
+         * Send an acquired frame through the stages
+         * Frames are completed immediately on the caller when there are no stages
+         * @param frame frame returned by acquire
+         */
+        void push(VisFrame& frame);
+
+        //! Frames acquired but not yet completed
+        U32 in_flight() const;
+
+        /**
+         * Processing time statistics of a stage since the pipeline was started
+         * Only the first VIS_PROFILE_STAGE_N stages are timed
+         * @param stage stage index
+         */
+        VisProfile::Summary profile(U32 stage) const;
+
+    PRIVATE:
+        //! Stages run back to back on a frame
+        struct Worker
+        {
+            U32 first;          //!< Index of the first stage
+            U32 n;              //!< Number of stages, only PER_EYE chains have more than one
+            bool per_eye;
+
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<VisFrame*> queue;
+            bool running;       //!< A pool task is draining the queue
+        };
+
+        //! Process the queued frames of a step, runs on the pool
+        void drain(U32 index);
+        void send(U32 index, VisFrame* frame);
+        void complete(VisFrame& frame);
+
+        //! Run a JOINT stage on a frame
+        void run(U32 stage, VisFrame& frame);
+
+        //! Run both eyes of a frame through a chain of PER_EYE stages
+        void run_eyes(const Worker& worker, VisFrame& frame);
+
+        /**
+         * Run one eye through a chain of PER_EYE stages
+         * @param elapsed processing time of each profiled stage in microseconds
+         * @param trace stamp the stages on the frame trace
+         */
+        void chain(const Worker& worker, U32 eye, VisFrame& frame,
+                   U32* elapsed, bool trace);
+
+        Complete m_complete;
+
+        VisFrame m_frames[VisArena::SLOT_N];
+        bool m_busy[VisArena::SLOT_N];
+        U32 m_next;                     //!< Next slot to acquire, frames complete in order
+
+        U32 m_in_flight;
+        mutable std::mutex m_mutex;
+        std::condition_variable m_free;
+
+        std::vector<VisStage*> m_stages;
+        std::vector<std::unique_ptr<Worker>> m_workers;
+        VisProfile m_profile[VIS_PROFILE_STAGE_N];
+    };
+}
+
+#endif //STEREO_HELI_VISPIPELINE_HPP
@@ -0,0 +1,61 @@
+//
+// Created by tumbar on 4/11/23.
+//
+
+#include <Heli/Vis/VisProfile.hpp>
+
+#include <algorithm>
+
+namespace Heli
+{
+    VisProfile::VisProfile()
+            : m_samples{0}, m_head(0), m_n(0)
+    {
+    }
+
+    void VisProfile::add(U32 us)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_samples[m_head] = us;
+        m_head = (m_head + 1) % VIS_PROFILE_WINDOW_N;
+        m_n = std::min<U32>(m_n + 1, VIS_PROFILE_WINDOW_N);
+    }
+
+    VisProfile::Summary VisProfile::summary() const
+    {
+        U32 sorted[VIS_PROFILE_WINDOW_N];
+        U32 n;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            n = m_n;
+            std::copy(m_samples, m_samples + n, sorted);
+        }
+
+        Summary out = {0, 0, 0, 0, n};
+        if (n == 0)
+        {
+            return out;
+        }
+
+        std::sort(sorted, sorted + n);
+
+        U64 sum = 0;
+        for (U32 i = 0; i < n; i++)
+        {
+            sum += sorted[i];
+        }
+
+        out.min = sorted[0];
+        out.max = sorted[n - 1];
+        out.mean = static_cast<U32>(sum / n);
+        out.p95 = sorted[std::min(n - 1, n * 95 / 100)];
+        return out;
+    }
+
+    void VisProfile::clear()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_head = 0;
+        m_n = 0;
+    }
+}
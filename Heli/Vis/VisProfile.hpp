@@ -0,0 +1,51 @@
+//
+// Created by tumbar on 4/11/23.
+//
+
+#ifndef STEREO_HELI_VISPROFILE_HPP
+#define STEREO_HELI_VISPROFILE_HPP
+
+#include <VisCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+
+#include <mutex>
+
+namespace Heli
+{
+    /**
+     * Rolling processing time statistics of a single vision stage.
+     * The stage's worker adds a sample per frame, the component thread
+     * reads the summary for telemetry and profiling events.
+     */
+    class VisProfile
+    {
+    public:
+        //! Processing times in microseconds
+        struct Summary
+        {
+            U32 min;
+            U32 mean;
+            U32 max;
+            U32 p95;
+            U32 count;      //!< Samples in the window
+        };
+
+        VisProfile();
+
+        //! Add the processing time of a frame
+        void add(U32 us);
+
+        //! Statistics over the last VIS_PROFILE_WINDOW_N frames
+        Summary summary() const;
+
+        void clear();
+
+    PRIVATE:
+        mutable std::mutex m_mutex;
+        U32 m_samples[VIS_PROFILE_WINDOW_N];
+        U32 m_head;
+        U32 m_n;
+    };
+}
+
+#endif //STEREO_HELI_VISPROFILE_HPP
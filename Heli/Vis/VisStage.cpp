@@ -2,91 +2,220 @@
 // Created by tumbar on 11/20/22.
 //
 
-#include <Heli/Vis/Vis.hpp>
 #include <Heli/Vis/VisStage.hpp>
+#include <Heli/Vis/Census.hpp>
 
 #include "Assert.hpp"
 #include "opencv2/imgproc.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 namespace Heli
 {
-    ScaleStage::ScaleStage(F32 x_scale, F32 y_scale, const Vis_Interpolation& interp)
-            : m_proc([this](cv::Mat& src_dest) {
-                  cv::resize(src_dest, src_dest,
-                             cv::Size(0, 0),
-                             m_fx, m_fy,
-                             m_interp);
-              }), m_fx(x_scale),
-              m_fy(y_scale)
+    static cv::InterpolationFlags interpolation(const Vis_Interpolation& interp)
     {
         switch (interp.e)
         {
             case Vis_Interpolation::NEAREST:
-                m_interp = cv::INTER_NEAREST;
-                break;
+                return cv::INTER_NEAREST;
+            default:
             case Vis_Interpolation::LINEAR:
-                m_interp = cv::INTER_LINEAR;
-                break;
+                return cv::INTER_LINEAR;
             case Vis_Interpolation::CUBIC:
-                m_interp = cv::INTER_CUBIC;
-                break;
+                return cv::INTER_CUBIC;
         }
     }
 
+    void VisStage::process_eye(U32 eye, cv::Mat& frame)
+    {
+        // Only PER_EYE stages are split
+        FW_ASSERT(0, eye);
+    }
+
+    void VisStage::process_eyes(cv::Mat& left, cv::Mat& right)
+    {
+        // The left eye picks its arena targets in the slot of this frame
+        U32 slot = VisArena::current();
+
+        libparallel::TaskGroup group;
+        group.run([this, slot, &left]() {
+            U32 outer = VisArena::bind(slot);
+            bool counted = VisArena::count(true);
+            process_eye(T_LEFT, left);
+            VisArena::count(counted);
+            VisArena::bind(outer);
+        });
+
+        process_eye(T_RIGHT, right);
+        group.wait();
+    }
+
+    ScaleStage::ScaleStage(VisArena& arena, F32 x_scale, F32 y_scale, const Vis_Interpolation& interp)
+            : m_arena(arena),
+              m_fx(x_scale),
+              m_fy(y_scale),
+              m_interp(interpolation(interp))
+    {
+    }
+
     void ScaleStage::process(cv::Mat& left, cv::Mat& right)
     {
-        auto& a1 = m_proc.feed<T_LEFT>(left);
-        auto& a2 = m_proc.feed<T_RIGHT>(right);
+        process_eyes(left, right);
+    }
 
-        a1.await();
-        a2.await();
+    void ScaleStage::process_eye(U32 eye, cv::Mat& frame)
+    {
+        // Resizing in place would allocate a new frame every time
+        cv::Size size(cvRound(frame.cols * m_fx), cvRound(frame.rows * m_fy));
+        cv::Mat& out = m_arena.target(eye, frame, size, frame.type());
+        cv::resize(frame, out, size, 0, 0, m_interp);
+        frame = out;
     }
 
-    RectifyStage::RectifyStage(const Calibration& calibration)
-            : m_proc([](std::tuple<cv::Mat&, cv::Mat&, cv::Mat&> t) {
-        cv::remap(std::get<0>(t), std::get<0>(t),
-                  std::get<1>(t), std::get<2>(t),
-                  cv::INTER_LINEAR);
-    })
+    RectifyStage::RectifyStage(VisArena& arena, const Calibration& calibration,
+                               F32 fx, F32 fy,
+                               const Vis_Interpolation& interp)
+    : m_arena(arena),
+    m_interp(interpolation(interp)),
+    m_size(cvRound(calibration.size.width * fx),
+           cvRound(calibration.size.height * fy))
     {
-        cv::initUndistortRectifyMap(calibration.left.k, calibration.left.d,
-                                    cv::noArray(), cv::noArray(),
-                                    calibration.size, CV_32FC1,
-                                    m_left_x, m_left_y);
+        init_eye(m_eyes[T_LEFT], calibration.left, m_size, fx, fy);
+        init_eye(m_eyes[T_RIGHT], calibration.right, m_size, fx, fy);
+    }
 
-        cv::initUndistortRectifyMap(calibration.right.k, calibration.right.d,
-                                    cv::noArray(), cv::noArray(),
-                                    calibration.size, CV_32FC1,
-                                    m_right_x, m_right_y);
+    cv::Matx33d Calibration::Intrinsic::scaled(F64 fx, F64 fy) const
+    {
+        cv::Matx33d s = k;
+        for (I32 j = 0; j < 3; j++)
+        {
+            s(0, j) *= fx;
+            s(1, j) *= fy;
+        }
+
+        // Keep the pixel centers aligned (same as cv::resize)
+        s(0, 2) = (k.at<F64>(0, 2) + 0.5) * fx - 0.5;
+        s(1, 2) = (k.at<F64>(1, 2) + 0.5) * fy - 0.5;
+        return s;
+    }
+
+    void RectifyStage::init_eye(Eye& eye, const Calibration::Intrinsic& intrinsic,
+                                const cv::Size& out, F32 fx, F32 fy)
+    {
+        // Scaling the output camera matrix moves the resize into the map
+        // The map is generated at the output resolution and samples the input frame
+        cv::Mat k(intrinsic.scaled(fx, fy));
+
+        cv::initUndistortRectifyMap(intrinsic.k, intrinsic.d,
+                                    cv::noArray(), k,
+                                    out, CV_16SC2,
+                                    eye.map_xy, eye.map_interp);
     }
 
     void RectifyStage::process(cv::Mat& left, cv::Mat& right)
     {
-        auto& a1 = m_proc.feed<T_LEFT>({left, m_left_x, m_left_y});
-        auto& a2 = m_proc.feed<T_RIGHT>({right, m_right_x, m_right_y});
+        process_eyes(left, right);
+    }
 
-        a1.await();
-        a2.await();
+    void RectifyStage::process_eye(U32 eye, cv::Mat& frame)
+    {
+        FW_ASSERT(eye < T_N, eye);
+
+        // Remap cannot run in place, frames are written to the arena
+        cv::Mat& out = m_arena.target(eye, frame, m_size, frame.type());
+        cv::remap(frame, out,
+                  m_eyes[eye].map_xy, m_eyes[eye].map_interp,
+                  m_interp);
+        frame = out;
+    }
+
+    static I32 floor_div(I32 a, I32 b)
+    {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
     }
 
     StereoStage::StereoStage(
-            Vis* vis, const Vis_StereoAlgorithm& algorithm)
+            VisArena& arena, const StereoParams& params, const Vis_StereoAlgorithm& algorithm)
+            : m_arena(arena), m_frame(0)
     {
-        Fw::ParamValid valid;
-        I32 preFilterCap = vis->paramGet_STEREO_PRE_FILTER_CAP(valid);
-        I32 uniquenessRatio = vis->paramGet_STEREO_UNIQUENESS_RATIO(valid);
+        I32 blockSize = params.block_size;
+        U32 bands = params.bands;
+
+        // OpenCV matchers only search multiples of 16 disparities
+        m_disparity_align = algorithm == Vis_StereoAlgorithm::CENSUS ||
+                            algorithm == Vis_StereoAlgorithm::CENSUS_SGM ? 1 : 16;
+
+        m_levels = static_cast<I32>(std::min<U32>(params.pyramid_levels, VIS_STEREO_PYRAMID_LEVEL_MAX));
+        m_radius = std::max(0, std::min<I32>(params.pyramid_radius, CensusStereo::REFINE_RADIUS_MAX));
+
+        StereoParams coarse = params;
+        if (m_levels > 0)
+        {
+            // Scaled disparity range covering the full range
+            I32 scale = 1 << m_levels;
+            I32 lo = floor_div(params.min_disparity, scale);
+            I32 hi = -floor_div(-(params.min_disparity + params.num_disparities), scale);
+            I32 n = hi - lo;
+
+            coarse.min_disparity = lo;
+            coarse.num_disparities = std::max(1, (n + m_disparity_align - 1) / m_disparity_align) * m_disparity_align;
+            coarse.speckle_window_size = params.speckle_window_size / (scale * scale);
+
+            m_refine = CensusStereo::create(false);
+            m_refine->setBlockSize(params.block_size);
+            m_refine->setMinDisparity(params.min_disparity);
+            m_refine->setNumDisparities(params.num_disparities);
+            m_refine->setUniquenessRatio(params.uniqueness_ratio);
+            m_refine->setSpeckleWindowSize(params.speckle_window_size);
+            m_refine->setSpeckleRange(params.speckle_range);
+        }
+
+        // Bands search (and seed) the range at the matching resolution
+        m_min_disparity = coarse.min_disparity;
+        m_num_disparities = coarse.num_disparities;
+        m_seed_margin = params.seed_margin;
+        m_seed_motion = params.seed_motion;
+        m_histogram.resize(m_num_disparities);
+
+        m_band_n = std::max<U32>(1, std::min<U32>(bands, VIS_STEREO_BAND_N));
+        for (U32 i = 0; i < m_band_n; i++)
+        {
+            m_bands[i].stereo = create(coarse, algorithm);
+            m_bands[i].min_disparity = m_min_disparity;
+            m_bands[i].num_disparities = m_num_disparities;
+            m_bands[i].invalid = static_cast<I16>((m_min_disparity - 1) * cv::StereoMatcher::DISP_SCALE);
+        }
+
+        // Block matching only looks at the block window
+        // Semi-global aggregation runs along vertical paths and needs more context
+        m_overlap = blockSize / 2;
+        if (algorithm == Vis_StereoAlgorithm::SEMI_GLOBAL_BLOCK_MATCHING ||
+            algorithm == Vis_StereoAlgorithm::CENSUS_SGM)
+        {
+            m_overlap += VIS_STEREO_SGBM_OVERLAP;
+        }
+    }
+
+    cv::Ptr<cv::StereoMatcher> StereoStage::create(const StereoParams& params, const Vis_StereoAlgorithm& algorithm)
+    {
+        cv::Ptr<cv::StereoMatcher> stereo;
+
+        I32 preFilterCap = params.pre_filter_cap;
+        I32 uniquenessRatio = params.uniqueness_ratio;
 
         switch (algorithm.e)
         {
             case Vis_StereoAlgorithm::BLOCK_MATCHING:
             {
                 auto stereo_bm = cv::StereoBM::create();
-                I32 textureThreshold = vis->paramGet_STEREO_BM_TEXTURE_THRESHOLD(valid);
+                I32 textureThreshold = params.bm_texture_threshold;
 
                 stereo_bm->setPreFilterCap(preFilterCap);
                 stereo_bm->setUniquenessRatio(uniquenessRatio);
                 stereo_bm->setTextureThreshold(textureThreshold);
-                m_stereo = stereo_bm;
+                stereo = stereo_bm;
             }
                 break;
             case Vis_StereoAlgorithm::SEMI_GLOBAL_BLOCK_MATCHING:
@@ -94,79 +223,687 @@ namespace Heli
                 auto stereo_sgbm = cv::StereoSGBM::create();
                 stereo_sgbm->setPreFilterCap(preFilterCap);
                 stereo_sgbm->setUniquenessRatio(uniquenessRatio);
-                m_stereo = stereo_sgbm;
+                stereo = stereo_sgbm;
+            }
+                break;
+            case Vis_StereoAlgorithm::CENSUS:
+            case Vis_StereoAlgorithm::CENSUS_SGM:
+            {
+                auto census = CensusStereo::create(algorithm == Vis_StereoAlgorithm::CENSUS_SGM);
+                I32 p1 = params.census_p1;
+                I32 p2 = params.census_p2;
+
+                census->setUniquenessRatio(uniquenessRatio);
+                census->setPenalties(p1, p2);
+                stereo = census;
             }
                 break;
         }
 
-        I32 blockSize = vis->paramGet_STEREO_BLOCK_SIZE(valid);
-        I32 minDisparity = vis->paramGet_STEREO_MIN_DISPARITY(valid);
-        I32 numDisparity = vis->paramGet_STEREO_NUM_DISPARITIES(valid);
-        I32 speckleWindowSize = vis->paramGet_STEREO_SPECKLE_WINDOW_SIZE(valid);
-        I32 speckleRange = vis->paramGet_STEREO_SPECKLE_RANGE(valid);
+        I32 blockSize = params.block_size;
+        I32 minDisparity = params.min_disparity;
+        I32 numDisparity = params.num_disparities;
+        I32 speckleWindowSize = params.speckle_window_size;
+        I32 speckleRange = params.speckle_range;
+
+        stereo->setBlockSize(blockSize);
+        stereo->setMinDisparity(minDisparity);
+        stereo->setNumDisparities(numDisparity);
+        stereo->setSpeckleWindowSize(speckleWindowSize);
+        stereo->setSpeckleRange(speckleRange);
+        stereo->setDisp12MaxDiff(1);
+        return stereo;
+    }
+
+    void StereoStage::match(Band* band)
+    {
+        band->stereo->compute(band->left, band->right, band->disparity);
+
+        // Bands own disjoint rows of the output
+        band->disparity.rowRange(band->offset, band->offset + band->out.rows).copyTo(band->out);
+        invalidate(band, band->out);
+    }
+
+    void StereoStage::invalidate(const Band* band, cv::Mat& disparity)
+    {
+        // A narrowed search marks invalid pixels below its own minimum
+        // which may be a valid disparity of the full range
+        I16 min = static_cast<I16>(band->min_disparity * cv::StereoMatcher::DISP_SCALE);
+        if (min == band->invalid + cv::StereoMatcher::DISP_SCALE)
+        {
+            return;
+        }
+
+        for (I32 y = 0; y < disparity.rows; y++)
+        {
+            I16* row = disparity.ptr<I16>(y);
+            for (I32 x = 0; x < disparity.cols; x++)
+            {
+                if (row[x] < min)
+                {
+                    row[x] = band->invalid;
+                }
+            }
+        }
+    }
+
+    void StereoStage::seed(Band& band, const cv::Mat& left, I32 y0)
+    {
+        const cv::Mat& disparity = m_last;
+
+        // Full searches are staggered between bands to keep the frame time even
+        bool full = m_seed_margin <= 0 ||
+                    m_previous.size() != disparity.size() ||
+                    m_previous.cols != left.cols ||
+                    m_previous.rows < y0 + left.rows ||
+                    (m_frame + static_cast<U32>(&band - m_bands)) % VIS_STEREO_SEED_REFRESH == 0;
+
+        if (!full)
+        {
+            cv::Mat previous = m_previous.rowRange(y0, y0 + left.rows);
+            F64 motion = cv::norm(left, previous, cv::NORM_L1) / static_cast<F64>(left.total());
+            full = motion > m_seed_motion;
+        }
+
+        I32 min_disparity = m_min_disparity;
+        I32 num_disparities = m_num_disparities;
+
+        if (!full)
+        {
+            std::fill(m_histogram.begin(), m_histogram.end(), 0);
 
-        m_stereo->setBlockSize(blockSize);
-        m_stereo->setMinDisparity(minDisparity);
-        m_stereo->setNumDisparities(numDisparity);
-        m_stereo->setSpeckleWindowSize(speckleWindowSize);
-        m_stereo->setSpeckleRange(speckleRange);
-        m_stereo->setDisp12MaxDiff(1);
+            U32 valid = 0;
+            const I16 min = static_cast<I16>(m_min_disparity * cv::StereoMatcher::DISP_SCALE);
+            for (I32 y = y0; y < y0 + left.rows; y++)
+            {
+                const I16* row = disparity.ptr<I16>(y);
+                for (I32 x = 0; x < disparity.cols; x++)
+                {
+                    if (row[x] >= min)
+                    {
+                        I32 d = (row[x] - min) / cv::StereoMatcher::DISP_SCALE;
+                        m_histogram[std::min(d, m_num_disparities - 1)]++;
+                        valid++;
+                    }
+                }
+            }
+
+            if (valid * 100 >= left.total() * VIS_STEREO_SEED_VALID)
+            {
+                // Trimmed disparity range of the previous frame
+                U32 trim = valid * VIS_STEREO_SEED_TRIM / 100;
+                I32 lo = 0;
+                U32 below = m_histogram[lo];
+                while (below <= trim) below += m_histogram[++lo];
+
+                I32 hi = m_num_disparities - 1;
+                U32 above = m_histogram[hi];
+                while (above <= trim) above += m_histogram[--hi];
+
+                I32 first = std::max(0, lo - m_seed_margin);
+                I32 last = std::min(m_num_disparities - 1, hi + m_seed_margin);
+                I32 n = last - first + 1;
+                n = (n + m_disparity_align - 1) / m_disparity_align * m_disparity_align;
+
+                num_disparities = std::min(m_num_disparities, n);
+                first = std::min(first, m_num_disparities - num_disparities);
+                min_disparity = m_min_disparity + first;
+            }
+        }
+
+        if (min_disparity != band.min_disparity || num_disparities != band.num_disparities)
+        {
+            band.stereo->setMinDisparity(min_disparity);
+            band.stereo->setNumDisparities(num_disparities);
+            band.min_disparity = min_disparity;
+            band.num_disparities = num_disparities;
+        }
     }
 
     void StereoStage::process(cv::Mat& left, cv::Mat& right)
     {
-        m_stereo->compute(left, right, m_disparity);
-        m_disparity.convertTo(right, CV_8U);
+        // Full precision disparity is kept for the depth projection
+        cv::Mat& disparity = m_arena.disparity();
+
+        if (m_levels == 0)
+        {
+            compute(left, right, disparity);
+        }
+        else
+        {
+            // Near field disparities are matched at a fraction of the cost
+            // and only refined over a few disparities per pixel
+            F64 s = 1.0 / (1 << m_levels);
+            cv::resize(left, m_coarse_left, cv::Size(), s, s, cv::INTER_AREA);
+            cv::resize(right, m_coarse_right, cv::Size(), s, s, cv::INTER_AREA);
+
+            compute(m_coarse_left, m_coarse_right, m_coarse);
+            m_refine->refine(left, right, m_coarse, 1 << m_levels, m_min_disparity, m_radius, disparity);
+        }
+
+        m_frame++;
+        disparity.convertTo(right, CV_8U);
     }
 
-    ColormapStage::ColormapStage(const Vis_ColorMap& colormap, const CamSelect& select)
-            : m_colormap(colormap), m_select(select)
+    void StereoStage::compute(const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity)
     {
+        I32 rows = left.rows;
+        for (U32 i = 0; i < m_band_n; i++)
+        {
+            I32 y0 = rows * static_cast<I32>(i) / static_cast<I32>(m_band_n);
+            I32 y1 = rows * static_cast<I32>(i + 1) / static_cast<I32>(m_band_n);
+            seed(m_bands[i], left.rowRange(y0, y1), y0);
+        }
+
+        if (m_band_n == 1)
+        {
+            m_bands[0].stereo->compute(left, right, disparity);
+            invalidate(&m_bands[0], disparity);
+        }
+        else
+        {
+            disparity.create(left.size(), CV_16S);
+
+            for (U32 i = 0; i < m_band_n; i++)
+            {
+                I32 y0 = rows * static_cast<I32>(i) / static_cast<I32>(m_band_n);
+                I32 y1 = rows * static_cast<I32>(i + 1) / static_cast<I32>(m_band_n);
+                I32 a = std::max(0, y0 - m_overlap);
+                I32 b = std::min(rows, y1 + m_overlap);
+
+                Band& band = m_bands[i];
+                band.left = left.rowRange(a, b);
+                band.right = right.rowRange(a, b);
+                band.out = disparity.rowRange(y0, y1);
+                band.offset = y0 - a;
+            }
+
+            // The first band is matched on this thread
+            libparallel::TaskGroup group;
+            for (U32 i = 1; i < m_band_n; i++)
+            {
+                Band* band = &m_bands[i];
+                group.run([band]() {
+                    bool counted = VisArena::count(true);
+                    match(band);
+                    VisArena::count(counted);
+                });
+            }
+
+            match(&m_bands[0]);
+            group.wait();
+        }
+
+        if (m_seed_margin > 0)
+        {
+            // Frames in flight each have their own disparity
+            // The previous one is not reused until this frame is done
+            // A coarse disparity is only rewritten once the next frame was seeded
+            left.copyTo(m_previous);
+            m_last = disparity;
+        }
+    }
+
+    ColormapStage::ColormapStage(VisArena& arena, const Vis_ColorMap& colormap, const CamSelect& select)
+            : m_arena(arena), m_select(select)
+    {
+        // applyColorMap converts and allocates on every call
+        // Build the table once and apply it with a plain lookup
+        cv::Mat ramp(1, 256, CV_8U);
+        for (I32 i = 0; i < 256; i++)
+        {
+            ramp.at<U8>(0, i) = static_cast<U8>(i);
+        }
+
+        cv::applyColorMap(ramp, m_lut, colormap.e);
+    }
+
+    void ColormapStage::apply(cv::Mat& frame, U32 eye)
+    {
+        cv::Mat& out = m_arena.target(eye, frame, frame.size(), CV_8UC3);
+        if (frame.channels() == 1)
+        {
+            cv::cvtColor(frame, out, cv::COLOR_GRAY2BGR);
+            cv::LUT(out, m_lut, out);
+        }
+        else
+        {
+            cv::LUT(frame, m_lut, out);
+        }
+
+        frame = out;
     }
 
     void ColormapStage::process(cv::Mat& left, cv::Mat& right)
     {
         if (m_select == CamSelect::LEFT || m_select == CamSelect::BOTH)
         {
-            cv::applyColorMap(left, left, m_colormap.e);
+            apply(left, T_LEFT);
         }
 
         if (m_select == CamSelect::RIGHT || m_select == CamSelect::BOTH)
         {
-            cv::applyColorMap(right, right, m_colormap.e);
+            apply(right, T_RIGHT);
+        }
+    }
+
+    DepthStage::DepthStage(VisArena& arena, const Calibration& calibration,
+                           F32 baseline, U32 left_mask_pix, F32 fx_scale,
+                           I32 min_disparity, I32 num_disparities,
+                           const Vis_DepthFormat& format)
+            : m_arena(arena), m_format(format),
+              m_left_mask_pix(static_cast<I32>(left_mask_pix)),
+              m_lut_min(min_disparity * cv::StereoMatcher::DISP_SCALE)
+    {
+        F64 fx = calibration.left.k.at<F64>(0, 0) * fx_scale;
+
+        // One entry per fixed point disparity step
+        U32 n = num_disparities * cv::StereoMatcher::DISP_SCALE;
+        m_lut_mm.resize(n);
+        m_lut_cm.resize(n);
+
+        for (U32 i = 0; i < n; i++)
+        {
+            F64 d = static_cast<F64>(m_lut_min + static_cast<I32>(i)) / cv::StereoMatcher::DISP_SCALE;
+            F64 depth_cm = d > 0 ? fx * baseline / d : 0;
+
+            m_lut_cm[i] = static_cast<F32>(depth_cm);
+            m_lut_mm[i] = cv::saturate_cast<U16>(depth_cm * 10);
         }
     }
 
-    DepthStage::DepthStage(const Calibration& calibration, F32 baseline, U32 left_mask_pix)
-            : m_fx(calibration.left.k.at<F64>(0, 0)),
-              m_b(baseline),
-              m_left_mask_pix(static_cast<I32>(left_mask_pix))
+    template<typename T>
+    void DepthStage::project(const cv::Mat& disparity, cv::Mat& depth, const T* lut)
     {
+        const I32 lut_n = static_cast<I32>(m_lut_mm.size());
+        const I32 cols = disparity.cols;
+        const I32 mask = std::min(m_left_mask_pix, cols);
+
+        for (I32 y = 0; y < disparity.rows; y++)
+        {
+            const I16* src = disparity.ptr<I16>(y);
+            T* dst = depth.ptr<T>(y);
+
+            // The left columns are never seen by the right camera
+            std::fill(dst, dst + mask, T(0));
+
+            for (I32 x = mask; x < cols; x++)
+            {
+                // Unsigned compare folds both range checks into one
+                U32 i = static_cast<U32>(static_cast<I32>(src[x]) - m_lut_min);
+                dst[x] = i < static_cast<U32>(lut_n) ? lut[i] : T(0);
+            }
+        }
     }
 
     void DepthStage::process(cv::Mat& left, cv::Mat& right)
     {
-        cv::Mat& disp = right;
+        // The 8-bit frame holds the fixed point values saturated
+        // Vis only adds this stage after a stereo stage at the same size
+        const cv::Mat& fixed = m_arena.disparity();
+        FW_ASSERT(fixed.type() == CV_16S, fixed.type());
+        FW_ASSERT(fixed.size() == right.size(), fixed.cols, fixed.rows, right.cols, right.rows);
+
+        cv::Mat& depth = m_arena.target(T_RIGHT, right, right.size(),
+                                        m_format == Vis_DepthFormat::MILLIMETER ? CV_16U : CV_32F);
+
+        if (m_format == Vis_DepthFormat::MILLIMETER)
+        {
+            project(fixed, depth, m_lut_mm.data());
+        }
+        else
+        {
+            project(fixed, depth, m_lut_cm.data());
+        }
+
+        right = depth;
+    }
+
+    SparseStage::SparseStage(VisArena& arena, const Calibration& calibration,
+                             F32 baseline, F32 fx_scale,
+                             const SparseParams& params,
+                             const std::vector<cv::Rect>& rois, U32 step)
+            : m_arena(arena), m_rois(rois),
+              m_step(std::max<I32>(1, static_cast<I32>(step)))
+    {
+        F64 fx = calibration.left.k.at<F64>(0, 0) * fx_scale;
+        m_fx_baseline = static_cast<F32>(fx * baseline);
+
+        I32 max_disparity = params.min_disparity + params.num_disparities - 1;
+        max_disparity = std::min<I32>(max_disparity, params.min_disparity + Vo::StereoMatcher::MAX_DISPARITIES - 1);
+
+        m_matcher.setWindowSize(params.window_size);
+        m_matcher.setTextureThreshold(params.texture_threshold);
+        m_matcher.setUniquenessRatio(params.uniqueness_ratio);
+        m_matcher.setDisparityRange(static_cast<I16>(params.min_disparity),
+                                    static_cast<I16>(max_disparity));
+    }
+
+    void SparseStage::layout(const cv::Size& size)
+    {
+        std::vector<cv::Rect> rois = m_rois;
+        if (rois.empty())
+        {
+            rois.emplace_back(0, 0, size.width, size.height);
+        }
+
+        // Count the samples first so that the points are allocated once
+        const cv::Rect frame(0, 0, size.width, size.height);
+        U32 n = 0;
+        for (auto& roi : rois)
+        {
+            roi &= frame;
+            n += ((roi.width + m_step - 1) / m_step) * ((roi.height + m_step - 1) / m_step);
+        }
+
+        n = std::min<U32>(n, VIS_SPARSE_POINT_MAX);
+        m_points.create(static_cast<I32>(n), 2, CV_16S);
+
+        // Samples are centered in their grid cell
+        U32 i = 0;
+        for (const auto& roi : rois)
+        {
+            for (I32 y = roi.y + m_step / 2; y < roi.y + roi.height && i < n; y += m_step)
+            {
+                for (I32 x = roi.x + m_step / 2; x < roi.x + roi.width && i < n; x += m_step)
+                {
+                    m_points.at<I16>(static_cast<I32>(i), 0) = static_cast<I16>(x);
+                    m_points.at<I16>(static_cast<I32>(i), 1) = static_cast<I16>(y);
+                    i++;
+                }
+            }
+        }
+
+        // The count above is an upper bound
+        m_points = m_points.rowRange(0, static_cast<I32>(i));
+        m_size = size;
+    }
+
+    void SparseStage::process(cv::Mat& left, cv::Mat& right)
+    {
+        if (left.size() != m_size)
+        {
+            layout(left.size());
+        }
+
+        m_matcher.compute(left, right, m_points, m_disparity);
+
+        cv::Mat& samples = m_arena.samples();
+        samples.create(m_points.rows, 3, CV_32F);
+
+        for (I32 i = 0; i < m_points.rows; i++)
+        {
+            F32 d = m_disparity.at<F32>(i);
+            F32* s = samples.ptr<F32>(i);
+            s[0] = m_points.at<I16>(i, 0);
+            s[1] = m_points.at<I16>(i, 1);
+            s[2] = d > 0 ? m_fx_baseline / d : 0;
+        }
+
+        right = samples;
+    }
+
+    StixelStage::StixelStage(VisArena& arena, const Calibration& calibration,
+                             F32 y_scale, const StixelParams& params)
+            : m_arena(arena), m_params(params)
+    {
+        // Ground rows follow the rectified frame at its current size
+        cv::Matx33d k = calibration.left.scaled(1.0, y_scale);
+        m_fy = static_cast<F32>(k(1, 1));
+        m_cy = static_cast<F32>(k(1, 2));
+        m_params.min_run = std::max<U32>(1, params.min_run);
+    }
+
+    void StixelStage::layout(I32 rows)
+    {
+        m_ground.resize(rows);
+
+        const F32 far = std::numeric_limits<F32>::max();
+        for (I32 y = 0; y < rows; y++)
+        {
+            // Ground at or above the horizon is infinitely far
+            F32 below = static_cast<F32>(y) - m_cy;
+            if (m_params.camera_height <= 0 || below <= 0)
+            {
+                m_ground[y] = far;
+            }
+            else
+            {
+                m_ground[y] = m_fy * m_params.camera_height / below * (1 - m_params.ground_margin);
+            }
+        }
+    }
+
+    template<typename T>
+    void StixelStage::scan(const cv::Mat& depth, F32 to_depth)
+    {
+        const I32 cols = depth.cols;
+        const U16 min_run = static_cast<U16>(std::min<U32>(m_params.min_run, 0xFFFF));
+        const F32 far = std::numeric_limits<F32>::max();
+
+        m_nearest.assign(cols, far);
+        m_run.assign(cols, 0);
+        m_base.assign(cols, -1);
+
+        F32* nearest = m_nearest.data();
+        U16* run = m_run.data();
+        I32* base = m_base.data();
+
+        for (I32 y = depth.rows - 1; y >= 0; y--)
+        {
+            const T* row = depth.ptr<T>(y);
+            const F32 ground = m_ground[y];
+            const I32 bottom = y + min_run - 1;
+
+            // Branch free so that the column loop vectorizes
+            for (I32 x = 0; x < cols; x++)
+            {
+                F32 z = static_cast<F32>(row[x]) * to_depth;
+                bool obstacle = z > 0 && z < ground;
+
+                run[x] = obstacle ? static_cast<U16>(std::min<I32>(run[x] + 1, min_run)) : 0;
+                bool solid = run[x] >= min_run;
+
+                nearest[x] = solid && z < nearest[x] ? z : nearest[x];
+                base[x] = solid && base[x] < 0 ? bottom : base[x];
+            }
+        }
+    }
+
+    void StixelStage::process(cv::Mat& left, cv::Mat& right)
+    {
+        (void) left;
+
+        FW_ASSERT(right.type() == CV_16U || right.type() == CV_32F, right.type());
+        FW_ASSERT(right.cols >= VIS_STIXEL_N, right.cols);
+
+        if (static_cast<I32>(m_ground.size()) != right.rows)
+        {
+            layout(right.rows);
+        }
 
-        // Avoid instability and division by zero
-        disp.setTo(0.1, disp == 0);
-        disp.setTo(0.1, disp == -1.0);
+        // Millimeter depth is reported in the centimeter baseline units
+        if (right.type() == CV_16U) scan<U16>(right, 0.1f);
+        else scan<F32>(right, 1.0f);
 
-        // Make empty depth map then fill with depth
-        disp = m_fx * m_b / disp;
+        cv::Mat& stixels = m_arena.stixels();
+        stixels.create(2, VIS_STIXEL_N, CV_32F);
+
+        F32* depth = stixels.ptr<F32>(0);
+        F32* base = stixels.ptr<F32>(1);
+
+        const I32 cols = right.cols;
+        const F32 far = std::numeric_limits<F32>::max();
+        for (I32 i = 0; i < VIS_STIXEL_N; i++)
+        {
+            I32 x0 = cols * i / VIS_STIXEL_N;
+            I32 x1 = cols * (i + 1) / VIS_STIXEL_N;
+
+            F32 d = *std::min_element(&m_nearest[x0], &m_nearest[x1]);
+            I32 b = *std::max_element(&m_base[x0], &m_base[x1]);
+
+            depth[i] = d < far ? d : 0;
+            base[i] = static_cast<F32>(b);
+        }
+    }
+
+    PointCloudStage::PointCloudStage(VisArena& arena, const Calibration& calibration,
+                                     F32 x_scale, F32 y_scale,
+                                     const cv::Matx44f& transform,
+                                     const CloudParams& params)
+            : m_arena(arena), m_transform(transform), m_params(params),
+              m_buckets(VIS_CLOUD_BUCKET_N), m_stamp(0)
+    {
+        static_assert((VIS_CLOUD_BUCKET_N & (VIS_CLOUD_BUCKET_N - 1)) == 0,
+                      "Voxel buckets are indexed with a mask");
+        static_assert(VIS_CLOUD_BUCKET_N > VIS_CLOUD_POINT_MAX,
+                      "Voxel grid must have room to probe when nearly full");
 
-        // Mask out the left side of the image
-        // This is caused by the right camera not seeing this portion of the image
-        cv::Mat mask = cv::Mat::zeros(disp.size[0], disp.size[1], CV_8U);
-        I32 ymax = disp.size[0];
-        I32 xmax = disp.size[1];
+        // Points are reprojected from the rectified frame at its current size
+        cv::Matx33d k = calibration.left.scaled(x_scale, y_scale);
+        m_fx = static_cast<F32>(k(0, 0));
+        m_fy = static_cast<F32>(k(1, 1));
+        m_cx = static_cast<F32>(k(0, 2));
+        m_cy = static_cast<F32>(k(1, 2));
 
-        cv::rectangle(
-                mask,
-                cv::Point(m_left_mask_pix, 0),
-                cv::Point(xmax, ymax),
-                255, -1);
+        m_params.stride = std::max<U32>(1, params.stride);
+        m_inv_voxel = params.voxel_size > 0 ? 1.0f / params.voxel_size : 1.0f;
+        m_used.reserve(VIS_CLOUD_POINT_MAX);
+
+        for (auto& voxel : m_buckets)
+        {
+            voxel.stamp = m_stamp;
+        }
+    }
+
+    void PointCloudStage::insert(F32 x, F32 y, F32 z)
+    {
+        I32 key[3] = {
+                static_cast<I32>(std::floor(x * m_inv_voxel)),
+                static_cast<I32>(std::floor(y * m_inv_voxel)),
+                static_cast<I32>(std::floor(z * m_inv_voxel)),
+        };
+
+        U32 hash = (static_cast<U32>(key[0]) * 73856093U) ^
+                   (static_cast<U32>(key[1]) * 19349663U) ^
+                   (static_cast<U32>(key[2]) * 83492791U);
+
+        for (U32 probe = 0; probe < VIS_CLOUD_PROBE_N; probe++)
+        {
+            U32 b = (hash + probe) & (VIS_CLOUD_BUCKET_N - 1);
+            Voxel& voxel = m_buckets[b];
+
+            if (voxel.stamp != m_stamp)
+            {
+                // Cloud is full, only existing voxels still grow
+                if (m_used.size() >= VIS_CLOUD_POINT_MAX)
+                {
+                    return;
+                }
+
+                // Claim an empty bucket for a new voxel
+                voxel.stamp = m_stamp;
+                voxel.key[0] = key[0];
+                voxel.key[1] = key[1];
+                voxel.key[2] = key[2];
+                voxel.sum[0] = x;
+                voxel.sum[1] = y;
+                voxel.sum[2] = z;
+                voxel.n = 1;
+                m_used.push_back(b);
+                return;
+            }
+
+            if (voxel.key[0] == key[0] && voxel.key[1] == key[1] && voxel.key[2] == key[2])
+            {
+                voxel.sum[0] += x;
+                voxel.sum[1] += y;
+                voxel.sum[2] += z;
+                voxel.n++;
+                return;
+            }
+        }
 
-        disp.setTo(0, mask);
+        // Every probed bucket holds another voxel
+    }
+
+    template<typename T>
+    void PointCloudStage::accumulate(const cv::Mat& depth, F32 to_depth)
+    {
+        const I32 stride = static_cast<I32>(m_params.stride);
+        const F32 max_depth = m_params.max_depth > 0 ? m_params.max_depth : std::numeric_limits<F32>::max();
+        const F32 inv_fx = 1.0f / m_fx;
+        const F32 inv_fy = 1.0f / m_fy;
+
+        for (I32 v = 0; v < depth.rows; v += stride)
+        {
+            const T* row = depth.ptr<T>(v);
+            const F32 ry = (static_cast<F32>(v) - m_cy) * inv_fy;
+
+            for (I32 u = 0; u < depth.cols; u += stride)
+            {
+                F32 z = static_cast<F32>(row[u]) * to_depth;
+                if (z <= 0 || z > max_depth)
+                {
+                    continue;
+                }
+
+                insert((static_cast<F32>(u) - m_cx) * inv_fx * z, ry * z, z);
+            }
+        }
+    }
+
+    void PointCloudStage::process(cv::Mat& left, cv::Mat& right)
+    {
+        (void) left;
+
+        FW_ASSERT(right.type() == CV_16U || right.type() == CV_32F, right.type());
+
+        // Stamps only repeat after every bucket was cleared
+        if (++m_stamp == 0)
+        {
+            for (auto& voxel : m_buckets)
+            {
+                voxel.stamp = 0;
+            }
+
+            m_stamp = 1;
+        }
+
+        m_used.clear();
+
+        // Millimeter depth is reported in the centimeter baseline units
+        if (right.type() == CV_16U) accumulate<U16>(right, 0.1f);
+        else accumulate<F32>(right, 1.0f);
+
+        cv::Mat& cloud = m_arena.cloud();
+        cloud.create(VIS_CLOUD_POINT_MAX, 3, CV_32F);
+
+        const cv::Matx44f& T = m_transform;
+        for (U32 i = 0; i < m_used.size(); i++)
+        {
+            const Voxel& voxel = m_buckets[m_used[i]];
+            F32 inv_n = 1.0f / static_cast<F32>(voxel.n);
+            F32 x = voxel.sum[0] * inv_n;
+            F32 y = voxel.sum[1] * inv_n;
+            F32 z = voxel.sum[2] * inv_n;
+
+            F32* p = cloud.ptr<F32>(static_cast<I32>(i));
+            p[0] = T(0, 0) * x + T(0, 1) * y + T(0, 2) * z + T(0, 3);
+            p[1] = T(1, 0) * x + T(1, 1) * y + T(1, 2) * z + T(1, 3);
+            p[2] = T(2, 0) * x + T(2, 1) * y + T(2, 2) * z + T(2, 3);
+        }
+
+        m_arena.cloud_n() = static_cast<U32>(m_used.size());
+    }
+
+    TrackStage::TrackStage(Track track)
+            : m_track(std::move(track))
+    {
+    }
+
+    void TrackStage::process(cv::Mat& left, cv::Mat& right)
+    {
+        m_track(left, right);
     }
 }
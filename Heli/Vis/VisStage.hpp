@@ -5,15 +5,25 @@
 #ifndef STEREO_HELI_VISSTAGE_HPP
 #define STEREO_HELI_VISSTAGE_HPP
 
+#include <VisCfg.hpp>
 #include <Fw/Types/String.hpp>
 #include <Heli/Cam/CamFrame.hpp>
+#include <Heli/Vis/VisArena.hpp>
 #include <Heli/Vis/Vis_StereoAlgorithmEnumAc.hpp>
+#include <Heli/Vis/Vis_DepthFormatEnumAc.hpp>
+#include <Heli/Vis/Vis_InterpolationEnumAc.hpp>
+#include <Heli/Vis/Vis_ColorMapEnumAc.hpp>
+#include <Heli/Cam/CamSelectEnumAc.hpp>
 
 #include <opencv2/core.hpp>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include <Heli/parallel/parallel.hpp>
+#include <Heli/Nav/Stereo.hpp>
+
+#include <functional>
+#include <vector>
 
 namespace Heli
 {
@@ -26,11 +36,20 @@ namespace Heli
     };
 
     class Vis;
+    class CensusStereo;
 
     struct Calibration {
         struct Intrinsic {
             cv::Mat k;  //!< Camera matrix
             cv::Mat d;  //!< Distortion parameters
+
+            /**
+             * Camera matrix of the rectified frames after resizing
+             * Pixel centers stay aligned (same as cv::resize and the rectification maps)
+             * @param fx horizontal scale of the frames
+             * @param fy vertical scale of the frames
+             */
+            cv::Matx33d scaled(F64 fx, F64 fy) const;
         };
 
         Intrinsic left;
@@ -43,22 +62,95 @@ namespace Heli
         cv::Size size;  //!< Image frame dimensions
     };
 
+    //! Stereo matcher configuration (STEREO_* parameters of Vis)
+    struct StereoParams
+    {
+        I32 pre_filter_cap;
+        I32 block_size;
+        I32 min_disparity;
+        I32 num_disparities;
+        I32 uniqueness_ratio;
+        I32 speckle_window_size;
+        I32 speckle_range;
+        I32 bm_texture_threshold;
+        I32 census_p1;
+        I32 census_p2;
+        U32 bands;
+        I32 seed_margin;
+        F32 seed_motion;
+        U32 pyramid_levels;
+        I32 pyramid_radius;
+    };
+
+    //! Stixel configuration (STIXEL_* parameters of Vis)
+    struct StixelParams
+    {
+        F32 camera_height;      //!< Camera height above the ground, 0 treats every pixel as an obstacle
+        F32 ground_margin;      //!< Fraction of the ground depth a pixel must be closer by to be an obstacle
+        U32 min_run;            //!< Consecutive obstacle rows needed to start an obstacle
+    };
+
+    //! Point cloud configuration (CLOUD_* parameters of Vis)
+    struct CloudParams
+    {
+        F32 voxel_size;         //!< Voxel edge length in baseline units
+        F32 max_depth;          //!< Farthest depth kept, 0 keeps every depth
+        U32 stride;             //!< Pixels between reprojected pixels along both axes
+    };
+
+    //! Sparse stereo configuration (SPARSE_* parameters of Vis)
+    struct SparseParams
+    {
+        U8 window_size;
+        U16 texture_threshold;
+        U8 uniqueness_ratio;
+        I32 min_disparity;
+        I32 num_disparities;
+    };
+
     class VisStage
     {
     public:
+        //! Frames a stage needs at once
+        enum Input
+        {
+            JOINT,          //!< Both eyes of the frame
+            PER_EYE,        //!< Each eye on its own, see process_eye
+        };
+
         virtual void process(cv::Mat &left, cv::Mat &right) = 0;
 
+        /**
+         * Process a single eye of a PER_EYE stage
+         * Both eyes of a frame may be processed at the same time on different threads
+         * @param eye T_LEFT or T_RIGHT
+         * @param frame frame of the eye, replaced by the output
+         */
+        virtual void process_eye(U32 eye, cv::Mat &frame);
+
+        virtual Input input() const { return JOINT; }
+
+        //! Short stage name for profiling
+        virtual const char* name() const = 0;
+
         virtual ~VisStage() = default;
+
+    protected:
+        //! Run process_eye on both eyes at the same time
+        void process_eyes(cv::Mat &left, cv::Mat &right);
     };
 
     class ScaleStage : public VisStage
     {
     public:
-        ScaleStage(F32 x_scale, F32 y_scale, const Vis_Interpolation& interp);
+        ScaleStage(VisArena& arena, F32 x_scale, F32 y_scale, const Vis_Interpolation& interp);
         void process(cv::Mat &left, cv::Mat &right) override;
+        void process_eye(U32 eye, cv::Mat &frame) override;
+        Input input() const override { return PER_EYE; }
+        const char* name() const override { return "SCALE"; }
 
     private:
-        libparallel::Parallelize<T_N, cv::Mat&> m_proc;
+        VisArena& m_arena;
 
         F32 m_fx;
         F32 m_fy;
@@ -68,60 +160,329 @@ namespace Heli
     class RectifyStage : public VisStage
     {
     public:
-        explicit RectifyStage(const Calibration& calibration);
+        /**
+         * Rectify and optionally rescale both frames in a single remap
+         * The scale is folded into the rectification maps so that
+         * each eye is only read once and written at the output resolution
+         * @param calibration camera model
+         * @param fx horizontal output scale
+         * @param fy vertical output scale
+         * @param interp interpolation used while remapping
+         */
+        RectifyStage(VisArena& arena, const Calibration& calibration,
+                              F32 fx = 1.0, F32 fy = 1.0,
+                              const Vis_Interpolation& interp = Vis_Interpolation::LINEAR);
 
         void process(cv::Mat &left, cv::Mat &right) override;
+        void process_eye(U32 eye, cv::Mat &frame) override;
+        Input input() const override { return PER_EYE; }
+        const char* name() const override { return "RECTIFY"; }
 
     private:
-        libparallel::Parallelize<T_N, std::tuple<cv::Mat&, cv::Mat&, cv::Mat&>> m_proc;
+        struct Eye
+        {
+            // Rectification maps to reproject epi-polar lines to be
+            // parallel on both land and right images. Gets rid of distortion
+            // using intrinsic parameters and epi-polar projection with extrinsic
+            // calibration parameters.
+            // Fixed point maps: integer coordinates (CV_16SC2) and
+            // interpolation table indices (CV_16UC1)
+            cv::Mat map_xy;
+            cv::Mat map_interp;
+        };
 
-        // Rectification maps to reproject epi-polar lines to be
-        // parallel on both land and right images. Gets rid of distortion
-        // using intrinsic parameters and epi-polar projection with extrinsic
-        // calibration parameters.
-        cv::Mat m_left_x;
-        cv::Mat m_left_y;
+        static void init_eye(Eye& eye, const Calibration::Intrinsic& intrinsic,
+                             const cv::Size& out, F32 fx, F32 fy);
 
-        cv::Mat m_right_x;
-        cv::Mat m_right_y;
+        VisArena& m_arena;
+
+        cv::InterpolationFlags m_interp;
+        cv::Size m_size;
+        Eye m_eyes[T_N];
     };
 
     class StereoStage : public VisStage
     {
     public:
-        StereoStage(Vis* vis, const Heli::Vis_StereoAlgorithm &algorithm);
+        StereoStage(VisArena& arena, const StereoParams& params, const Heli::Vis_StereoAlgorithm &algorithm);
 
         void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "STEREO"; }
 
     private:
-        cv::Ptr <cv::StereoMatcher> m_stereo;
-        cv::Mat m_disparity;
+        /**
+         * Horizontal slice of the frame matched on its own thread
+         * The input is extended by the overlap so that the block
+         * windows of the output rows are complete
+         */
+        struct Band
+        {
+            cv::Ptr<cv::StereoMatcher> stereo;  //!< Matchers keep state and cannot be shared
+            cv::Mat left;
+            cv::Mat right;
+            cv::Mat disparity;                  //!< Band disparity including the overlap
+            cv::Mat out;                        //!< Rows of the full disparity owned by this band
+            I32 offset;                         //!< First output row in the band disparity
+
+            I32 min_disparity;                  //!< Disparity range searched this frame
+            I32 num_disparities;
+            I16 invalid;                        //!< Invalid disparity of the full search range
+        };
+
+        static cv::Ptr<cv::StereoMatcher> create(const StereoParams& params, const Heli::Vis_StereoAlgorithm &algorithm);
+        static void match(Band* band);
+
+        /**
+         * Match a frame split across the bands
+         * @param left left frame at the matching resolution
+         * @param right right frame at the matching resolution
+         * @param disparity CV_16S output disparity
+         */
+        void compute(const cv::Mat& left, const cv::Mat& right, cv::Mat& disparity);
+        static void invalidate(const Band* band, cv::Mat& disparity);
+
+        /**
+         * Pick the disparity range a band searches this frame
+         * Frames at hover barely change so the disparities of the previous
+         * frame bound the current ones. The full range is searched when
+         * the previous frame is unreliable or the band has changed.
+         * @param band band to seed
+         * @param left current left frame rows owned by the band
+         * @param y0 first row owned by the band
+         */
+        void seed(Band& band, const cv::Mat& left, I32 y0);
+
+        VisArena& m_arena;
+
+        Band m_bands[VIS_STEREO_BAND_N];
+        U32 m_band_n;
+        I32 m_overlap;
+
+        I32 m_min_disparity;                    //!< Full search range
+        I32 m_num_disparities;
+        I32 m_disparity_align;                  //!< Multiple of the searched disparity count
+        I32 m_seed_margin;
+        F32 m_seed_motion;
+
+        U32 m_frame;
+        cv::Mat m_previous;                     //!< Left frame of the previous frame
+        cv::Mat m_last;                         //!< Disparity of the previous frame
+        std::vector<U32> m_histogram;           //!< Integer disparity histogram of a band
+
+        // Coarse to fine matching
+        // The bands match a downsampled frame over the scaled disparity range
+        // and the refiner searches a narrow range around it at full resolution
+        I32 m_levels;                           //!< Pyramid levels, 0 matches at full resolution
+        I32 m_radius;                           //!< Full resolution search radius
+        cv::Ptr<CensusStereo> m_refine;
+        cv::Mat m_coarse_left;
+        cv::Mat m_coarse_right;
+        cv::Mat m_coarse;                       //!< Disparity of the downsampled frame
     };
 
     class ColormapStage : public VisStage
     {
     public:
-        ColormapStage(const Vis_ColorMap &colormap, const CamSelect &select);
+        ColormapStage(VisArena& arena, const Vis_ColorMap &colormap, const CamSelect &select);
 
         void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "COLORMAP"; }
 
     private:
-        Vis_ColorMap m_colormap;
+        void apply(cv::Mat& frame, U32 eye);
+
+        VisArena& m_arena;
+        cv::Mat m_lut;      //!< 256 entry BGR lookup table of the colormap
         CamSelect m_select;
     };
 
     class DepthStage : public VisStage
     {
     public:
-        explicit DepthStage(const Calibration& calibration, F32 baseline, U32 left_mask_pix);
+        /**
+         * Project disparity to depth with a lookup table
+         * The table covers every fixed point disparity the matcher can produce
+         * @param arena frame arena holding the stereo disparity, must be filled by an earlier stage
+         * @param calibration camera model
+         * @param baseline stereo baseline in cm
+         * @param left_mask_pix columns on the left not seen by the right camera
+         * @param fx_scale scale applied to the frame before stereo matching
+         * @param min_disparity matcher minimum disparity in pixels
+         * @param num_disparities matcher disparity range in pixels
+         * @param format output depth format
+         */
+        DepthStage(VisArena& arena, const Calibration& calibration,
+                   F32 baseline, U32 left_mask_pix, F32 fx_scale,
+                   I32 min_disparity, I32 num_disparities,
+                   const Vis_DepthFormat& format);
 
         void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "DEPTH"; }
 
     private:
-        F32 m_fx;    // x focal length in pixels
-        F32 m_b;     // baseline in world coord units (cm)
+        template<typename T>
+        void project(const cv::Mat& disparity, cv::Mat& depth, const T* lut);
+
+        VisArena& m_arena;
+        Vis_DepthFormat m_format;
 
         I32 m_left_mask_pix; // number of pixels to mask out
+
+        // Indexed by the fixed point disparity offset by m_lut_min
+        // Out of range and non-positive disparities have no depth
+        I32 m_lut_min;
+        std::vector<U16> m_lut_mm;
+        std::vector<F32> m_lut_cm;
+    };
+
+    class SparseStage : public VisStage
+    {
+    public:
+        /**
+         * Range a grid of samples instead of the whole frame
+         * Only the samples are matched so the cost scales with their number
+         * The (u, v, depth) samples replace the right frame and are kept in the arena
+         * @param calibration camera model
+         * @param baseline stereo baseline, depth is in the same units
+         * @param fx_scale scale applied to the frame before this stage
+         * @param params matcher configuration
+         * @param rois regions to sample in frame pixels, the whole frame if empty
+         * @param step pixels between samples
+         */
+        SparseStage(VisArena& arena, const Calibration& calibration,
+                    F32 baseline, F32 fx_scale,
+                    const SparseParams& params,
+                    const std::vector<cv::Rect>& rois, U32 step);
+
+        void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "SPARSE"; }
+
+    private:
+        //! Lay the samples out on a new frame size
+        void layout(const cv::Size& size);
+
+        VisArena& m_arena;
+        Vo::StereoMatcher m_matcher;
+
+        F32 m_fx_baseline;                  //!< Depth times disparity
+        std::vector<cv::Rect> m_rois;
+        I32 m_step;
+
+        cv::Size m_size;                    //!< Frame size the samples were laid out for
+        cv::Mat m_points;                   //!< N x 2 CV_16S sample coordinates
+        cv::Mat m_disparity;                //!< N x 1 CV_32F sample disparity
+    };
+
+    class StixelStage : public VisStage
+    {
+    public:
+        /**
+         * Reduce the depth map to the nearest obstacle of each column bin
+         * Must follow the depth stage, the frames are not modified
+         * Ground is modelled as a plane below a level camera. Pixels well
+         * in front of the ground at their row are obstacles and the lowest
+         * run of obstacle rows is the base of the column's stixel.
+         * @param calibration camera model
+         * @param y_scale vertical scale applied to the frame before this stage
+         * @param params obstacle detection configuration
+         */
+        StixelStage(VisArena& arena, const Calibration& calibration,
+                    F32 y_scale, const StixelParams& params);
+
+        void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "STIXEL"; }
+
+    private:
+        //! Build the ground depth of every row
+        void layout(I32 rows);
+
+        template<typename T>
+        void scan(const cv::Mat& depth, F32 to_depth);
+
+        VisArena& m_arena;
+
+        F32 m_fy;
+        F32 m_cy;
+        StixelParams m_params;
+
+        // Rows are scanned bottom to top over all columns at once
+        // so that the inner loop runs over contiguous memory
+        std::vector<F32> m_ground;          //!< Obstacle depth threshold per row
+        std::vector<F32> m_nearest;         //!< Nearest obstacle per column
+        std::vector<U16> m_run;             //!< Current obstacle run per column
+        std::vector<I32> m_base;            //!< Obstacle base row per column, -1 if none
+    };
+
+    class PointCloudStage : public VisStage
+    {
+    public:
+        /**
+         * Reproject the depth map into a voxel downsampled point cloud
+         * Must follow the depth stage, the frames are not modified
+         * Each voxel becomes the centroid of its points. Voxels are
+         * accumulated in a preallocated hash grid in a single pass and
+         * voxels past VIS_CLOUD_POINT_MAX or a full probe run are dropped.
+         * @param calibration camera model
+         * @param x_scale horizontal scale applied to the frame before this stage
+         * @param y_scale vertical scale applied to the frame before this stage
+         * @param transform maps left camera points to the output frame
+         * @param params reprojection and voxel configuration
+         */
+        PointCloudStage(VisArena& arena, const Calibration& calibration,
+                        F32 x_scale, F32 y_scale,
+                        const cv::Matx44f& transform,
+                        const CloudParams& params);
+
+        void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "CLOUD"; }
+
+    private:
+        struct Voxel
+        {
+            I32 key[3];
+            F32 sum[3];
+            U32 n;
+            U32 stamp;          //!< Frame the voxel was last claimed in
+        };
+
+        template<typename T>
+        void accumulate(const cv::Mat& depth, F32 to_depth);
+
+        void insert(F32 x, F32 y, F32 z);
+
+        VisArena& m_arena;
+
+        F32 m_fx, m_fy, m_cx, m_cy;
+        cv::Matx44f m_transform;
+        CloudParams m_params;
+        F32 m_inv_voxel;
+
+        // Buckets are reused between frames and never cleared
+        // A voxel belongs to the current frame if its stamp matches
+        std::vector<Voxel> m_buckets;
+        std::vector<U32> m_used;            //!< Buckets claimed this frame in claim order
+        U32 m_stamp;
+    };
+
+    class TrackStage : public VisStage
+    {
+    public:
+        //! Called with the frames of both eyes, only valid during the call
+        using Track = std::function<void(const cv::Mat& left, const cv::Mat& right)>;
+
+        /**
+         * Hand the frames to visual odometry
+         * Must follow rectification and come before any stage replacing the frames
+         * The frames are not modified
+         * @param track called on the stage's task for every frame
+         */
+        explicit TrackStage(Track track);
+
+        void process(cv::Mat &left, cv::Mat &right) override;
+        const char* name() const override { return "TRACK"; }
+
+    private:
+        Track m_track;
     };
 }
 
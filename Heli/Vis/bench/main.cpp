@@ -0,0 +1,506 @@
+//
+// Created by tumbar on 4/12/23.
+//
+// Runs a Vis stage chain on a single stereo pair outside of the flight
+// topology. Stages and stereo parameters are given on the command line
+// so that matchers and resolutions can be compared on a workstation.
+//
+//   vis_bench --left left.jpg --right right.jpg --calib calib.yml
+//             --stages rectify,stereo,depth --algorithm sgbm -n 500
+//
+
+#include <Heli/Vis/VisPipeline.hpp>
+#include <Heli/Vis/VisStage.hpp>
+#include <Heli/Vis/VisArena.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace Heli;
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    U32 elapsed_us(Clock::time_point start, Clock::time_point end)
+    {
+        return static_cast<U32>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    }
+
+    struct Options
+    {
+        std::string left;
+        std::string right;
+        std::string calib;
+        std::string stages = "rectify,stereo,depth";
+        std::string algorithm = "bm";
+        std::string depth = "mm";
+        U32 iterations = 200;
+        U32 warmup = 10;
+        F32 scale = 1.0;
+        I32 colormap = Vis_ColorMap::JET;
+
+        // Vis.fpp parameter defaults
+        StereoParams stereo = {
+                29,     // pre_filter_cap
+                5,      // block_size
+                -25,    // min_disparity
+                16,     // num_disparities
+                10,     // uniqueness_ratio
+                100,    // speckle_window_size
+                15,     // speckle_range
+                100,    // bm_texture_threshold
+                4,      // census_p1
+                20,     // census_p2
+                4,      // bands
+                0,      // seed_margin
+                6.0,    // seed_motion
+                0,      // pyramid_levels
+                2,      // pyramid_radius
+        };
+
+        U32 left_mask_pix = 96;
+        U32 sparse_step = 16;
+        F32 camera_height = 0;
+    };
+
+    void usage(const char* argv0)
+    {
+        fprintf(stderr,
+                "usage: %s --left IMAGE --right IMAGE [options]\n"
+                "\n"
+                "  --calib FILE             OpenCV YAML with width, height, K1, D1, K2, D2, baseline (cm)\n"
+                "  --stages LIST            comma separated: rectify, rectify_scale, scale, stereo, depth, colormap,\n"
+                "                           sparse, stixel, cloud (default rectify,stereo,depth)\n"
+                "  -n N                     frames to run (default 200)\n"
+                "  --warmup N               frames run before measuring (default 10)\n"
+                "  --scale F                scale of rectify_scale and scale stages (default 1)\n"
+                "  --algorithm NAME         bm, sgbm, census, census_sgm (default bm)\n"
+                "  --depth FORMAT           mm or cm (default mm)\n"
+                "  --colormap N             OpenCV colormap id (default JET)\n"
+                "  --block-size N\n"
+                "  --min-disparity N\n"
+                "  --num-disparities N\n"
+                "  --uniqueness N\n"
+                "  --speckle-window N\n"
+                "  --speckle-range N\n"
+                "  --bands N\n"
+                "  --seed-margin N\n"
+                "  --pyramid-levels N\n"
+                "  --pyramid-radius N\n"
+                "  --census-p1 N\n"
+                "  --census-p2 N\n"
+                "  --sparse-step N          pixels between sparse samples (default 16)\n"
+                "  --camera-height F        stixel ground plane distance (cm), 0 disables the ground model\n",
+                argv0);
+    }
+
+    Options parse(I32 argc, char** argv)
+    {
+        Options opts;
+        for (I32 i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+
+            const char* value = argv[++i];
+            if (arg == "--left") opts.left = value;
+            else if (arg == "--right") opts.right = value;
+            else if (arg == "--calib") opts.calib = value;
+            else if (arg == "--stages") opts.stages = value;
+            else if (arg == "--algorithm") opts.algorithm = value;
+            else if (arg == "--depth") opts.depth = value;
+            else if (arg == "-n") opts.iterations = std::strtoul(value, nullptr, 0);
+            else if (arg == "--warmup") opts.warmup = std::strtoul(value, nullptr, 0);
+            else if (arg == "--scale") opts.scale = std::strtof(value, nullptr);
+            else if (arg == "--colormap") opts.colormap = std::atoi(value);
+            else if (arg == "--block-size") opts.stereo.block_size = std::atoi(value);
+            else if (arg == "--min-disparity") opts.stereo.min_disparity = std::atoi(value);
+            else if (arg == "--num-disparities") opts.stereo.num_disparities = std::atoi(value);
+            else if (arg == "--uniqueness") opts.stereo.uniqueness_ratio = std::atoi(value);
+            else if (arg == "--speckle-window") opts.stereo.speckle_window_size = std::atoi(value);
+            else if (arg == "--speckle-range") opts.stereo.speckle_range = std::atoi(value);
+            else if (arg == "--bands") opts.stereo.bands = std::strtoul(value, nullptr, 0);
+            else if (arg == "--seed-margin") opts.stereo.seed_margin = std::atoi(value);
+            else if (arg == "--pyramid-levels") opts.stereo.pyramid_levels = std::strtoul(value, nullptr, 0);
+            else if (arg == "--pyramid-radius") opts.stereo.pyramid_radius = std::atoi(value);
+            else if (arg == "--camera-height") opts.camera_height = std::strtof(value, nullptr);
+            else if (arg == "--sparse-step") opts.sparse_step = std::strtoul(value, nullptr, 0);
+            else if (arg == "--census-p1") opts.stereo.census_p1 = std::atoi(value);
+            else if (arg == "--census-p2") opts.stereo.census_p2 = std::atoi(value);
+            else throw std::invalid_argument("unknown option " + arg);
+        }
+
+        if (opts.left.empty() || opts.right.empty())
+        {
+            throw std::invalid_argument("--left and --right are required");
+        }
+
+        if (opts.iterations == 0)
+        {
+            throw std::invalid_argument("-n must be at least 1");
+        }
+
+        return opts;
+    }
+
+    Vis_StereoAlgorithm algorithm(const std::string& name)
+    {
+        if (name == "bm") return Vis_StereoAlgorithm::BLOCK_MATCHING;
+        if (name == "sgbm") return Vis_StereoAlgorithm::SEMI_GLOBAL_BLOCK_MATCHING;
+        if (name == "census") return Vis_StereoAlgorithm::CENSUS;
+        if (name == "census_sgm") return Vis_StereoAlgorithm::CENSUS_SGM;
+        throw std::invalid_argument("unknown stereo algorithm " + name);
+    }
+
+    /**
+     * Load the stereo camera model
+     * Without a model file the frames are assumed to be rectified already
+     * @param path OpenCV YAML file, may be empty
+     * @param size input frame size
+     * @param baseline stereo baseline in cm
+     */
+    Calibration load_calibration(const std::string& path, const cv::Size& size, F32& baseline)
+    {
+        Calibration calib;
+        calib.size = size;
+        baseline = 0;
+
+        if (path.empty())
+        {
+            return calib;
+        }
+
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened())
+        {
+            throw std::runtime_error("failed to open calibration " + path);
+        }
+
+        I32 width, height;
+        fs["width"] >> width;
+        fs["height"] >> height;
+        fs["K1"] >> calib.left.k;
+        fs["D1"] >> calib.left.d;
+        fs["K2"] >> calib.right.k;
+        fs["D2"] >> calib.right.d;
+        fs["baseline"] >> baseline;
+
+        calib.size = cv::Size(width, height);
+        if (calib.size != size)
+        {
+            throw std::runtime_error("calibration size does not match the images");
+        }
+
+        return calib;
+    }
+
+    /**
+     * Records the processing time of every frame of a stage
+     * Timed stages are always JOINT so both eyes land in the same sample
+     */
+    class TimedStage : public VisStage
+    {
+    public:
+        TimedStage(VisStage* stage, U32 frames)
+                : m_stage(stage)
+        {
+            m_samples.reserve(frames);
+        }
+
+        void process(cv::Mat& left, cv::Mat& right) override
+        {
+            auto start = Clock::now();
+            m_stage->process(left, right);
+            m_samples.push_back(elapsed_us(start, Clock::now()));
+        }
+
+        const char* name() const override
+        {
+            return m_stage->name();
+        }
+
+        std::vector<U32>& samples()
+        {
+            return m_samples;
+        }
+
+    private:
+        std::unique_ptr<VisStage> m_stage;
+        std::vector<U32> m_samples;
+    };
+
+    void report(const char* name, std::vector<U32>& samples)
+    {
+        if (samples.empty())
+        {
+            return;
+        }
+
+        std::sort(samples.begin(), samples.end());
+
+        U64 sum = 0;
+        for (U32 s : samples) sum += s;
+
+        auto percentile = [&](U32 p) {
+            return samples[std::min<size_t>(samples.size() - 1, samples.size() * p / 100)];
+        };
+
+        printf("  %-10s %8lu %8u %8u %8u %8u\n",
+               name,
+               static_cast<unsigned long>(sum / samples.size()),
+               percentile(50), percentile(95), percentile(99),
+               samples.back());
+    }
+}
+
+I32 main(I32 argc, char** argv)
+{
+    Options opts;
+    try
+    {
+        opts = parse(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "%s\n\n", e.what());
+        usage(argv[0]);
+        return 1;
+    }
+
+    cv::Mat left = cv::imread(opts.left, cv::IMREAD_GRAYSCALE);
+    cv::Mat right = cv::imread(opts.right, cv::IMREAD_GRAYSCALE);
+    if (left.empty() || right.empty() || left.size() != right.size())
+    {
+        fprintf(stderr, "failed to load a stereo pair of identical size\n");
+        return 1;
+    }
+
+    VisArena arena;
+    std::vector<std::unique_ptr<VisStage>> stages;
+    std::vector<TimedStage*> timed;
+
+    try
+    {
+        F32 baseline;
+        Calibration calib = load_calibration(opts.calib, left.size(), baseline);
+        F32 fx_scale = 1.0;
+        F32 fy_scale = 1.0;
+        bool disparity = false;
+        bool depth = false;
+
+        std::stringstream list(opts.stages);
+        std::string name;
+        while (std::getline(list, name, ','))
+        {
+            VisStage* stage;
+            if (name == "rectify" || name == "rectify_scale")
+            {
+                if (opts.calib.empty())
+                {
+                    throw std::invalid_argument(name + " needs --calib");
+                }
+
+                F32 scale = name == "rectify" ? 1.0f : opts.scale;
+                stage = new RectifyStage(arena, calib, scale, scale);
+                fx_scale *= scale;
+                fy_scale *= scale;
+                disparity = false;
+                depth = false;
+            }
+            else if (name == "scale")
+            {
+                stage = new ScaleStage(arena, opts.scale, opts.scale, Vis_Interpolation::LINEAR);
+                fx_scale *= opts.scale;
+                fy_scale *= opts.scale;
+                disparity = false;
+                depth = false;
+            }
+            else if (name == "stereo")
+            {
+                stage = new StereoStage(arena, opts.stereo, algorithm(opts.algorithm));
+                disparity = true;
+                depth = false;
+            }
+            else if (name == "depth")
+            {
+                if (opts.calib.empty())
+                {
+                    throw std::invalid_argument("depth needs --calib");
+                }
+
+                if (!disparity)
+                {
+                    throw std::invalid_argument("depth must follow stereo at the same scale");
+                }
+
+                Vis_DepthFormat format = opts.depth == "cm" ?
+                                         Vis_DepthFormat::CENTIMETER_F32 : Vis_DepthFormat::MILLIMETER;
+                stage = new DepthStage(arena, calib, baseline, opts.left_mask_pix, fx_scale,
+                                       opts.stereo.min_disparity, opts.stereo.num_disparities,
+                                       format);
+                depth = true;
+            }
+            else if (name == "sparse")
+            {
+                if (opts.calib.empty())
+                {
+                    throw std::invalid_argument("sparse needs --calib");
+                }
+
+                SparseParams sparse = {
+                        11,     // window_size
+                        200,    // texture_threshold
+                        static_cast<U8>(opts.stereo.uniqueness_ratio),
+                        opts.stereo.min_disparity,
+                        opts.stereo.num_disparities,
+                };
+
+                stage = new SparseStage(arena, calib, baseline, fx_scale, sparse, {}, opts.sparse_step);
+                disparity = false;
+                depth = false;
+            }
+            else if (name == "stixel")
+            {
+                if (opts.calib.empty())
+                {
+                    throw std::invalid_argument("stixel needs --calib");
+                }
+
+                if (!depth)
+                {
+                    throw std::invalid_argument("stixel must follow depth");
+                }
+
+                StixelParams stixel = {opts.camera_height, 0.15f, 4};
+                stage = new StixelStage(arena, calib, fy_scale, stixel);
+            }
+            else if (name == "cloud")
+            {
+                if (opts.calib.empty())
+                {
+                    throw std::invalid_argument("cloud needs --calib");
+                }
+
+                if (!depth)
+                {
+                    throw std::invalid_argument("cloud must follow depth");
+                }
+
+                // Points stay in the left camera frame
+                CloudParams cloud = {10.0f, 1000.0f, 2};
+                stage = new PointCloudStage(arena, calib, fx_scale, fy_scale,
+                                            cv::Matx44f::eye(), cloud);
+            }
+            else if (name == "colormap")
+            {
+                stage = new ColormapStage(arena,
+                                          static_cast<Vis_ColorMap::T>(opts.colormap),
+                                          CamSelect::BOTH);
+                disparity = false;
+                depth = false;
+            }
+            else
+            {
+                throw std::invalid_argument("unknown stage " + name);
+            }
+
+            auto* t = new TimedStage(stage, opts.iterations + opts.warmup);
+            timed.push_back(t);
+            stages.emplace_back(t);
+        }
+
+        arena.reserve(calib.size, CV_8U);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    // Frame ids index the per-frame timestamps
+    U32 total = opts.warmup + opts.iterations;
+    std::vector<Clock::time_point> started(total);
+    std::vector<U32> latency(total);
+
+    VisPipeline pipeline([&](VisFrame& frame) {
+        latency[frame.id] = elapsed_us(started[frame.id], Clock::now());
+    });
+
+    // Stages work in place so every frame starts from a fresh copy
+    cv::Mat inputs[VisArena::SLOT_N][2];
+
+    pipeline.start(stages);
+
+    Clock::time_point start;
+    for (U32 i = 0; i < total; i++)
+    {
+        if (i == opts.warmup)
+        {
+            // Drop the warm up samples
+            pipeline.stop();
+            for (auto* t : timed) t->samples().clear();
+
+            U32 allocations = VisArena::allocations();
+            printf("Warm up: %u frames, %u allocations\n", opts.warmup, allocations);
+
+            pipeline.start(stages);
+            start = Clock::now();
+        }
+
+        VisFrame& frame = pipeline.acquire(i);
+        left.copyTo(inputs[frame.slot][0]);
+        right.copyTo(inputs[frame.slot][1]);
+        frame.left = inputs[frame.slot][0];
+        frame.right = inputs[frame.slot][1];
+
+        started[i] = Clock::now();
+        pipeline.push(frame);
+    }
+
+    if (opts.warmup == 0)
+    {
+        // Nothing was warmed up, the first frame starts the clock
+        start = started[0];
+    }
+
+    U32 allocations = VisArena::allocations();
+    pipeline.stop();
+    F64 seconds = std::chrono::duration<F64>(Clock::now() - start).count();
+
+    rusage ru = {};
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("\n%ux%u, %s, %u frames\n", left.cols, left.rows, opts.stages.c_str(), opts.iterations);
+    printf("  %-10s %8s %8s %8s %8s %8s\n", "stage", "mean", "p50", "p95", "p99", "max");
+    for (auto* t : timed)
+    {
+        report(t->name(), t->samples());
+    }
+
+    std::vector<U32> frame_latency(latency.begin() + opts.warmup, latency.end());
+    report("frame", frame_latency);
+
+    printf("\nThroughput: %.1f fps (%u frames in flight)\n",
+           opts.iterations / seconds, static_cast<U32>(VisArena::SLOT_N));
+    printf("Allocations: %u\n", VisArena::allocations() - allocations);
+    printf("Peak RSS: %.1f MiB\n", ru.ru_maxrss / 1024.0);
+
+    return 0;
+}
@@ -0,0 +1,333 @@
+//
+// Created by tumbar on 4/15/23.
+//
+// Measures the fork/join round trip of libparallel. A batch of empty
+// tasks is forked onto the pool and joined, the time per batch is the
+// scheduling overhead every stage pays per frame. The same batch is
+// also handed to dedicated threads through a mutex and condition
+// variable queue for comparison.
+//
+// The caller is pinned outside the vision cores the workers run on so
+// every handoff crosses cores. With a single core the waiting caller
+// runs most tasks itself, the share it ran is reported with the times.
+//
+//   parallel_bench --tasks 2 -n 100000
+//
+
+#include <Heli/parallel/parallel.hpp>
+#include <Heli/parallel/policy.hpp>
+
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        U32 iterations = 100000;
+        U32 warmup = 1000;
+        U32 tasks = 2;
+        U32 workers = 0;
+        I32 cpu = -1;
+    };
+
+    void usage(const char* argv0)
+    {
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "\n"
+                "  -n N                     round trips to run (default 100000)\n"
+                "  --warmup N               round trips run before measuring (default 1000)\n"
+                "  --tasks N                tasks forked per round trip (default 2)\n"
+                "  --workers N              pool workers, 0 for one per vision core (default 0)\n"
+                "  --cpu N                  core the caller is pinned to (default first non-vision core)\n",
+                argv0);
+    }
+
+    Options parse(I32 argc, char** argv)
+    {
+        Options opts;
+        for (I32 i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+
+            const char* value = argv[++i];
+            if (arg == "-n") opts.iterations = std::strtoul(value, nullptr, 0);
+            else if (arg == "--warmup") opts.warmup = std::strtoul(value, nullptr, 0);
+            else if (arg == "--tasks") opts.tasks = std::strtoul(value, nullptr, 0);
+            else if (arg == "--workers") opts.workers = std::strtoul(value, nullptr, 0);
+            else if (arg == "--cpu") opts.cpu = std::strtol(value, nullptr, 0);
+            else throw std::invalid_argument("unknown option " + arg);
+        }
+
+        if (opts.iterations == 0 || opts.tasks == 0)
+        {
+            throw std::invalid_argument("-n and --tasks must be at least 1");
+        }
+
+        return opts;
+    }
+
+    /**
+     * Pin the caller to a core the workers do not run on
+     * @param cpu requested core, -1 picks the first available non-vision core
+     * @return core the caller is pinned to, -1 if it could not be pinned
+     */
+    I32 pin_caller(I32 cpu)
+    {
+        cpu_set_t available;
+        CPU_ZERO(&available);
+        if (sched_getaffinity(0, sizeof(available), &available) != 0)
+        {
+            return -1;
+        }
+
+        if (cpu < 0)
+        {
+            U32 vision = libparallel::ThreadPolicy::cpus(libparallel::ThreadPolicy::VISION);
+            for (I32 i = 0; i < 32 && cpu < 0; i++)
+            {
+                if (CPU_ISSET(i, &available) && !(vision & (1U << i)))
+                {
+                    cpu = i;
+                }
+            }
+        }
+
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &available))
+        {
+            return -1;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0 ? cpu : -1;
+    }
+
+    //! Counts the tasks of a round trip and the ones run by the caller
+    struct Counter
+    {
+        std::atomic<U32> tasks;
+        std::atomic<U32> caller;
+        std::thread::id caller_id;
+
+        Counter() : tasks(0), caller(0), caller_id(std::this_thread::get_id()) {}
+
+        void run()
+        {
+            tasks++;
+            if (std::this_thread::get_id() == caller_id)
+            {
+                caller++;
+            }
+        }
+
+        //! Percentage of the tasks run on the caller since the last call
+        U32 take_caller_share()
+        {
+            U32 t = tasks.exchange(0);
+            U32 c = caller.exchange(0);
+            return t > 0 ? static_cast<U32>(100ULL * c / t) : 0;
+        }
+    };
+
+    /**
+     * Dedicated threads fed through a locked queue,
+     * each job is a heap allocated std::function
+     */
+    class LockedThreads
+    {
+    public:
+        explicit LockedThreads(U32 n) : m_pending(0)
+        {
+            for (U32 i = 0; i < n; i++)
+            {
+                m_queues.push_back(std::make_unique<libparallel::Queue<std::function<void()>>>());
+            }
+
+            for (U32 i = 0; i < n; i++)
+            {
+                m_threads.emplace_back([this, i]() {
+                    // Same cores as the pool workers
+                    libparallel::ThreadPolicy::get().apply(libparallel::ThreadPolicy::VISION, "bench");
+
+                    try
+                    {
+                        while (true)
+                        {
+                            m_queues[i]->pop()();
+
+                            std::unique_lock<std::mutex> lock(m_mutex);
+                            if (--m_pending == 0)
+                            {
+                                m_done.notify_all();
+                            }
+                        }
+                    }
+                    catch (libparallel::QuitException&)
+                    {
+                    }
+                });
+            }
+        }
+
+        ~LockedThreads()
+        {
+            for (auto& queue : m_queues) queue->quit();
+            for (auto& thread : m_threads) thread.join();
+        }
+
+        void fork_join(U32 tasks, Counter& counter)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_pending = tasks;
+            }
+
+            for (U32 t = 0; t < tasks; t++)
+            {
+                m_queues[t % m_queues.size()]->push([&counter]() { counter.run(); });
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_pending > 0)
+            {
+                m_done.wait(lock);
+            }
+        }
+
+    private:
+        std::vector<std::unique_ptr<libparallel::Queue<std::function<void()>>>> m_queues;
+        std::vector<std::thread> m_threads;
+
+        std::mutex m_mutex;
+        std::condition_variable m_done;
+        U32 m_pending;
+    };
+
+    //! Time every round trip in nanoseconds
+    template<typename F>
+    std::vector<U32> measure(const Options& opts, F&& round_trip)
+    {
+        for (U32 i = 0; i < opts.warmup; i++)
+        {
+            round_trip();
+        }
+
+        std::vector<U32> samples(opts.iterations);
+        for (U32 i = 0; i < opts.iterations; i++)
+        {
+            auto start = Clock::now();
+            round_trip();
+            auto end = Clock::now();
+            samples[i] = static_cast<U32>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        }
+
+        return samples;
+    }
+
+    void report(const char* name, std::vector<U32> samples, U32 caller_share)
+    {
+        std::sort(samples.begin(), samples.end());
+
+        U64 total = 0;
+        for (U32 s : samples) total += s;
+
+        auto percentile = [&](U32 p) {
+            return samples[std::min<size_t>(samples.size() - 1, samples.size() * p / 100)];
+        };
+
+        printf("  %-10s %8lu %8u %8u %8u %8u %7u%%\n",
+               name, static_cast<unsigned long>(total / samples.size()),
+               percentile(50), percentile(95), percentile(99),
+               samples.back(), caller_share);
+    }
+}
+
+I32 main(I32 argc, char** argv)
+{
+    Options opts;
+    try
+    {
+        opts = parse(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "%s\n\n", e.what());
+        usage(argv[0]);
+        return 1;
+    }
+
+    I32 cpu = pin_caller(opts.cpu);
+    U32 cores = std::max(1U, std::thread::hardware_concurrency());
+    if (cpu < 0 || cores < 2)
+    {
+        fprintf(stderr,
+                "warning: caller is not pinned apart from the workers (%u cores online),\n"
+                "         tasks the caller ran inline are included in the times\n",
+                cores);
+    }
+
+    libparallel::Pool pool(opts.workers);
+    Counter counter;
+
+    // Every task goes to the pool, the caller only joins
+    auto pooled = measure(opts, [&]() {
+        libparallel::TaskGroup group(pool);
+        for (U32 t = 0; t < opts.tasks; t++)
+        {
+            group.run([&counter]() { counter.run(); });
+        }
+        group.wait();
+    });
+    U32 pooled_share = counter.take_caller_share();
+
+    // The first task runs on the caller like the stages do
+    auto forked = measure(opts, [&]() {
+        libparallel::TaskGroup group(pool);
+        for (U32 t = 1; t < opts.tasks; t++)
+        {
+            group.run([&counter]() { counter.run(); });
+        }
+        counter.run();
+        group.wait();
+    });
+    U32 forked_share = counter.take_caller_share();
+
+    std::vector<U32> locked;
+    {
+        LockedThreads threads(pool.size());
+        locked = measure(opts, [&]() { threads.fork_join(opts.tasks, counter); });
+    }
+    U32 locked_share = counter.take_caller_share();
+
+    printf("%u tasks per round trip, %u workers on cpus 0x%x, caller on cpu %d, %u round trips (ns)\n",
+           opts.tasks, pool.size(), libparallel::ThreadPolicy::cpus(libparallel::ThreadPolicy::VISION),
+           cpu, opts.iterations);
+    printf("  %-10s %8s %8s %8s %8s %8s %8s\n", "handoff", "mean", "p50", "p95", "p99", "max", "caller");
+    report("pool", pooled, pooled_share);
+    report("fork", forked, forked_share);
+    report("locked", locked, locked_share);
+
+    return 0;
+}
@@ -3,3 +3,366 @@
 //
 
 #include "parallel.hpp"
+#include "policy.hpp"
+
+#include <climits>
+#include <cstdio>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace libparallel
+{
+    // Lets a worker find its own deque
+    static thread_local Pool* s_pool = nullptr;
+    static thread_local U32 s_index = 0;
+
+    void wait(std::atomic<U32>& word, U32 expected)
+    {
+        // std::atomic<U32> has the layout of a U32
+        syscall(SYS_futex, reinterpret_cast<U32*>(&word),
+                FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+    }
+
+    void wake(std::atomic<U32>& word, I32 n)
+    {
+        syscall(SYS_futex, reinterpret_cast<U32*>(&word),
+                FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+    }
+
+    Token Awaitable::await()
+    {
+        U32 state = m_ready.load(std::memory_order_acquire);
+        for (U32 i = 0; state != READY && i < PARALLEL_SPIN_N; i++)
+        {
+            state = m_ready.load(std::memory_order_acquire);
+        }
+
+        while (state != READY)
+        {
+            // Tell the signaller a wake up is needed
+            if (state == IDLE)
+            {
+                m_ready.compare_exchange_strong(state, SLEEPING, std::memory_order_acquire);
+                continue;
+            }
+
+            wait(m_ready, SLEEPING);
+            state = m_ready.load(std::memory_order_acquire);
+        }
+
+        Token tok = m_token;
+        reset();
+        return tok;
+    }
+
+    void Awaitable::signal(Token tok)
+    {
+        m_token = tok;
+        if (m_ready.exchange(READY, std::memory_order_acq_rel) == SLEEPING)
+        {
+            wake(m_ready, INT_MAX);
+        }
+    }
+
+    bool Pool::Deque::push(const Task& task)
+    {
+        I64 b = m_bottom.load(std::memory_order_relaxed);
+        I64 t = m_top.load(std::memory_order_acquire);
+        if (b - t >= PARALLEL_DEQUE_N)
+        {
+            return false;
+        }
+
+        m_tasks[b & (PARALLEL_DEQUE_N - 1)] = task;
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool Pool::Deque::pop(Task& task)
+    {
+        I64 b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        I64 t = m_top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            // Empty
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        task = m_tasks[b & (PARALLEL_DEQUE_N - 1)];
+        if (t == b)
+        {
+            // Last task, race the thieves for it
+            bool won = m_top.compare_exchange_strong(t, t + 1,
+                                                     std::memory_order_seq_cst,
+                                                     std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+
+        return true;
+    }
+
+    bool Pool::Deque::steal(Task& task)
+    {
+        I64 t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        I64 b = m_bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+        {
+            return false;
+        }
+
+        // The copy is only kept if no other thread took the task meanwhile
+        task = m_tasks[t & (PARALLEL_DEQUE_N - 1)];
+        return m_top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+    }
+
+    Pool::Pool(U32 workers)
+            : m_epoch(0), m_sleeping(0), m_quit(false)
+    {
+        if (workers == 0)
+        {
+            // One worker per vision core present on this machine
+            U32 cores = std::max(1U, std::thread::hardware_concurrency());
+            U32 mask = ThreadPolicy::cpus(ThreadPolicy::VISION);
+            for (U32 cpu = 0; cpu < cores && cpu < 32; cpu++)
+            {
+                workers += (mask >> cpu) & 1;
+            }
+
+            if (workers == 0)
+            {
+                workers = cores;
+            }
+        }
+
+        for (U32 i = 0; i < workers; i++)
+        {
+            m_workers.push_back(std::make_unique<Worker>());
+        }
+
+        // Workers steal from each other so all of them
+        // must exist before the first one starts
+        for (U32 i = 0; i < workers; i++)
+        {
+            m_workers[i]->thread = std::thread(&Pool::run, this, i);
+        }
+    }
+
+    Pool::~Pool()
+    {
+        m_quit = true;
+        m_epoch++;
+        wake(m_epoch, INT_MAX);
+
+        for (auto& worker : m_workers)
+        {
+            worker->thread.join();
+        }
+    }
+
+    Pool& Pool::get()
+    {
+        static Pool pool(PARALLEL_WORKER_N);
+        return pool;
+    }
+
+    U32 Pool::size() const
+    {
+        return m_workers.size();
+    }
+
+    void Pool::submit(const Task& task)
+    {
+        // Workers keep their own tasks, outside and detached tasks are shared
+        bool queued;
+        if (!task.group())
+        {
+            queued = m_detached.push(task);
+        }
+        else if (s_pool == this)
+        {
+            queued = m_workers[s_index]->tasks.push(task);
+        }
+        else
+        {
+            queued = m_inject.push(task);
+        }
+
+        if (!queued)
+        {
+            Task inline_task = task;
+            execute(inline_task);
+            return;
+        }
+
+        // Sleepers read the epoch before checking for tasks one last time
+        m_epoch.fetch_add(1);
+        if (m_sleeping.load() > 0)
+        {
+            wake(m_epoch, 1);
+        }
+    }
+
+    bool Pool::help()
+    {
+        Task task;
+        bool found = take(s_pool == this ? s_index : size(), task);
+        if (found)
+        {
+            execute(task);
+        }
+
+        return found;
+    }
+
+    bool Pool::take(U32 index, Task& task)
+    {
+        U32 n = size();
+        if (index < n && m_workers[index]->tasks.pop(task))
+        {
+            return true;
+        }
+
+        if (m_inject.pop(task))
+        {
+            return true;
+        }
+
+        for (U32 i = 1; i <= n; i++)
+        {
+            U32 victim = (index + i) % n;
+            if (victim != index && m_workers[victim]->tasks.steal(task))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Pool::execute(Task& task)
+    {
+        task();
+        if (task.group())
+        {
+            task.group()->done();
+        }
+    }
+
+    void Pool::run(U32 index)
+    {
+        s_pool = this;
+        s_index = index;
+
+        char name[16];
+        snprintf(name, sizeof(name), "pool%u", index);
+        ThreadPolicy::get().apply(ThreadPolicy::VISION, name);
+
+        U32 idle = 0;
+        while (true)
+        {
+            // Grouped tasks first, someone may be waiting on them
+            Task task;
+            if (take(index, task) || m_detached.pop(task))
+            {
+                execute(task);
+                idle = 0;
+                continue;
+            }
+
+            if (++idle < PARALLEL_SPIN_N)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            m_sleeping.fetch_add(1);
+            U32 epoch = m_epoch.load();
+
+            // A task submitted before the epoch was read is seen here
+            bool found = take(index, task) || m_detached.pop(task);
+            if (!found && !m_quit)
+            {
+                wait(m_epoch, epoch);
+            }
+
+            m_sleeping.fetch_sub(1);
+
+            if (found)
+            {
+                execute(task);
+                idle = 0;
+            }
+            else if (m_quit)
+            {
+                break;
+            }
+        }
+    }
+
+    TaskGroup::TaskGroup(Pool& pool)
+            : m_pool(pool), m_pending(0)
+    {
+    }
+
+    TaskGroup::~TaskGroup()
+    {
+        wait();
+    }
+
+    void TaskGroup::wait()
+    {
+        U32 idle = 0;
+        while (true)
+        {
+            U32 pending = m_pending.load(std::memory_order_acquire);
+            if ((pending & ~WAITING) == 0)
+            {
+                break;
+            }
+
+            if (m_pool.help())
+            {
+                idle = 0;
+                continue;
+            }
+
+            if (++idle < PARALLEL_SPIN_N)
+            {
+                continue;
+            }
+
+            // Every task of the group was taken by another thread
+            pending = m_pending.fetch_or(WAITING, std::memory_order_acq_rel) | WAITING;
+            if ((pending & ~WAITING) != 0)
+            {
+                libparallel::wait(m_pending, pending);
+            }
+        }
+
+        m_pending.store(0, std::memory_order_relaxed);
+    }
+
+    void TaskGroup::done()
+    {
+        // The group may be gone as soon as the count drops,
+        // only the futex word address is used after this
+        U32 pending = m_pending.fetch_sub(1, std::memory_order_acq_rel);
+        FW_ASSERT((pending & ~WAITING) > 0, pending);
+        if (pending == (WAITING | 1))
+        {
+            wake(m_pending, INT_MAX);
+        }
+    }
+}
@@ -5,18 +5,23 @@
 #ifndef STEREO_HELI_PARALLEL_HPP
 #define STEREO_HELI_PARALLEL_HPP
 
+#include <ParallelCfg.hpp>
 #include <Fw/Types/BasicTypes.hpp>
+#include <Fw/Types/Assert.hpp>
 
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 
+#include <algorithm>
+#include <cstddef>
+#include <new>
 #include <type_traits>
 
-#include <iostream>
-#include <functional>
 #include <memory>
 #include <thread>
 #include <queue>
+#include <vector>
 
 namespace libparallel
 {
@@ -26,52 +31,55 @@ namespace libparallel
     {
     };
 
+    /**
+     * Sleep until a word no longer holds a value
+     * May return spuriously, callers check the word again
+     */
+    void wait(std::atomic<U32>& word, U32 expected);
+
+    //! Wake up to n threads sleeping on a word
+    void wake(std::atomic<U32>& word, I32 n);
+
+    /**
+     * Single completion passed from one thread to another
+     * Completion is a store to an atomic, the waiter only sleeps
+     * in the kernel once spinning did not see it.
+     */
     class Awaitable
     {
     public:
-        Awaitable() : ready(false), token(0)
+        Awaitable() : m_ready(IDLE), m_token(0)
         {}
 
         Awaitable(const Awaitable& a)
-                : ready(a.ready), token(a.token)
+                : m_ready(a.m_ready.load()), m_token(a.m_token)
         {
         }
 
         void reset()
         {
-            ready = false;
-            token = 0;
+            m_ready.store(IDLE, std::memory_order_relaxed);
+            m_token = 0;
         }
 
-        Token await()
-        {
-            std::unique_lock<std::mutex> lock(mutex);
-            while (!ready)
-            {
-                cv.wait(lock);
-            }
-
-            Token tok = token;
-            reset();
-            return tok;
-        }
-
-        void signal(Token tok)
-        {
-            std::unique_lock<std::mutex> lock(mutex);
-            ready = true;
-            token = tok;
-            cv.notify_all();
-        }
+        Token await();
+        void signal(Token tok);
 
     PRIVATE:
-        bool ready;
-        Token token;
+        enum
+        {
+            IDLE,
+            SLEEPING,   //!< The waiter sleeps and needs to be woken up
+            READY,
+        };
 
-        std::mutex mutex;
-        std::condition_variable cv;
+        std::atomic<U32> m_ready;
+        Token m_token;
     };
 
+    /**
+     * Unbounded blocking queue, first in first out
+     */
     template<typename T>
     class Queue
     {
@@ -81,7 +89,7 @@ namespace libparallel
         {
             std::unique_lock<std::mutex> lock(mutex);
             queue.push(t);
-            condition.notify_all();
+            condition.notify_one();
         }
 
         T pop()
@@ -89,14 +97,15 @@ namespace libparallel
             std::unique_lock<std::mutex> lock(mutex);
             while (queue.empty())
             {
-                condition.wait(lock);
                 if (quiting)
                 {
                     throw QuitException();
                 }
+
+                condition.wait(lock);
             }
 
-            T r = queue.back();
+            T r = queue.front();
             queue.pop();
             return r;
         }
@@ -121,6 +130,7 @@ namespace libparallel
 
         void quit()
         {
+            std::unique_lock<std::mutex> lock(mutex);
             quiting = true;
             condition.notify_all();
         }
@@ -133,83 +143,314 @@ namespace libparallel
         std::queue<T> queue;
     };
 
-    template<typename A>
-    class ParallelThread
+    /**
+     * Bounded lock-free queue, any number of producers and consumers
+     * Each cell carries a sequence number telling whether it is ready
+     * to be written or read for the current lap of the ring.
+     */
+    template<typename T, U32 N>
+    class Ring
     {
+        static_assert((N & (N - 1)) == 0, "Ring size must be a power of two");
+
     public:
-        ParallelThread()
-                : m_thread([=]() {
-            while(true)
+        Ring() : m_head(0), m_tail(0)
+        {
+            for (U32 i = 0; i < N; i++)
+            {
+                m_cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        //! @return false if the ring is full
+        bool push(const T& t)
+        {
+            U32 pos = m_tail.load(std::memory_order_relaxed);
+            while (true)
             {
-                try
+                Cell& cell = m_cells[pos & (N - 1)];
+                U32 seq = cell.sequence.load(std::memory_order_acquire);
+                I32 diff = static_cast<I32>(seq - pos);
+                if (diff == 0)
                 {
-                    auto p = m_queue.pop();
-                    (*function)(p.second);
-                    awaiter.signal(p.first);
+                    if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        cell.value = t;
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
                 }
-                catch(QuitException&)
+                else if (diff < 0)
                 {
-                    break;
+                    return false;
                 }
-                catch(std::exception& e)
+                else
                 {
-                    std::cerr << "Exception occurred in parallel thread" << e.what() << std::endl;
-                    break;
+                    pos = m_tail.load(std::memory_order_relaxed);
                 }
             }
-        })
-        {
         }
 
-        void set(std::function<void(A)> f)
+        //! @return false if the ring is empty
+        bool pop(T& t)
         {
-            function = std::make_unique<std::function<void(A)>>(f);
+            U32 pos = m_head.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Cell& cell = m_cells[pos & (N - 1)];
+                U32 seq = cell.sequence.load(std::memory_order_acquire);
+                I32 diff = static_cast<I32>(seq - (pos + 1));
+                if (diff == 0)
+                {
+                    if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        t = cell.value;
+                        cell.sequence.store(pos + N, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = m_head.load(std::memory_order_relaxed);
+                }
+            }
         }
 
-        Awaitable& feed(const A& a, Token tok)
+    PRIVATE:
+        struct Cell
         {
-            m_queue.push({tok, a});
-            return awaiter;
+            std::atomic<U32> sequence;
+            T value;
+        };
+
+        // Producers and consumers do not share a cache line
+        alignas(64) std::atomic<U32> m_head;
+        alignas(64) std::atomic<U32> m_tail;
+        Cell m_cells[N];
+    };
+
+    class TaskGroup;
+
+    /**
+     * Callable stored inline without allocating
+     * Captures must be trivially copyable and fit in PARALLEL_TASK_SIZE
+     * bytes, capture large state by reference.
+     */
+    class Task
+    {
+    public:
+        Task() : m_storage(), m_invoke(nullptr), m_group(nullptr)
+        {}
+
+        template<typename F>
+        Task(const F& function, TaskGroup* group)
+                : m_storage(), m_invoke(&invoke<F>), m_group(group)
+        {
+            static_assert(sizeof(F) <= PARALLEL_TASK_SIZE, "Task captures do not fit inline");
+            static_assert(alignof(F) <= alignof(std::max_align_t), "Task captures are over aligned");
+            static_assert(std::is_trivially_copyable<F>::value, "Task captures must be trivially copyable");
+            new (m_storage) F(function);
         }
 
-        ~ParallelThread()
+        void operator()() { m_invoke(m_storage); }
+        TaskGroup* group() const { return m_group; }
+
+    PRIVATE:
+        template<typename F>
+        static void invoke(void* storage)
         {
-            m_queue.quit();
-            m_thread.join();
+            (*static_cast<F*>(storage))();
         }
 
-    private:
-        std::unique_ptr<std::function<void(A)>> function;
-        Awaitable awaiter;
-        Queue<std::pair<Token, A>> m_queue;
-        std::thread m_thread;
+        alignas(std::max_align_t) U8 m_storage[PARALLEL_TASK_SIZE];
+        void (*m_invoke)(void*);
+        TaskGroup* m_group;
     };
 
-    template<U32 n, typename A>
-    class Parallelize
+    /**
+     * Work-stealing thread pool shared by the whole process.
+     *
+     * Every worker owns a bounded lock-free deque of tasks. Workers run
+     * their own tasks newest first and steal the oldest task of another
+     * worker once they run dry. Tasks submitted from outside the pool
+     * go through a shared ring. A task that finds its queue full runs
+     * on the submitting thread.
+     *
+     * Idle workers poll a few times before sleeping on a futex, waking
+     * them is skipped entirely while none sleep.
+     *
+     * Threads waiting on a TaskGroup run pending tasks instead of
+     * blocking so tasks can fork and join nested groups. Tasks without
+     * a group are detached: they go through their own ring and only
+     * workers run them, so a wait never picks up long running work
+     * such as a pipeline stage draining its queue.
+     */
+    class Pool
     {
     public:
-        explicit Parallelize(std::function<void(A)> f)
+        /**
+         * Start the workers
+         * @param workers number of worker threads, 0 for one per hardware thread
+         */
+        explicit Pool(U32 workers);
+        ~Pool();
+
+        //! Pool shared by the process, started on first use with PARALLEL_WORKER_N workers
+        static Pool& get();
+
+        //! Number of worker threads
+        U32 size() const;
+
+        /**
+         * Queue a task
+         * @param function task to run
+         * @param group group notified once the task ran, nullptr to detach the task
+         */
+        template<typename F>
+        void submit(const F& function, TaskGroup* group)
         {
-            for (auto& i : m_threads) i.set(f);
+            submit(Task(function, group));
         }
 
-        template<U32 i, Token tok = 0>
-        Awaitable& feed(A&& args)
+        void submit(const Task& task);
+
+        /**
+         * Run one pending task of any group on the calling thread
+         * Detached tasks are left to the workers
+         * @return false if no task was pending
+         */
+        bool help();
+
+    PRIVATE:
+        /**
+         * Bounded Chase-Lev deque
+         * The owner pushes and pops at the bottom, thieves take from the top.
+         */
+        class Deque
         {
-            static_assert(i < n, "Thread index is out of range");
-            return m_threads[i].feed(args, tok);
-        }
+        public:
+            Deque() : m_top(0), m_bottom(0)
+            {}
+
+            //! Owner only, @return false if the deque is full
+            bool push(const Task& task);
+
+            //! Owner only, newest task
+            bool pop(Task& task);
+
+            //! Any thread, oldest task
+            bool steal(Task& task);
 
-        Awaitable& feed(A&& args, U32 i, Token tok = 0)
+        PRIVATE:
+            alignas(64) std::atomic<I64> m_top;
+            alignas(64) std::atomic<I64> m_bottom;
+            Task m_tasks[PARALLEL_DEQUE_N];
+        };
+
+        struct Worker
         {
-            FW_ASSERT(i < n, i);
-            return m_threads[i].feed(args, tok);
+            Deque tasks;
+            std::thread thread;
+        };
+
+        void run(U32 index);
+
+        /**
+         * Find a task for a thread
+         * @param index worker index of the thread, size() outside the pool
+         */
+        bool take(U32 index, Task& task);
+
+        static void execute(Task& task);
+
+        std::vector<std::unique_ptr<Worker>> m_workers;
+        Ring<Task, PARALLEL_INJECT_N> m_inject;     //!< Tasks submitted from outside the pool
+        Ring<Task, PARALLEL_INJECT_N> m_detached;   //!< Tasks without a group, workers only
+
+        std::atomic<U32> m_epoch;       //!< Bumped by every submit, workers sleep on it
+        std::atomic<U32> m_sleeping;    //!< Workers about to sleep or sleeping
+        std::atomic<bool> m_quit;
+    };
+
+    /**
+     * Tasks that are waited on together
+     */
+    class TaskGroup
+    {
+    public:
+        explicit TaskGroup(Pool& pool = Pool::get());
+
+        //! Groups are always joined
+        ~TaskGroup();
+
+        //! Queue a task on the pool
+        template<typename F>
+        void run(const F& function)
+        {
+            m_pending.fetch_add(1, std::memory_order_relaxed);
+            m_pool.submit(function, this);
         }
 
+        //! Wait for every task of the group, pending tasks run on the caller meanwhile
+        void wait();
+
     PRIVATE:
-        std::array<ParallelThread<A>, n> m_threads;
+        friend class Pool;
+
+        enum
+        {
+            WAITING = 0x80000000U,      //!< A thread sleeps until the count drops to zero
+        };
+
+        void done();
+
+        Pool& m_pool;
+        std::atomic<U32> m_pending;     //!< Tasks not done yet and the WAITING flag
     };
+
+    /**
+     * Split a range over the pool and wait for it
+     * The first chunk runs on the caller
+     * @param begin first index
+     * @param end one past the last index
+     * @param grain smallest number of indices worth a task
+     * @param function called with each chunk as (begin, end)
+     */
+    template<typename F>
+    void parallel_for(I32 begin, I32 end, I32 grain, F&& function)
+    {
+        Pool& pool = Pool::get();
+
+        I32 n = end - begin;
+        if (n <= 0)
+        {
+            return;
+        }
+
+        I32 chunks = std::min<I32>((n + grain - 1) / std::max<I32>(grain, 1),
+                                   static_cast<I32>(pool.size()) + 1);
+        if (chunks <= 1)
+        {
+            function(begin, end);
+            return;
+        }
+
+        auto* f = &function;
+        TaskGroup group(pool);
+        for (I32 c = 1; c < chunks; c++)
+        {
+            I32 b = begin + n * c / chunks;
+            I32 e = begin + n * (c + 1) / chunks;
+            group.run([f, b, e]() { (*f)(b, e); });
+        }
+
+        function(begin, begin + n / chunks);
+        group.wait();
+    }
 }
 
 #endif //STEREO_HELI_PARALLEL_HPP
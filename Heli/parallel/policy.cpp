@@ -0,0 +1,212 @@
+//
+// Created by tumbar on 4/16/23.
+//
+
+#include "policy.hpp"
+#include <Fw/Types/Assert.hpp>
+
+#include <cstdio>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace libparallel
+{
+    static const U32 s_cpus[ThreadPolicy::CLASS_N] = {
+            PARALLEL_CONTROL_CPUS,
+            PARALLEL_CAMERA_CPUS,
+            PARALLEL_VISION_CPUS,
+            PARALLEL_ENCODER_CPUS,
+            PARALLEL_GROUND_CPUS,
+    };
+
+    static const I32 s_priority[ThreadPolicy::CLASS_N] = {
+            PARALLEL_CONTROL_PRIORITY,
+            PARALLEL_CAMERA_PRIORITY,
+            PARALLEL_VISION_PRIORITY,
+            PARALLEL_ENCODER_PRIORITY,
+            PARALLEL_GROUND_PRIORITY,
+    };
+
+    ThreadPolicy::ThreadPolicy()
+            : m_threads(), m_generation(0)
+    {
+    }
+
+    ThreadPolicy& ThreadPolicy::get()
+    {
+        static ThreadPolicy policy;
+        return policy;
+    }
+
+    U32 ThreadPolicy::cpus(Class cls)
+    {
+        FW_ASSERT(cls < CLASS_N, cls);
+        return s_cpus[cls];
+    }
+
+    I32 ThreadPolicy::priority(Class cls)
+    {
+        FW_ASSERT(cls < CLASS_N, cls);
+        return s_priority[cls];
+    }
+
+    bool ThreadPolicy::apply(Class cls, const char* name)
+    {
+        FW_ASSERT(cls < CLASS_N, cls);
+
+        I32 tid = static_cast<I32>(syscall(SYS_gettid));
+
+        char short_name[16];
+        strncpy(short_name, name, sizeof(short_name) - 1);
+        short_name[sizeof(short_name) - 1] = 0;
+        pthread_setname_np(pthread_self(), short_name);
+
+        // Cores missing on this machine are dropped by the kernel,
+        // a mask without any present core is rejected and the thread keeps its cores
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (U32 cpu = 0; cpu < 32; cpu++)
+        {
+            if (s_cpus[cls] & (1U << cpu))
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+
+        bool applied = sched_setaffinity(0, sizeof(set), &set) == 0;
+
+        sched_param param = {};
+        param.sched_priority = s_priority[cls];
+        applied &= sched_setscheduler(0, s_priority[cls] > 0 ? SCHED_FIFO : SCHED_OTHER, &param) == 0;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // Threads re-applying a policy keep their slot
+        Thread* slot = nullptr;
+        for (auto& thread : m_threads)
+        {
+            if (thread.tid == tid)
+            {
+                slot = &thread;
+                break;
+            }
+
+            if (!slot && thread.tid == 0)
+            {
+                slot = &thread;
+            }
+        }
+
+        // Telemetry is best effort, the policy is applied either way
+        if (slot)
+        {
+            slot->tid = tid;
+            memcpy(slot->name, short_name, sizeof(slot->name));
+            slot->cls = cls;
+            slot->applied = applied;
+            m_generation++;
+        }
+
+        return applied;
+    }
+
+    bool ThreadPolicy::thread(U32 index, Thread& thread)
+    {
+        FW_ASSERT(index < PARALLEL_THREAD_N, index);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        thread = m_threads[index];
+        return thread.tid != 0;
+    }
+
+    bool ThreadPolicy::usage(U32 index, Usage& usage)
+    {
+        FW_ASSERT(index < PARALLEL_THREAD_N, index);
+
+        I32 tid;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            tid = m_threads[index].tid;
+        }
+
+        if (tid == 0)
+        {
+            return false;
+        }
+
+        char path[64];
+        char line[512];
+        bool valid = false;
+
+        snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+        FILE* f = fopen(path, "r");
+        if (f)
+        {
+            // The name may hold spaces, fields are counted after it
+            if (fgets(line, sizeof(line), f))
+            {
+                const char* fields = strrchr(line, ')');
+                unsigned long utime = 0;
+                unsigned long stime = 0;
+                int processor = 0;
+
+                if (fields && sscanf(fields + 2,
+                                     "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                                     "%*d %*d %*d %*d %*d %*d %*u %*u %*d %*u %*u %*u %*u %*u "
+                                     "%*u %*u %*u %*u %*u %*u %*u %*u %*d %d",
+                                     &utime, &stime, &processor) == 3)
+                {
+                    static const U64 tick_us = 1000000 / sysconf(_SC_CLK_TCK);
+                    usage.cpu_us = (static_cast<U64>(utime) + stime) * tick_us;
+                    usage.cpu = processor;
+                    valid = true;
+                }
+            }
+
+            fclose(f);
+        }
+
+        snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+        f = fopen(path, "r");
+        if (f)
+        {
+            usage.voluntary = 0;
+            usage.involuntary = 0;
+            while (fgets(line, sizeof(line), f))
+            {
+                unsigned long long n;
+                if (sscanf(line, "voluntary_ctxt_switches: %llu", &n) == 1) usage.voluntary = n;
+                else if (sscanf(line, "nonvoluntary_ctxt_switches: %llu", &n) == 1) usage.involuntary = n;
+            }
+
+            fclose(f);
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            // The thread exited
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_threads[index].tid == tid)
+            {
+                m_threads[index].tid = 0;
+                m_generation++;
+            }
+        }
+
+        return valid;
+    }
+
+    U32 ThreadPolicy::generation()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_generation;
+    }
+}
@@ -0,0 +1,101 @@
+//
+// Created by tumbar on 4/16/23.
+//
+
+#ifndef STEREO_HELI_POLICY_HPP
+#define STEREO_HELI_POLICY_HPP
+
+#include <ParallelCfg.hpp>
+#include <Fw/Types/BasicTypes.hpp>
+
+#include <mutex>
+
+namespace libparallel
+{
+    /**
+     * Core affinity and scheduling of every thread class.
+     *
+     * Threads apply the policy of their class on themselves when they
+     * start. Cores and priorities come from ParallelCfg.hpp so the
+     * control path can be isolated from image processing. SCHED_FIFO
+     * needs CAP_SYS_NICE, threads without it keep SCHED_OTHER but are
+     * still pinned.
+     *
+     * Applying a policy also registers the thread so that its CPU time
+     * and context switches can be sampled from /proc.
+     */
+    class ThreadPolicy
+    {
+    public:
+        enum Class
+        {
+            CONTROL,
+            CAMERA,
+            VISION,
+            ENCODER,
+            GROUND,
+            CLASS_N
+        };
+
+        //! Registered thread
+        struct Thread
+        {
+            I32 tid;                //!< Kernel thread id, 0 if the slot is free
+            char name[16];
+            Class cls;
+            bool applied;           //!< Scheduling policy was accepted by the kernel
+        };
+
+        //! Usage counters of a thread since it started
+        struct Usage
+        {
+            U64 cpu_us;             //!< User and system CPU time
+            U64 voluntary;          //!< Context switches while blocking
+            U64 involuntary;        //!< Context switches from preemption
+            I32 cpu;                //!< Core the thread last ran on
+        };
+
+        static ThreadPolicy& get();
+
+        /**
+         * Pin the calling thread to the cores of its class and set its scheduling
+         * @param cls thread class
+         * @param name short thread name, also set as the kernel thread name
+         * @return false if the scheduling policy could not be applied
+         */
+        bool apply(Class cls, const char* name);
+
+        //! Cores of a thread class as a bit mask
+        static U32 cpus(Class cls);
+
+        //! Priority of a thread class, 0 is SCHED_OTHER
+        static I32 priority(Class cls);
+
+        /**
+         * Copy a registered thread
+         * @param index slot below PARALLEL_THREAD_N
+         * @return false if the slot is free
+         */
+        bool thread(U32 index, Thread& thread);
+
+        /**
+         * Read the usage counters of a registered thread
+         * Slots of threads that exited are freed
+         * @param index slot below PARALLEL_THREAD_N
+         * @return false if the slot is free
+         */
+        bool usage(U32 index, Usage& usage);
+
+        //! Changes every time a thread is registered or freed
+        U32 generation();
+
+    PRIVATE:
+        ThreadPolicy();
+
+        std::mutex m_mutex;
+        Thread m_threads[PARALLEL_THREAD_N];
+        U32 m_generation;
+    };
+}
+
+#endif //STEREO_HELI_POLICY_HPP
@@ -7,7 +7,9 @@
 
 enum
 {
-    CAMERA_BUFFER_N = 3,           //!< Internal libcamera buffers
+    CAMERA_BUFFER_N = 3,           //!< Default internal libcamera buffers
+    CAMERA_BUFFER_MAX_N = 8,       //!< Maximum buffer pool depth
+    CAMERA_SYNC_QUEUE_N = 2,       //!< Requests per eye waiting to be paired
 };
 
 #endif //STEREO_HELI_CAMCFG_HPP
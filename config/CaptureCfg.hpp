@@ -0,0 +1,16 @@
+//
+// Created by tumbar on 4/10/23.
+//
+
+#ifndef STEREO_HELI_CAPTURECFG_HPP
+#define STEREO_HELI_CAPTURECFG_HPP
+
+enum
+{
+    CAPTURE_QUEUE_MAX_N = 16,      //!< Maximum snapshots waiting to be written
+    CAPTURE_QUEUE_DEFAULT_N = 4,   //!< Snapshots waiting to be written unless configured
+    CAPTURE_BURST_MAX_N = 64,      //!< Maximum consecutive frames saved by one capture command
+    CAPTURE_TIMEOUT_MS = 3000,     //!< A capture fails if no frame could be queued for this long
+};
+
+#endif //STEREO_HELI_CAPTURECFG_HPP
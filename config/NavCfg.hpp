@@ -0,0 +1,39 @@
+//
+// Created by tumbar on 4/14/23.
+//
+
+#ifndef STEREO_HELI_NAVCFG_HPP
+#define STEREO_HELI_NAVCFG_HPP
+
+enum
+{
+    NAV_OCCUPANCY_XY_N = 64,       //!< Occupancy cells along each horizontal axis (power of two)
+    NAV_OCCUPANCY_Z_N = 16,        //!< Occupancy cells along the vertical axis (power of two)
+
+    // Log-odds in 1/16 units, saturated to keep the map responsive
+    NAV_OCCUPANCY_HIT = 14,        //!< Log-odds added to the cell holding a point
+    NAV_OCCUPANCY_MISS = -4,       //!< Log-odds added to cells a ray passes through
+    NAV_OCCUPANCY_MIN = -64,       //!< Most certain free cell
+    NAV_OCCUPANCY_MAX = 64,        //!< Most certain occupied cell
+    NAV_OCCUPANCY_OCCUPIED = 16,   //!< Cells above this are occupied
+    NAV_OCCUPANCY_FREE = -16,      //!< Cells below this are free
+
+    // Point clouds are copied out of the Vis arena and integrated on the Nav thread
+    NAV_CLOUD_BUFFER_N = 2,        //!< Point clouds queued for integration
+    NAV_CLOUD_POINT_MAX = 4096,    //!< Points per cloud, at least VIS_CLOUD_POINT_MAX
+
+    // Visual odometry front end, sized to keep up with the camera on the Pi
+    NAV_VO_TILE_W = 64,            //!< Keypoint detection tile width in pixels
+    NAV_VO_TILE_H = 48,            //!< Keypoint detection tile height in pixels
+    NAV_VO_TILE_KP_N = 4,          //!< Strongest keypoints kept per tile
+    NAV_VO_POINT_MAX = 400,        //!< Keypoints ranged and tracked per frame
+    NAV_VO_STEREO_WINDOW = 9,      //!< Sparse stereo window size in pixels (odd)
+    NAV_VO_MIN_DISPARITY = 1,      //!< Smallest disparity searched, farthest point ranged
+    NAV_VO_MAX_DISPARITY = 128,    //!< Largest disparity searched, nearest point ranged
+    NAV_VO_FLOW_WINDOW = 21,       //!< Optical flow window size in pixels
+    NAV_VO_FLOW_LEVELS = 3,        //!< Optical flow pyramid levels above the frame
+    NAV_VO_RANSAC_ITERATIONS = 64, //!< PnP hypotheses tested per frame
+    NAV_VO_MIN_INLIERS = 12,       //!< Inliers needed to accept a motion
+};
+
+#endif //STEREO_HELI_NAVCFG_HPP
@@ -0,0 +1,34 @@
+//
+// Created by tumbar on 4/15/23.
+//
+
+#ifndef STEREO_HELI_PARALLELCFG_HPP
+#define STEREO_HELI_PARALLELCFG_HPP
+
+enum
+{
+    PARALLEL_WORKER_N = 0,         //!< Shared pool workers, 0 uses one per hardware thread
+    PARALLEL_TASK_SIZE = 48,       //!< Bytes of captured state stored inline in a task
+    PARALLEL_DEQUE_N = 256,        //!< Tasks queued per worker (power of two)
+    PARALLEL_INJECT_N = 256,       //!< Tasks queued from outside the pool (power of two)
+    PARALLEL_SPIN_N = 64,          //!< Failed polls before a thread sleeps
+
+    PARALLEL_THREAD_N = 24,        //!< Threads tracked for usage telemetry (Threads.THREAD_N)
+
+    // Cores of each thread class as a bit mask (the Pi 4 has cores 0 to 3)
+    // Priority 0 runs under SCHED_OTHER, higher priorities under SCHED_FIFO
+    // Control owns core 0 and vision owns cores 2 and 3. Encoder and ground
+    // share core 1 with the camera and only run while it waits for a frame.
+    PARALLEL_CONTROL_CPUS = 0x1,   //!< Flight controller, state estimate and joystick
+    PARALLEL_CONTROL_PRIORITY = 50,
+    PARALLEL_CAMERA_CPUS = 0x2,    //!< Camera streaming
+    PARALLEL_CAMERA_PRIORITY = 40,
+    PARALLEL_VISION_CPUS = 0xC,    //!< Vis, Nav and the shared pool
+    PARALLEL_VISION_PRIORITY = 0,
+    PARALLEL_ENCODER_CPUS = 0x2,   //!< Video encoder and streamer
+    PARALLEL_ENCODER_PRIORITY = 0,
+    PARALLEL_GROUND_CPUS = 0x2,    //!< Captures written to disk and other ground I/O
+    PARALLEL_GROUND_PRIORITY = 0,
+};
+
+#endif //STEREO_HELI_PARALLELCFG_HPP
@@ -0,0 +1,17 @@
+//
+// Created by tumbar on 4/5/23.
+//
+
+#ifndef STEREO_HELI_TRACECFG_HPP
+#define STEREO_HELI_TRACECFG_HPP
+
+enum
+{
+    TRACE_PIPE_STAGE_N = 4,        //!< Frame pipeline stages traced (FramePipe.PIPELINE_N)
+    TRACE_VIS_STAGE_N = 8,         //!< Vision stages traced per frame
+    TRACE_WINDOW_N = 256,          //!< Frames used to compute latency percentiles
+    TRACE_HISTORY_N = 1024,        //!< Completed frame traces kept for dumping
+    TRACE_PUBLISH_PERIOD = 30,     //!< Frames between latency telemetry updates
+};
+
+#endif //STEREO_HELI_TRACECFG_HPP
@@ -0,0 +1,35 @@
+//
+// Created by tumbar on 4/7/23.
+//
+
+#ifndef STEREO_HELI_VISCFG_HPP
+#define STEREO_HELI_VISCFG_HPP
+
+enum
+{
+    VIS_STEREO_BAND_N = 4,         //!< Maximum stereo bands matched in parallel (one per core)
+    VIS_STEREO_SGBM_OVERLAP = 16,  //!< Extra band overlap rows for semi-global path aggregation
+
+    VIS_PIPELINE_DEPTH = 4,        //!< Frames in flight through the Vis stages at once
+
+    VIS_PROFILE_STAGE_N = 8,       //!< Stages timed by the profiler (Vis.PROFILE_STAGE_N)
+    VIS_PROFILE_WINDOW_N = 128,    //!< Frames used for stage timing statistics
+    VIS_PROFILE_PUBLISH_PERIOD = 30,   //!< Frames between stage timing telemetry updates
+
+    VIS_STEREO_SEED_REFRESH = 15,  //!< Frames between full disparity searches of a seeded band
+    VIS_STEREO_SEED_VALID = 50,    //!< Minimum percentage of valid pixels to seed from a band
+    VIS_STEREO_SEED_TRIM = 2,      //!< Percentage of outliers ignored at each end of the seed range
+
+    VIS_STEREO_PYRAMID_LEVEL_MAX = 3,  //!< Deepest pyramid level of the coarse stereo match (1/8 scale)
+
+    VIS_SPARSE_ROI_N = 8,          //!< Regions sampled by the sparse stereo stage
+    VIS_SPARSE_POINT_MAX = 4096,   //!< Samples matched by the sparse stereo stage per frame
+
+    VIS_STIXEL_N = 80,             //!< Column bins of the stixel stage (Nav.STIXEL_N)
+
+    VIS_CLOUD_POINT_MAX = 4096,    //!< Voxels kept by the point cloud stage per frame
+    VIS_CLOUD_BUCKET_N = 8192,     //!< Voxel hash buckets (power of two, above VIS_CLOUD_POINT_MAX)
+    VIS_CLOUD_PROBE_N = 8,         //!< Buckets probed before a voxel is dropped
+};
+
+#endif //STEREO_HELI_VISCFG_HPP